@@ -24,40 +24,63 @@ buffer_create(size_t size)
 }
 
 /**
- * Shrink the buffer.
+ * Consume n bytes of string.
  *
- * Move string to starting point of buffer.
+ * It's a pointer bump, except that an empty buffer is rewound to its start for
+ * free.
  */
 void
-buffer_shrink(struct buffer *buf)
+buffer_consume(struct buffer *buf, size_t n)
 {
-    memmove(buf->start, buf->pos, buf->last - buf->pos);
-    buf->last = buf->start + (buf->last - buf->pos);
-    buf->pos = buf->start;
+    buf->pos += n;
+    if (buf->pos == buf->last) {
+        buf->pos = buf->start;
+        buf->last = buf->start;
+    }
 }
 
 /**
- * Grow buffer extra size.
+ * Make sure at least n bytes are available at the end of the buffer.
+ *
+ * String is moved to starting point of buffer if it makes enough room and
+ * fills at most half of the buffer, the buffer is grown otherwise. So bytes
+ * moved are bounded by bytes appended, the cost is amortized.
+ *
+ * Returns 0 on success, -1 if out of memory.
  */
 int
-buffer_grow(struct buffer *buf, size_t extra)
+buffer_reserve(struct buffer *buf, size_t n)
 {
-    if (extra <= 0)
-        return 0;
-
-    size_t size = buffer_capacity(buf) + extra;
+    size_t size = buffer_size(buf);
 
-    size_t pos_off = buf->pos - buf->start;
-    size_t last_off = buf->last - buf->start;
-        
-    buf->start = realloc(buf->start, size);
-    if (buf->start == NULL)
-        return -1;
-
-    buf->pos = buf->start + pos_off;
-    buf->last = buf->start + last_off;
-    buf->end = buf->start + size;
+    if ((size_t)buffer_available(buf) >= n)
+        return 0;
 
+    if (size <= (size_t)buffer_capacity(buf) / 2 &&
+        (size_t)buffer_capacity(buf) - size >= n) {
+        memmove(buf->start, buf->pos, size);
+    } else {
+        size_t capacity = buffer_capacity(buf) * 2;
+        char *start;
+        if (capacity < size + n)
+            capacity = size + n;
+        if (buf->pos != buf->start) {
+            // Only live data is worth copying.
+            start = malloc(capacity);
+            if (start == NULL)
+                return -1;
+            memcpy(start, buf->pos, size);
+            free(buf->start);
+        } else {
+            start = realloc(buf->start, capacity);
+            if (start == NULL)
+                return -1;
+        }
+        buf->start = start;
+        buf->end = start + capacity;
+    }
+    buf->pos = buf->start;
+    buf->last = buf->start + size;
     return 0;
 }
 
@@ -2,6 +2,10 @@
 #define BUFFER_H
 /**
  * String Buffer.
+ *
+ * Data is consumed from pos and appended at last. Consuming only moves pos,
+ * the data is moved back to start lazily, when there is not enough room left
+ * at the end (see buffer_reserve).
  */
 
 #include <stdlib.h>
@@ -19,8 +23,8 @@ struct buffer {
 #define buffer_capacity(buf)  (buf->end - buf->start)
 
 struct buffer *buffer_create(size_t size);
-void buffer_shrink(struct buffer *buf);
-int buffer_grow(struct buffer *buf, size_t extra);
+void buffer_consume(struct buffer *buf, size_t n);
+int buffer_reserve(struct buffer *buf, size_t n);
 void buffer_delete(struct buffer *buf);
 
 #endif
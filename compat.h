@@ -3,6 +3,52 @@
 
 #if defined(__linux__)
 #define _GNU_SOURCE
+#define HAVE_EPOLL
+#define HAVE_PPOLL
+#define HAVE_ACCEPT4
+#define HAVE_MEMMEM
+#define HAVE_RECVMMSG
+#define HAVE_SENDMMSG
+#define HAVE_SENDFILE
+#define HAVE_SPLICE
+#define HAVE_ZEROCOPY
+#define HAVE_SCHED_AFFINITY
+#define HAVE_REUSEPORT_CBPF
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
 #endif
+#endif
+#endif
+
+#include <lua.h>
+
+/* Continuation function passed to lua_yieldk(). */
+#if LUA_VERSION_NUM == 502
+#define LUA_KFUNCTION(name) static int name(lua_State *L)
+#else
+#define LUA_KFUNCTION(name) \
+    static int name(lua_State *L, int status, lua_KContext ctx)
+#endif
+
+/* Whether the running coroutine can yield. */
+#if LUA_VERSION_NUM == 502
+#define compat_isyieldable(L) 1
+#else
+#define compat_isyieldable(L) lua_isyieldable(L)
+#endif
+
+/* lua_resume() returning the number of values yielded or returned. */
+static inline int
+compat_resume(lua_State *L, lua_State *from, int nargs, int *nresults)
+{
+#if LUA_VERSION_NUM >= 504
+    return lua_resume(L, from, nargs, nresults);
+#else
+    int status = lua_resume(L, from, nargs);
+    *nresults = lua_gettop(L);
+    return status;
+#endif
+}
 
 #endif
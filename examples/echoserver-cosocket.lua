@@ -0,0 +1,44 @@
+#!/usr/bin/env lua
+local socket = require "ssocket"
+
+HOST = '127.0.0.1'
+PORT = 12345
+tcpsock = socket.tcp()
+local ok, err = tcpsock:bind(HOST, PORT)
+if err then
+  print(err)
+  os.exit()
+end
+tcpsock:listen(128)
+
+addr, err = tcpsock:getsockname()
+print(string.format("Listening on %s:%d...", addr[1], addr[2]))
+print("")
+
+-- Each connection is served by its own coroutine, blocking socket operations
+-- yield to the scheduler.
+function handler(conn)
+  local reader = conn:readuntil("\n")
+  while true do
+    local data, err = reader()
+    if err then
+      print(string.format("[%d] %s, exit.", conn:fileno(), err))
+      break
+    end
+    conn:write(data .. "\n")
+  end
+  conn:close()
+end
+
+socket.spawn(function()
+  while true do
+    local conn, err = tcpsock:accept()
+    if err then
+      print(err)
+      break
+    end
+    socket.spawn(handler, conn)
+  end
+end)
+
+socket.run()
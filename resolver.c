@@ -0,0 +1,339 @@
+#include "compat.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include "timeout.h"
+#include "resolver.h"
+
+#define RESOLVER_BUCKETS    256     /* hash buckets, a power of 2 */
+#define RESOLVER_MAXENTRIES 4096    /* expired entries are dropped above it */
+#define RESOLVER_THREADS    4       /* max helper threads */
+#define RESOLVER_TTL        (60 * TIMEOUT_NSEC)
+#define RESOLVER_NEGTTL     (5 * TIMEOUT_NSEC)
+
+struct entry {
+    struct entry *next;             /* hash chain */
+    struct entry *qnext;            /* queue of entries to resolve */
+    char *name;
+    int family;
+    int pending;                    /* being resolved */
+    int pinned;                     /* set by resolver_sethost, never expires */
+    int64_t delay;                  /* of the answers to a pinned name */
+    int64_t expires;
+    struct resolver_result result;
+    int *waiters;                   /* write end of the pipes to notify */
+    int nwaiters;
+    int capwaiters;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static struct entry *buckets[RESOLVER_BUCKETS];
+static int nentries;
+static struct entry *queue_head, *queue_tail;
+static int nthreads;                /* helper threads started */
+static int nidle;                   /* helper threads waiting for work */
+static int64_t ttl = RESOLVER_TTL;
+static int64_t negative_ttl = RESOLVER_NEGTTL;
+
+/**
+ * FNV-1a hash of the name and family.
+ */
+static unsigned
+__hash(const char *name, int family)
+{
+    unsigned h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    h ^= (unsigned)family;
+    h *= 16777619u;
+    return h & (RESOLVER_BUCKETS - 1);
+}
+
+static void
+__entry_free(struct entry *e)
+{
+    free(e->waiters);
+    free(e->name);
+    free(e);
+}
+
+/**
+ * Drop expired entries, when the cache grows too large.
+ */
+static void
+__sweep(int64_t now)
+{
+    int i;
+    for (i = 0; i < RESOLVER_BUCKETS; i++) {
+        struct entry **p = &buckets[i];
+        while (*p) {
+            struct entry *e = *p;
+            if (!e->pending && !e->pinned && e->expires <= now) {
+                *p = e->next;
+                __entry_free(e);
+                nentries--;
+            } else {
+                p = &e->next;
+            }
+        }
+    }
+}
+
+/**
+ * Resolve e->name, the entry stays pending so it is not freed meanwhile.
+ */
+static void
+__resolve(struct entry *e)
+{
+    struct addrinfo hints, *res, *ai;
+    struct resolver_result *r = &e->result;
+    int64_t delay;
+    int err, syserror;
+
+    pthread_mutex_lock(&lock);
+    delay = e->pinned ? e->delay : 0;
+    pthread_mutex_unlock(&lock);
+    if (delay > 0) {
+        // A pinned name answering slowly, there is nothing to resolve.
+        struct timespec ts;
+        timeout_timespec(delay, &ts);
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+            ;
+        pthread_mutex_lock(&lock);
+        goto done;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = e->family;
+    // One entry per address, instead of one per socket type.
+    hints.ai_socktype = SOCK_STREAM;
+    err = getaddrinfo(e->name, NULL, &hints, &res);
+    syserror = err == EAI_SYSTEM ? errno : 0;
+
+    pthread_mutex_lock(&lock);
+    if (e->pinned) {
+        // Pinned meanwhile, the result is discarded.
+        if (err == 0)
+            freeaddrinfo(res);
+        err = -1;
+    } else {
+        r->error = err;
+        r->syserror = syserror;
+        r->naddrs = 0;
+    }
+    if (err == 0) {
+        for (ai = res; ai && r->naddrs < RESOLVER_MAXADDRS; ai = ai->ai_next) {
+            if (ai->ai_addrlen > sizeof(r->addrs[0]))
+                continue;
+            memcpy(&r->addrs[r->naddrs], ai->ai_addr, ai->ai_addrlen);
+            r->addrlens[r->naddrs] = ai->ai_addrlen;
+            r->naddrs++;
+        }
+        freeaddrinfo(res);
+    }
+    if (!e->pinned)
+        e->expires = timeout_gettime() + (err == 0 ? ttl : negative_ttl);
+done:
+    e->pending = 0;
+    while (e->nwaiters > 0) {
+        int fd = e->waiters[--e->nwaiters];
+        // The waiter may be gone, the pipe is then broken.
+        write(fd, "", 1);
+        close(fd);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void *
+__helper(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    while (1) {
+        struct entry *e;
+        while (queue_head == NULL) {
+            nidle++;
+            pthread_cond_wait(&queued, &lock);
+            nidle--;
+        }
+        e = queue_head;
+        queue_head = e->qnext;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+        pthread_mutex_unlock(&lock);
+        __resolve(e);
+        pthread_mutex_lock(&lock);
+    }
+    return NULL;
+}
+
+/**
+ * Queue e to be resolved by a helper thread, starting one if none is idle.
+ *
+ * Returns 0 on success, -1 on error with errno set.
+ */
+static int
+__enqueue(struct entry *e)
+{
+    e->pending = 1;
+    e->qnext = NULL;
+    if (queue_tail)
+        queue_tail->qnext = e;
+    else
+        queue_head = e;
+    queue_tail = e;
+
+    if (nidle == 0 && nthreads < RESOLVER_THREADS) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        int err;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        err = pthread_create(&thread, &attr, __helper, NULL);
+        pthread_attr_destroy(&attr);
+        if (err == 0) {
+            nthreads++;
+        } else if (nthreads == 0) {
+            // Nobody would ever resolve it.
+            queue_head = queue_tail = NULL;
+            e->pending = 0;
+            errno = err;
+            return -1;
+        }
+    }
+    pthread_cond_signal(&queued);
+    return 0;
+}
+
+/**
+ * Returns the entry of name for family, created if there is none, or NULL on
+ * error with errno set. The lock is held.
+ */
+static struct entry *
+__entry_get(const char *name, int family, int64_t now)
+{
+    unsigned h = __hash(name, family);
+    struct entry *e;
+
+    for (e = buckets[h]; e; e = e->next) {
+        if (e->family == family && !strcmp(e->name, name))
+            return e;
+    }
+    if (nentries >= RESOLVER_MAXENTRIES)
+        __sweep(now);
+    e = (struct entry *)calloc(1, sizeof(struct entry));
+    if (e == NULL || (e->name = strdup(name)) == NULL) {
+        free(e);
+        errno = ENOMEM;
+        return NULL;
+    }
+    e->family = family;
+    e->next = buckets[h];
+    buckets[h] = e;
+    nentries++;
+    return e;
+}
+
+void
+resolver_setttl(int64_t positive, int64_t negative)
+{
+    pthread_mutex_lock(&lock);
+    if (positive >= 0)
+        ttl = positive;
+    if (negative >= 0)
+        negative_ttl = negative;
+    pthread_mutex_unlock(&lock);
+}
+
+int
+resolver_sethost(const char *name, const struct resolver_result *result, int64_t delay)
+{
+    static const int families[] = {AF_UNSPEC, AF_INET, AF_INET6};
+    int64_t now = timeout_gettime();
+    int i, j;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < 3; i++) {
+        struct entry *e = __entry_get(name, families[i], now);
+        struct resolver_result *r;
+        if (e == NULL) {
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+        if (result == NULL) {
+            // Resolved again by the next lookup.
+            e->pinned = 0;
+            e->expires = 0;
+            continue;
+        }
+        // The addresses of the family only.
+        r = &e->result;
+        r->naddrs = 0;
+        for (j = 0; j < result->naddrs; j++) {
+            if (families[i] != AF_UNSPEC && result->addrs[j].ss_family != families[i])
+                continue;
+            memcpy(&r->addrs[r->naddrs], &result->addrs[j], result->addrlens[j]);
+            r->addrlens[r->naddrs] = result->addrlens[j];
+            r->naddrs++;
+        }
+        r->error = r->naddrs > 0 ? 0 : EAI_NONAME;
+        r->syserror = 0;
+        e->pinned = 1;
+        e->delay = delay;
+    }
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+int
+resolver_lookup(const char *name, int family, int stale, struct resolver_result *result, int *fd)
+{
+    int64_t now = timeout_gettime();
+    struct entry *e;
+    int pipefd[2];
+
+    pthread_mutex_lock(&lock);
+    e = __entry_get(name, family, now);
+    if (e == NULL)
+        goto err;
+    if (!e->pending && (stale || (e->pinned ? e->delay <= 0 : e->expires > now))) {
+        memcpy(result, &e->result, sizeof(*result));
+        pthread_mutex_unlock(&lock);
+        return 1;
+    }
+
+    if (e->nwaiters == e->capwaiters) {
+        int cap = e->capwaiters ? e->capwaiters * 2 : 4;
+        int *waiters = (int *)realloc(e->waiters, cap * sizeof(int));
+        if (waiters == NULL) {
+            errno = ENOMEM;
+            goto err;
+        }
+        e->waiters = waiters;
+        e->capwaiters = cap;
+    }
+    if (pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) == -1)
+        goto err;
+    // Resolutions of the same name are shared.
+    if (!e->pending && __enqueue(e) == -1) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        goto err;
+    }
+    e->waiters[e->nwaiters++] = pipefd[1];
+    pthread_mutex_unlock(&lock);
+    *fd = pipefd[0];
+    return 0;
+
+err:
+    pthread_mutex_unlock(&lock);
+    return -1;
+}
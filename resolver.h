@@ -0,0 +1,59 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+/**
+ * Asynchronous name resolution with a cache.
+ *
+ * getaddrinfo() is called by helper threads, so the calling thread only waits
+ * on a pipe, which fits in an event loop. Results, successful or not, are
+ * cached by name and family for a configurable time, as getaddrinfo() does
+ * not tell the TTL of the records. The cache is shared by all the threads of
+ * the process.
+ */
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define RESOLVER_MAXADDRS   8       /* addresses kept per name */
+
+struct resolver_result {
+    int error;                      /* getaddrinfo() error, 0 on success */
+    int syserror;                   /* errno, if error is EAI_SYSTEM */
+    int naddrs;
+    struct sockaddr_storage addrs[RESOLVER_MAXADDRS];
+    socklen_t addrlens[RESOLVER_MAXADDRS];
+};
+
+/*
+ * Set the time results are cached, in nanoseconds, for successful and failed
+ * resolutions. 0 disables caching, only concurrent resolutions of a name are
+ * then shared. A negative time leaves it unchanged.
+ */
+void resolver_setttl(int64_t ttl, int64_t negative_ttl);
+
+/*
+ * Pin name to the addresses of result, which are then used instead of
+ * resolving it, as if it were in the hosts file. A lookup for AF_INET or
+ * AF_INET6 gets the addresses of that family. If delay is positive, they are
+ * only returned delay nanoseconds after each lookup, as by a slow name server.
+ * result NULL unpins name.
+ *
+ * Returns 0 on success, -1 on error with errno set.
+ */
+int resolver_sethost(const char *name, const struct resolver_result *result, int64_t delay);
+
+/*
+ * Look up name for family (AF_INET, AF_INET6 or AF_UNSPEC).
+ *
+ * Returns 1 if a result is cached, and copies it to result. Expired results
+ * are accepted if stale is not 0, which is used to get the result of a
+ * resolution waited for.
+ *
+ * Otherwise, the name is resolved in the background and 0 is returned. *fd is
+ * then the read end of a pipe which becomes readable once done, to be closed by
+ * the caller, which looks the name up again.
+ *
+ * Returns -1 on error, with errno set.
+ */
+int resolver_lookup(const char *name, int family, int stale, struct resolver_result *result, int *fd);
+
+#endif
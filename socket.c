@@ -2,12 +2,15 @@
 
 #include <lua.h>
 #include <lauxlib.h>
+#include <lualib.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <stddef.h>
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -15,39 +18,240 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <netdb.h>
 #include <poll.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#endif
+#include <sys/stat.h>
+#ifdef HAVE_SCHED_AFFINITY
+#include <sched.h>
+#endif
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_ZEROCOPY
+#include <linux/errqueue.h>
+#if !defined(SO_ZEROCOPY) || !defined(MSG_ZEROCOPY)
+#undef HAVE_ZEROCOPY
+#endif
+#endif
+#ifdef HAVE_REUSEPORT_CBPF
+#include <linux/filter.h>
+#endif
 #include "timeout.h"
+#include "timer.h"
 #include "buffer.h"
+#include "resolver.h"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
 
 #define _VERSION "0.0.1"
 
 #define TCPSOCK_TYPENAME     "TCPSOCKET*"
 #define UDPSOCK_TYPENAME     "UDPSOCKET*"
+#define POLLER_TYPENAME      "POLLER*"
+#define SCHEDULER_TYPENAME   "SCHEDULER*"
+#define URING_TYPENAME       "URING*"
+#define BYTES_TYPENAME       "BYTES*"
+#define RELAY_TYPENAME       "RELAY*"
+#define CONNRACE_TYPENAME    "CONNRACE*"
+#define POOL_TYPENAME        "POOL*"
+#define CONNMANY_TYPENAME    "CONNMANY*"
+#define FILEXFER_TYPENAME    "FILEXFER*"
+#define ZCLINGER_TYPENAME    "ZCLINGER*"
 
 /* Socket address */
 typedef union {
   struct sockaddr sa;
   struct sockaddr_in in;
+  struct sockaddr_in6 in6;
   struct sockaddr_un un;
 } sockaddr_t;
 
 /* Convert "sockaddr_t" to "struct sockaddr *". */
 #define SAS2SA(x) (&((x)->sa))
 
+/* Message header of recvmmsg()/sendmmsg(), emulated with recvmsg()/sendmsg()
+ * if not available */
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+typedef struct mmsghdr mmsghdr_t;
+#else
+typedef struct {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+} mmsghdr_t;
+#endif
+
+/* Message vectors used by recvmany/sendmany, kept by the socket between calls */
+struct msgslab {
+    unsigned int count;         /* capacity, in messages */
+    size_t size;                /* capacity of each message, in bytes */
+    mmsghdr_t *msgs;
+    sockaddr_t *addrs;
+    struct iovec *iov;
+    char *data;                 /* count * size bytes */
+};
+
+/* Data of a write pinned until its zerocopy sends complete */
+struct zcpin {
+    uint32_t lo;                /* id of the first send */
+    uint32_t hi;                /* id past the last send, once sealed */
+    uint32_t done;              /* sends completed */
+    int open;                   /* write in progress, not sealed yet */
+    int ref;                    /* reference to the data in the registry */
+};
+
+/* MSG_ZEROCOPY state of a socket, see setzerocopy */
+struct zerocopy {
+    size_t threshold;           /* writes of at least threshold bytes use it */
+    uint32_t next;              /* id of the next zerocopy send */
+    size_t npins;
+    size_t cap;
+    struct zcpin *pins;         /* oldest first */
+};
+
+/* Sockets closed while the kernel still reads data they pinned */
+struct zclinger {
+    int closed;                 /* collected with the Lua state */
+    size_t n;
+    size_t cap;
+    struct zclingering {
+        int fd;
+        struct zerocopy *zc;
+    } *socks;
+};
+
+/* Worker thread, see socket.workers() */
+struct worker {
+    int id;                     /* starts from 1 */
+    int cpu;                    /* CPU it is pinned to, -1 if not pinned */
+    lua_State *L;               /* Lua state of the worker */
+    pthread_t thread;
+    int listenfd;
+    char *error;                /* error raised by the script */
+    /* stats, only updated by the worker thread */
+    uint64_t accepted;          /* connections accepted */
+    uint64_t received;          /* bytes received */
+    uint64_t sent;              /* bytes sent */
+};
+
 /* Socket Object */
 struct sockobj {
     int fd;
     int sock_family;
+    int sock_flags;             /* options set before the socket is created */
+    unsigned int sock_opts;     /* sockopts set on the socket, by index */
+    int gso_size;               /* UDP_SEGMENT size, 0 if disabled */
     double sock_timeout;        /* in seconds */
     struct buffer *buf;         /* used for buffer reading */
+    struct buffer *wbuf;        /* used for buffer writing, see setwritebuffer */
+    size_t wbuf_size;           /* high watermark of wbuf, 0 if disabled */
+    struct msgslab *slab;       /* used by recvmany/sendmany, NULL until then */
+    struct zerocopy *zc;        /* used by setzerocopy, NULL until then */
+    double idle_timeout;        /* in seconds, <= 0 if disabled */
+    int64_t last_active;        /* time of the last I/O activity */
+    struct timer idle;          /* idle timer, in the wheel of the scheduler */
+    struct worker *worker;      /* worker thread owning it, NULL if none */
+    char *pool;                 /* keepalive pool, set by connect */
+};
+
+/* Mutable byte buffer, filled in place by readinto/recvinto */
+struct bytesobj {
+    size_t size;                /* capacity */
+    size_t len;                 /* bytes filled */
+    char data[];
 };
 
+#define getbytesobj(L, idx) ((struct bytesobj *)luaL_checkudata(L, idx, BYTES_TYPENAME))
+
+/* sock_flags */
+#define SOCKOBJ_REUSEADDR   0x1
+#define SOCKOBJ_REUSEPORT   0x2
+#define SOCKOBJ_GRO         0x4
+#define SOCKOBJ_CORK        0x8     /* TCP_CORK set by the user */
+#define SOCKOBJ_MORE        0x10    /* last send had MSG_MORE */
+#define SOCKOBJ_FASTOPEN    0x20    /* connect is sending its first payload */
+#define SOCKOBJ_SYNDATA     0x40    /* which went in the SYN, see connect */
+#define SOCKOBJ_HANDSHAKE   0x80    /* waiting to know if the server took it */
+
 #define getsockobj(L) ((struct sockobj *)lua_touserdata(L, 1));
+
+/* Poller Object */
+struct pollerobj {
+    int epfd;
+#ifdef HAVE_EPOLL
+    int nevents;                    /* capacity of events */
+    struct epoll_event *events;     /* used for receiving ready events */
+#endif
+};
+
+#define getpollerobj(L) ((struct pollerobj *)luaL_checkudata(L, 1, POLLER_TYPENAME))
+
+#define POLLER_NEVENTS  64
+
+/* Coroutine managed by the scheduler (cosocket mode) */
+struct task {
+    lua_State *co;              /* the coroutine */
+    int ref;                    /* reference of the coroutine in registry */
+    int nargs;                  /* number of arguments of the first resume */
+    int parked;                 /* waiting for an event or a deadline */
+    int woken;                  /* woken up by readiness of the fd */
+    int fd;                     /* fd waited on, -1 if none */
+    struct timer timer;         /* time to wake up, if pending */
+    int suspended;              /* a socket operation is suspended */
+    struct timeout tm;          /* timeout of the suspended operation */
+    size_t progress;            /* progress of the suspended operation */
+    int resolvefd;              /* pipe of a suspended name resolution, or -1 */
+    struct task *next;          /* run queue link */
+    struct task *prev, *succ;   /* list of all tasks */
+};
+
+/* Tasks waiting on a fd */
+struct fdwaiters {
+    struct task *reader;
+    struct task *writer;
+    int registered;             /* events registered in epoll */
+};
+
+/* Scheduler, one per Lua state, created by the first socket.spawn() */
+struct scheduler {
+    int epfd;
+    int running;
+    int ntasks;
+    struct task *current;       /* task being resumed */
+    struct task *runq_head;     /* tasks ready to run */
+    struct task *runq_tail;
+    struct timerwheel wheel;    /* task deadlines and idle sockets */
+    struct task *tasks;         /* all tasks */
+    struct fdwaiters *fds;      /* indexed by fd */
+    int nfds;
+    int64_t now;                /* clock cached once per loop iteration */
+};
+
+#define SCHED_NEVENTS   256
+
+/* Kinds of timers in the wheel, ticks are microseconds */
+#define TIMER_TASK      0   /* data is a struct task */
+#define TIMER_IDLE      1   /* data is a struct sockobj */
+
+/* Execution backends, selected at module load by SSOCKET_BACKEND */
+#define BACKEND_POLL        "poll"
+#define BACKEND_IO_URING    "io_uring"
+
+#define URING_ENTRIES   64
+
+#define CPU_SETSIZE_MAX 1024    /* max number of CPUs used by workers */
 #define CHECK_ERRNO(expected)   (errno == expected)
 
 /* Custom socket error strings */
@@ -59,8 +263,44 @@ struct sockobj {
 #define OPT_TCP_NODELAY   "tcp_nodelay"
 #define OPT_TCP_KEEPALIVE "tcp_keepalive"
 #define OPT_TCP_REUSEADDR "tcp_reuseaddr"
+#define OPT_TCP_REUSEPORT "tcp_reuseport"
+#define OPT_TCP_CORK      "tcp_cork"
+#define OPT_UDP_SEGMENT   "udp_segment"
+#define OPT_UDP_GRO       "udp_gro"
+#define OPT_TCP_QUICKACK        "tcp_quickack"
+#define OPT_TCP_NOTSENT_LOWAT   "tcp_notsent_lowat"
+#define OPT_TCP_DEFER_ACCEPT    "tcp_defer_accept"
+#define OPT_TCP_USER_TIMEOUT    "tcp_user_timeout"
+#define OPT_SO_RCVBUF           "so_rcvbuf"
+#define OPT_SO_SNDBUF           "so_sndbuf"
+#define OPT_SO_REUSEPORT        "so_reuseport"
+#define OPT_SO_BUSY_POLL        "so_busy_poll"
+#define OPT_SO_PRIORITY         "so_priority"
+#define OPT_IP_TOS              "ip_tos"
 
 #define RECV_BUFSIZE 8192
+#define ACCEPTMANY_MAX 64
+#define MMSG_MAX 1024           /* max messages per recvmany/sendmany call */
+#define DATAGRAM_MAX 65536      /* max bytes per datagram */
+#define IOV_INLINE 16           /* buffers of a write kept on the C stack */
+#define SENDFILE_CHUNK 65536    /* bytes per pread() without sendfile() */
+#define RELAY_BUFSIZE 65536     /* bytes moved per splice() by socket.relay */
+#define READTOFILE_CHUNK 65536  /* bytes per recv() without splice() */
+#define CONNECT_DELAY 0.25      /* seconds before racing the next address */
+#define POOL_SIZE 30            /* default connections per keepalive pool */
+#define POOL_TIMEOUT 60         /* default idle seconds of a pooled connection */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+/* Events */
+#define EVENT_NONE      0
+#define EVENT_READABLE  POLLIN
+#define EVENT_WRITABLE  POLLOUT
+#define EVENT_ANY       (POLLIN | POLLOUT)
 
 /**
  * Function to perform the setting of socket blocking mode.
@@ -77,409 +317,4253 @@ __setblocking(int fd, int block)
     fcntl(fd, F_SETFL, flags);
 }
 
+#ifdef HAVE_EPOLL
+#ifdef SYS_epoll_pwait2
+static pthread_once_t pwait2_once = PTHREAD_ONCE_INIT;
+static int nopwait2;        /* epoll_pwait2 is not supported by the kernel */
+
+/**
+ * Probe epoll_pwait2 once for all the threads: an invalid call fails with
+ * ENOSYS only if the kernel does not have it.
+ */
+static void
+__epoll_probepwait2(void)
+{
+    nopwait2 = syscall(SYS_epoll_pwait2, -1, NULL, 0, NULL, NULL, 0) == -1 && CHECK_ERRNO(ENOSYS);
+}
+#endif
+
 /**
- * Do a event polling on the socket, if necessary (sock_timeout > 0).
+ * epoll_wait(2) with a timeout in nanoseconds (negative means no timeout).
  *
- * Returns:
- *  1   on timeout
- *  -1  on error
- *  0   success
+ * Uses epoll_pwait2(2) if the kernel has it, falls back to epoll_wait(2) with
+ * the timeout rounded up to milliseconds.
  */
-#define EVENT_NONE      0
-#define EVENT_READABLE  POLLIN
-#define EVENT_WRITABLE  POLLOUT
-#define EVENT_ANY       (POLLIN | POLLOUT)
 static int
-__waitfd(struct sockobj *s, int event, struct timeout *tm)
+__epoll_wait(int epfd, struct epoll_event *events, int maxevents, int64_t timeout)
 {
-    int ret;
+#ifdef SYS_epoll_pwait2
+    pthread_once(&pwait2_once, __epoll_probepwait2);
+    if (!nopwait2) {
+        struct {
+            long long tv_sec;
+            long long tv_nsec;
+        } ts;               /* struct __kernel_timespec */
+        ts.tv_sec = timeout / TIMEOUT_NSEC;
+        ts.tv_nsec = timeout % TIMEOUT_NSEC;
+        return syscall(SYS_epoll_pwait2, epfd, events, maxevents,
+                       timeout >= 0 ? &ts : NULL, NULL, 0);
+    }
+#endif
+    return epoll_wait(epfd, events, maxevents, timeout_ms(timeout));
+}
+#endif
 
-    // Nothing to do if socket is closed.
-    if (s->fd < 0)
-        return 0;
+/**
+ * Accept a connection on a listening socket. The new socket is non-blocking
+ * and close-on-exec (atomically where accept4(2) is available).
+ */
+static int
+__accept(int fd)
+{
+#ifdef HAVE_ACCEPT4
+    return accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int clientfd = accept(fd, NULL, NULL);
+    if (clientfd != -1) {
+        __setblocking(clientfd, 0);
+        fcntl(clientfd, F_SETFD, FD_CLOEXEC);
+    }
+    return clientfd;
+#endif
+}
 
-    struct pollfd pollfd;
-    pollfd.fd = s->fd;
-    pollfd.events = event;
+/*** Cosocket scheduler ***/
 
-    do {
-        // Handling this condition here simplifies the loops.
-        double left = timeout_left(tm);
-        if (left == 0.0)
-            return 1;
-        int timeout = (int)(left * 1e3);
-        ret = poll(&pollfd, 1, timeout >= 0 ? timeout : -1);
-    } while (ret == -1 && CHECK_ERRNO(EINTR));
+static char scheduler_key;  /* registry key of the scheduler */
+static char worker_key;     /* registry key of the worker of a Lua state */
 
-    if (ret < 0) {
-        return -1;
-    } else if (ret == 0) {
-        return 1;
-    } else {
-        return 0;
-    }
+static struct scheduler *
+__sched_get(lua_State *L)
+{
+    struct scheduler *sched;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &scheduler_key);
+    sched = (struct scheduler *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return sched;
 }
 
-int
-__select(int nfds, fd_set * readfds, fd_set * writefds, fd_set * errorfds,
-         struct timeout *tm)
+/**
+ * Returns the running task if L is a coroutine managed by the scheduler,
+ * NULL otherwise (socket operations block as usual).
+ */
+static struct task *
+__sched_task(lua_State *L, struct scheduler **sched_ret)
 {
-    int ret;
-    do {
-        struct timeval tv = { 0, 0 };
-        double t = timeout_left(tm);
-        if (t >= 0) {
-            tv.tv_sec = (int)t;
-            tv.tv_usec = (int)((t - tv.tv_sec) * 1.0e6);
-        }
-
-        ret = select(nfds, readfds, writefds, errorfds, (t >= 0) ? &tv : NULL);
-    } while (ret < 0 && errno == EINTR);
-    return ret;
+    struct scheduler *sched = __sched_get(L);
+    if (sched_ret)
+        *sched_ret = sched;
+    if (sched && sched->current && sched->current->co == L)
+        return sched->current;
+    return NULL;
 }
 
 /**
- * Get the address length according to the socket object's address family.
- * Return 1 if the family is known, 0 otherwise. The length is returned through
- * len_ret.
+ * Returns the clock cached by the scheduler if it is running, -1 otherwise
+ * (see timeout_left).
  */
-static int
-__getsockaddrlen(struct sockobj *s, socklen_t * len_ret)
+static int64_t
+__sched_clock(lua_State *L)
 {
-    switch (s->sock_family) {
-    case AF_UNIX:
-        *len_ret = sizeof(struct sockaddr_un);
-        return 1;
-    case AF_INET:
-        *len_ret = sizeof(struct sockaddr_in);
-        return 1;
-    case AF_INET6:
-        *len_ret = sizeof(struct sockaddr_in6);
-        return 1;
-    default:
-        return 0;
+    struct scheduler *sched = __sched_get(L);
+    if (sched && sched->running)
+        return sched->now;
+    return -1;
+}
+
+static void
+__sched_ready(struct scheduler *sched, struct task *t)
+{
+    t->next = NULL;
+    if (sched->runq_tail) {
+        sched->runq_tail->next = t;
+    } else {
+        sched->runq_head = t;
     }
+    sched->runq_tail = t;
 }
 
-/* 
- * Convert a string specifying a host name or one of a few symbolic names to a
- * numeric IP address.
+#ifdef HAVE_EPOLL
+/**
+ * Make epoll registration of fd match the events its waiters need.
  */
 static int
-__sockobj_setipaddr(lua_State *L, const char *name, struct sockaddr *addr_ret, size_t addr_ret_size, int af)
+__sched_watch(struct scheduler *sched, int fd)
 {
-    struct addrinfo hints, *res;
-    int err;
-    int d1, d2, d3, d4;
-    char ch;
-    memset((void *)addr_ret, 0, addr_ret_size);
-    
-    if (sscanf(name, "%d.%d.%d.%d%c", &d1, &d2, &d3, &d4, &ch) == 4
-        && 0 <= d1 && d1 <= 255
-        && 0 <= d2 && d2 <= 255
-        && 0 <= d3 && d3 <= 255
-        && 0 <= d4 && d4 <= 255) {
-        struct sockaddr_in *sin;
-        sin = (struct sockaddr_in *)addr_ret;
-        sin->sin_addr.s_addr = htonl(((long)d1 << 24) | ((long)d2 << 16) | ((long)d3 << 8) | ((long)d4 << 0));
-        sin->sin_family = AF_INET;
+    struct fdwaiters *w = &sched->fds[fd];
+    struct epoll_event ev;
+    int events = 0;
+    int op;
+
+    if (w->reader)
+        events |= EVENT_READABLE;
+    if (w->writer)
+        events |= EVENT_WRITABLE;
+    if (events == w->registered)
         return 0;
-    }
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = af;
-    err = getaddrinfo(name, NULL, &hints, &res);
-    if (err) {
-        lua_pushnil(L);
-        lua_pushstring(L, gai_strerror(errno));
-        return -1;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = fd;
+    if (events & EVENT_READABLE)
+        ev.events |= EPOLLIN;
+    if (events & EVENT_WRITABLE)
+        ev.events |= EPOLLOUT;
+
+    if (events == 0) {
+        op = EPOLL_CTL_DEL;
+    } else if (w->registered == 0) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+    if (epoll_ctl(sched->epfd, op, fd, &ev) == -1) {
+        if (op == EPOLL_CTL_DEL) {
+            // fd was closed, already removed from epoll
+        } else if (CHECK_ERRNO(ENOENT)) {
+            // fd was closed and reused
+            if (epoll_ctl(sched->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+                return -1;
+        } else if (CHECK_ERRNO(EEXIST)) {
+            if (epoll_ctl(sched->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+                return -1;
+        } else {
+            return -1;
+        }
     }
-    if (res->ai_addrlen < addr_ret_size)
-        addr_ret_size = res->ai_addrlen;
-    memcpy((char *)addr_ret, res->ai_addr, addr_ret_size);
-    freeaddrinfo(res);
+    w->registered = events;
     return 0;
 }
+#endif
 
 /**
- * Parse socket address arguments.
- *
- * Socket addresses are represented as follows:
+ * Convert a time in nanoseconds to ticks of the timer wheel. Deadlines are
+ * rounded up, so timers never expire early.
+ */
+static uint64_t
+__sched_ticks(int64_t time, int roundup)
+{
+    if (roundup)
+        time += 999;
+    return (uint64_t)(time / 1000);
+}
 
- *  - A single string is used for the AF_UNIX address family.
- *  - Two arguments (host, port) is used for the AF_INET address family,
- *    where host is a string representing either a hostname in Internet Domain
- *    Notation like 'www.example.com' or an IPv4 address like '8.8.8.8', and port
- *    is an number.
+static void
+__sched_addtimer(struct scheduler *sched, struct timer *timer, int64_t deadline)
+{
+    timerwheel_add(&sched->wheel, timer, __sched_ticks(deadline, 1));
+}
 
- * If you use a hostname in the host portion of IPv4/IPv6 socket address, the
- * program may show a nondeterministic behavior, as we use the first address
- * returned from the DNS resolution. The socket address will be resolved
- * differently into an actual IPv4/v6 address, depending on the results from DNS
- * resolution and/or the host configuration. For deterministic behavior use a
- * numeric address in host portion.
- *
- * This method assumed that address arguments start after offset index.
+/**
+ * Park the task until fd becomes ready for event (if fd >= 0) or deadline is
+ * reached (if deadline >= 0).
  *
- * Returns 0 on success, -1 on failure.
+ * Returns 0 on success, -1 on error (errno is set).
  */
 static int
-__sockobj_getaddrfromarg(lua_State * L, struct sockobj *s, struct sockaddr *addr_ret,
-                     socklen_t * len_ret, int offset)
+__sched_park(struct scheduler *sched, struct task *t, int fd, int event, int64_t deadline)
 {
-    int n;
-    n = lua_gettop(L);
-    if (n != 1 + offset && n != 2 + offset) {
-        lua_pushnil(L);
-        lua_pushfstring(L, "expecting %d or %d arguments"
-        " (including the object itself), but seen %d", offset + 1, offset + 2, n);
-        return -1;
-    }
-
-    if (n == 2 + offset) {
-        s->sock_family = AF_INET;
-    } else if (n == 1 + offset) {
-        s->sock_family = AF_UNIX;
-    }
-    if (s->sock_family == AF_INET) {
-        struct sockaddr_in *addr = (struct sockaddr_in *)addr_ret;
-        const char *host;
-        int port;
-        host = luaL_checkstring(L, 1 + offset);
-        port = luaL_checknumber(L, 2 + offset);
-        if (__sockobj_setipaddr(L, host, (struct sockaddr *)addr, sizeof(*addr), AF_INET) != 0) {
+#ifdef HAVE_EPOLL
+    if (fd >= 0) {
+        struct fdwaiters *w;
+        if (fd >= sched->nfds) {
+            int nfds = sched->nfds ? sched->nfds : 64;
+            while (nfds <= fd)
+                nfds *= 2;
+            w = realloc(sched->fds, nfds * sizeof(struct fdwaiters));
+            if (w == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            memset(w + sched->nfds, 0, (nfds - sched->nfds) * sizeof(struct fdwaiters));
+            sched->fds = w;
+            sched->nfds = nfds;
+        }
+        w = &sched->fds[fd];
+        if ((event == EVENT_READABLE && w->reader) ||
+            (event == EVENT_WRITABLE && w->writer)) {
+            // another coroutine is waiting on the same socket
+            errno = EBUSY;
             return -1;
         }
-        addr->sin_family = AF_INET;
-        addr->sin_port = htons(port);
-        *len_ret = sizeof(*addr);
-    } else if (s->sock_family == AF_UNIX) {
-        struct sockaddr_un *addr = (struct sockaddr_un *)addr_ret;
-        const char *path = luaL_checkstring(L, 1 + offset);
-        addr->sun_family = AF_UNIX;
-        strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
-        *len_ret = sizeof(*addr);
-    } else {
-        assert(0);
+        if (event == EVENT_READABLE) {
+            w->reader = t;
+        } else {
+            w->writer = t;
+        }
+        if (__sched_watch(sched, fd) == -1) {
+            if (event == EVENT_READABLE) {
+                w->reader = NULL;
+            } else {
+                w->writer = NULL;
+            }
+            return -1;
+        }
+        t->fd = fd;
     }
+#endif
+    if (deadline >= 0)
+        __sched_addtimer(sched, &t->timer, deadline);
+    t->parked = 1;
     return 0;
 }
 
+static void
+__sched_unpark(struct scheduler *sched, struct task *t)
+{
+    if (t->fd >= 0) {
+        struct fdwaiters *w = &sched->fds[t->fd];
+        if (w->reader == t)
+            w->reader = NULL;
+        if (w->writer == t)
+            w->writer = NULL;
+        t->fd = -1;
+    }
+    timerwheel_del(&sched->wheel, &t->timer);
+    t->parked = 0;
+}
+
+/**
+ * Wake up a parked task. `woken` tells whether the fd it waited on is ready.
+ */
+static void
+__sched_wake(struct scheduler *sched, struct task *t, int woken)
+{
+    __sched_unpark(sched, t);
+    t->woken = woken;
+    __sched_ready(sched, t);
+}
+
+/**
+ * Wake up tasks waiting on a fd which is going to be closed.
+ */
+static void
+__sched_closefd(lua_State *L, int fd)
+{
+    struct scheduler *sched = __sched_get(L);
+    if (sched == NULL || fd >= sched->nfds)
+        return;
+    struct fdwaiters *w = &sched->fds[fd];
+    if (w->reader)
+        __sched_wake(sched, w->reader, 1);
+    if (w->writer)
+        __sched_wake(sched, w->writer, 1);
+    // closing removes the fd from epoll
+    w->registered = 0;
+}
+
+/**
+ * Wake up tasks waiting on a fd which is going to be kept open but not used by
+ * its socket object anymore, and remove it from epoll.
+ */
+static void
+__sched_detachfd(lua_State *L, int fd)
+{
+#ifdef HAVE_EPOLL
+    struct scheduler *sched = __sched_get(L);
+    if (sched && fd < sched->nfds && sched->fds[fd].registered)
+        epoll_ctl(sched->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    __sched_closefd(L, fd);
+}
+
+/**
+ * Continuation of socket operations suspended in __waitfd.
+ *
+ * Operations are restartable, so we simply call the suspended function again.
+ * It restores its timeout and progress from the task (see
+ * __sockobj_inittimeout).
+ */
+LUA_KFUNCTION(__sched_continue)
+{
+    lua_Debug ar;
+    lua_CFunction f;
+    struct task *t;
+    int n;
+    lua_getstack(L, 0, &ar);
+    lua_getinfo(L, "f", &ar);
+    f = lua_tocfunction(L, -1);
+    lua_pop(L, 1);
+    n = f(L);
+    // In case the operation returned early without restoring its state.
+    t = __sched_task(L, NULL);
+    if (t)
+        t->suspended = 0;
+    return n;
+}
+
 /**
- * Create a table, push address info into it.
+ * Do a event polling on fd, if necessary (sock_timeout > 0).
  *
- * The family field os the socket object is inspected to determine what kind of
- * address it really is.
+ * If L is a coroutine managed by the scheduler, it does not block. Instead,
+ * the coroutine is parked and yields to the scheduler, saving the timeout and
+ * the progress of the operation. When woken up, the operation is called again
+ * from start (see __sched_continue).
  *
- * In case of success, a table associated with address info pushed on the stack;
- * In case of error, a nil value with a string describing the error pushed on
- * the stack.
+ * Returns:
+ *  1   on timeout
+ *  -1  on error
+ *  0   success
  */
 static int
-__sockobj_makeaddr(lua_State * L, struct sockobj *s, struct sockaddr *addr,
-               socklen_t addrlen)
+__waitrawfd(lua_State *L, int fd, int event, struct timeout *tm, size_t progress)
 {
-    lua_newtable(L);
+    int ret;
+    struct scheduler *sched;
+    struct task *t;
 
-    switch (addr->sa_family) {
-    case AF_INET:
-        {
-            struct sockaddr_in *a = (struct sockaddr_in *)addr;
-            char buf[NI_MAXHOST];
-            int err = getnameinfo(addr, addrlen, buf, sizeof(buf), NULL, 0,
-                                  NI_NUMERICHOST);
-            if (err) {
-                err = errno;
-                lua_pushnil(L);
-                lua_pushstring(L, gai_strerror(errno));
-                return -1;
-            }
-            lua_pushnumber(L, 1);
-            lua_pushstring(L, buf);
-            lua_settable(L, -3);
-            lua_pushnumber(L, 2);
-            lua_pushnumber(L, ntohs(a->sin_port));
-            lua_settable(L, -3);
+    // Nothing to do if socket is closed.
+    if (fd < 0)
+        return 0;
+
+    struct pollfd pollfd;
+    pollfd.fd = fd;
+    pollfd.events = event;
+
+    t = __sched_task(L, &sched);
+    if (t && compat_isyieldable(L)) {
+        if (t->woken) {
+            t->woken = 0;
             return 0;
         }
-    case AF_UNIX:
-        {
-            struct sockaddr_un *a = (struct sockaddr_un *)addr;
-#ifdef linux
-            if (a->sun_path[0] == 0) { /* Linux abstract namespace */
-                addrlen -= offset(struct sockaddr_un, sun_path);
-                lua_pushlstring(L, a->sun_path, addrlen);
-            } else
+        if (timeout_left(tm, sched->now) == 0)
+            return 1;
+        do {
+            ret = poll(&pollfd, 1, 0);
+        } while (ret == -1 && CHECK_ERRNO(EINTR));
+        if (ret != 0)
+            return ret < 0 ? -1 : 0;
+        if (__sched_park(sched, t, fd, event, tm->tm_deadline) == -1)
+            return -1;
+        t->suspended = 1;
+        t->tm = *tm;
+        t->progress = progress;
+        return lua_yieldk(L, 0, 0, __sched_continue);
+    }
+
+    do {
+        // Handling this condition here simplifies the loops.
+        int64_t left = timeout_left(tm, -1);
+        if (left == 0)
+            return 1;
+#ifdef HAVE_PPOLL
+        struct timespec ts;
+        ret = ppoll(&pollfd, 1, timeout_timespec(left, &ts), NULL);
+#else
+        ret = poll(&pollfd, 1, timeout_ms(left));
 #endif
-            {
-                /* regular NULL-terminated string */
-                lua_pushstring(L, a->sun_path);
-            }
-            return 0;
-        }
-    default:
-        /* If we don't know the address family, return it as an {int, bytes}
-         * table. */
-        lua_pushnumber(L, 1);
-        lua_pushnumber(L, addr->sa_family);
-        lua_settable(L, -3);
-        lua_pushnumber(L, 2);
-        lua_pushstring(L, addr->sa_data);
-        lua_settable(L, -3);
+    } while (ret == -1 && CHECK_ERRNO(EINTR));
+
+    if (ret < 0) {
+        return -1;
+    } else if (ret == 0) {
+        return 1;
+    } else {
         return 0;
     }
 }
 
+#ifdef HAVE_ZEROCOPY
 /**
- * Generic socket object creation.
+ * Release the data pinned for the zerocopy sends completed, oldest first.
  */
-struct sockobj *
-__sockobj_create(lua_State *L, const char *tname)
+static void
+__zerocopy_release(lua_State *L, struct zerocopy *zc)
 {
-    struct sockobj *s =
-        (struct sockobj *)lua_newuserdata(L, sizeof(struct sockobj));
-    if (!s) {
-        return NULL;
+    size_t i, n = 0;
+    for (i = 0; i < zc->npins; i++) {
+        struct zcpin *pin = &zc->pins[i];
+        if (!pin->open && pin->done >= pin->hi - pin->lo)
+            luaL_unref(L, LUA_REGISTRYINDEX, pin->ref);
+        else
+            zc->pins[n++] = *pin;
     }
-    s->fd = -1;
-    s->sock_timeout = -1;
-    s->sock_family = 0;
-    s->buf = NULL;
-    luaL_setmetatable(L, tname);
-    return s;
+    zc->npins = n;
 }
 
 /**
- * Generic socket fd creation.
+ * Read the completions of zerocopy sends from the error queue of fd, without
+ * blocking, and release the data they pinned.
+ */
+static void
+__zerocopy_reapfd(lua_State *L, struct zerocopy *zc, int fd)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 4];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    size_t i;
+
+    while (zc->npins > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (CHECK_ERRNO(EINTR))
+                continue;
+            break;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+                continue;
+            // Sends ee_info to ee_data, inclusive, are completed.
+            for (i = 0; i < zc->npins; i++) {
+                struct zcpin *pin = &zc->pins[i];
+                uint32_t lo = pin->lo > serr->ee_info ? pin->lo : serr->ee_info;
+                uint32_t hi = pin->hi < serr->ee_data + 1 ? pin->hi : serr->ee_data + 1;
+                if (pin->open)
+                    hi = serr->ee_data + 1;
+                if (hi > lo)
+                    pin->done += hi - lo;
+            }
+        }
+    }
+    __zerocopy_release(L, zc);
+}
+
+/**
+ * Reap the zerocopy sends of s, see __zerocopy_reapfd.
+ *
+ * Pending completions make the socket report POLLERR, so this is done before
+ * waiting on it.
  */
+static void
+__zerocopy_reap(lua_State *L, struct sockobj *s)
+{
+    __zerocopy_reapfd(L, s->zc, s->fd);
+}
+
+static char zclinger_key;   /* registry key of the lingering sockets */
+
 static int
-__sockobj_createsocket(lua_State *L, struct sockobj *s, int type)
+zclinger_gc(lua_State * L)
 {
-    int fd;
-    assert(s->fd == -1);
+    struct zclinger *l = (struct zclinger *)lua_touserdata(L, 1);
+    size_t i;
+    // The pinned data goes with the state.
+    for (i = 0; i < l->n; i++) {
+        close(l->socks[i].fd);
+        free(l->socks[i].zc->pins);
+        free(l->socks[i].zc);
+    }
+    free(l->socks);
+    l->socks = NULL;
+    l->n = l->cap = 0;
+    l->closed = 1;
+    return 0;
+}
 
-    if ((fd = socket(s->sock_family, type, 0)) == -1) {
-        lua_pushnil(L);
-        lua_pushfstring(L, "failed to create socket: %s", strerror(errno));
-        return -1;
+/**
+ * Returns the lingering sockets of the Lua state, created if create is not 0,
+ * or NULL.
+ */
+static struct zclinger *
+__zclinger_get(lua_State *L, int create)
+{
+    struct zclinger *l;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &zclinger_key);
+    l = (struct zclinger *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (l == NULL && create) {
+        l = (struct zclinger *)lua_newuserdata(L, sizeof(struct zclinger));
+        memset(l, 0, sizeof(*l));
+        luaL_setmetatable(L, ZCLINGER_TYPENAME);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &zclinger_key);
     }
-    s->fd = fd;
+    return l;
+}
 
-    // 100% non-blocking
-    __setblocking(s->fd, 0);
+/**
+ * Close the lingering sockets whose zerocopy sends are all completed, and
+ * release their data.
+ */
+static void
+__zclinger_reap(lua_State *L)
+{
+    struct zclinger *l = __zclinger_get(L, 0);
+    size_t i, n = 0;
+    if (l == NULL)
+        return;
+    for (i = 0; i < l->n; i++) {
+        struct zclingering *z = &l->socks[i];
+        __zerocopy_reapfd(L, z->zc, z->fd);
+        if (z->zc->npins > 0) {
+            l->socks[n++] = *z;
+            continue;
+        }
+        close(z->fd);
+        free(z->zc->pins);
+        free(z->zc);
+    }
+    l->n = n;
+}
 
+/**
+ * Keep the socket of s open past its close, with the data of its zerocopy sends
+ * in progress: the kernel reads it until they complete, while Lua would reuse
+ * its memory once released. The socket is shut down for writing instead, and
+ * closed by __zclinger_reap once done.
+ *
+ * Returns 0 on success, then s has no socket nor zerocopy state anymore, or -1
+ * if the socket can not be kept.
+ */
+static int
+__zerocopy_linger(lua_State *L, struct sockobj *s)
+{
+    struct zclinger *l = __zclinger_get(L, 1);
+    struct zerocopy *zc = s->zc;
+    if (l->closed)
+        return -1;
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 8;
+        struct zclingering *socks = (struct zclingering *)realloc(l->socks, cap * sizeof(struct zclingering));
+        if (socks == NULL)
+            return -1;
+        l->socks = socks;
+        l->cap = cap;
+    }
+    // Left open by a write whose coroutine was never resumed.
+    if (zc->pins[zc->npins - 1].open) {
+        zc->pins[zc->npins - 1].open = 0;
+        zc->pins[zc->npins - 1].hi = zc->next;
+    }
+    __sched_detachfd(L, s->fd);
+    shutdown(s->fd, SHUT_WR);
+    l->socks[l->n].fd = s->fd;
+    l->socks[l->n].zc = zc;
+    l->n++;
+    s->fd = -1;
+    s->zc = NULL;
     return 0;
 }
 
 /**
- * Close associated socket and buffers.
+ * Pin the data at idx, a string or an array of strings or slices, until the
+ * zerocopy sends of the write in progress are completed: the kernel reads it
+ * when transmitting. A restarted write keeps its pin.
+ *
+ * Bytes objects are not pinned, they may be refilled before the kernel reads
+ * them.
+ *
+ * Returns 0 on success, or -1 if the data can not be pinned.
  */
 static int
-__sockobj_close(lua_State *L, struct sockobj *s)
+__zerocopy_pin(lua_State *L, struct sockobj *s, int idx)
 {
-    if (s->fd != -1) {
-        if (close(s->fd) != 0) {
-            lua_pushnil(L);
-            lua_pushstring(L, strerror(errno));
+    struct zerocopy *zc = s->zc;
+    struct task *t = __sched_task(L, NULL);
+    struct zcpin *pin;
+    int i, n;
+    __zclinger_reap(L);
+    if (zc->npins > 0 && zc->pins[zc->npins - 1].open) {
+        if (t && t->suspended)
+            return 0;
+        // Left open by a write whose coroutine was never resumed.
+        zc->pins[zc->npins - 1].open = 0;
+        zc->pins[zc->npins - 1].hi = zc->next;
+    }
+    if (zc->npins == zc->cap) {
+        size_t cap = zc->cap ? zc->cap * 2 : 8;
+        struct zcpin *pins = (struct zcpin *)realloc(zc->pins, cap * sizeof(struct zcpin));
+        if (pins == NULL)
             return -1;
-        }
-        s->fd = -1;
+        zc->pins = pins;
+        zc->cap = cap;
     }
-    if (s->buf) {
-        buffer_delete(s->buf);
-        s->buf = NULL;
+    if (lua_type(L, idx) == LUA_TTABLE) {
+        // The array may be changed by the caller, its data is pinned instead.
+        n = (int)lua_rawlen(L, idx);
+        lua_createtable(L, n, 0);
+        for (i = 1; i <= n; i++) {
+            lua_rawgeti(L, idx, i);
+            if (lua_type(L, -1) == LUA_TTABLE) {
+                lua_rawgeti(L, -1, 1);
+                lua_remove(L, -2);
+            }
+            if (lua_type(L, -1) != LUA_TSTRING) {
+                lua_pop(L, 2);
+                return -1;
+            }
+            lua_rawseti(L, -2, i);
+        }
+    } else if (lua_type(L, idx) == LUA_TSTRING) {
+        lua_pushvalue(L, idx);
+    } else {
+        return -1;
     }
+    pin = &zc->pins[zc->npins++];
+    pin->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    pin->lo = pin->hi = zc->next;
+    pin->done = 0;
+    pin->open = 1;
     return 0;
 }
 
 /**
- * Generic socket connection.
+ * End the pin of the write done, which covers the zerocopy sends made since
+ * __zerocopy_pin.
+ */
+static void
+__zerocopy_seal(lua_State *L, struct sockobj *s)
+{
+    struct zerocopy *zc = s->zc;
+    struct zcpin *pin = &zc->pins[zc->npins - 1];
+    assert(zc->npins > 0 && pin->open);
+    pin->open = 0;
+    pin->hi = zc->next;
+    __zerocopy_release(L, zc);
+}
+#endif
+
+/**
+ * Release the zerocopy state of the socket and the data it pinned.
+ */
+static void
+__zerocopy_free(lua_State *L, struct sockobj *s)
+{
+#ifdef HAVE_ZEROCOPY
+    size_t i;
+    if (s->zc == NULL)
+        return;
+    for (i = 0; i < s->zc->npins; i++)
+        luaL_unref(L, LUA_REGISTRYINDEX, s->zc->pins[i].ref);
+    free(s->zc->pins);
+    free(s->zc);
+    s->zc = NULL;
+#else
+    (void)L;
+    (void)s;
+#endif
+}
+
+/**
+ * Wait for event on the socket, see __waitrawfd.
  */
 static int
-__sockobj_connect(lua_State *L, struct sockobj *s, struct sockaddr *addr, socklen_t len)
+__waitfd(lua_State *L, struct sockobj *s, int event, struct timeout *tm, size_t progress)
 {
-    int ret;
-    char *errstr = NULL;
-    struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
-    assert(s->fd > 0);
+#ifdef HAVE_ZEROCOPY
+    if (s->zc && s->zc->npins > 0)
+        __zerocopy_reap(L, s);
+#endif
+    return __waitrawfd(L, s->fd, event, tm, progress);
+}
 
-    errno = 0;
-    ret = connect(s->fd, addr, len);
+/**
+ * Init the timeout of a socket operation.
+ *
+ * If the running coroutine resumes an operation suspended in __waitfd, the
+ * timeout and the progress saved there are restored instead.
+ *
+ * Returns 1 if the operation is resumed, 0 otherwise.
+ */
+static int
+__sockobj_inittimeout(lua_State *L, struct sockobj *s, struct timeout *tm, size_t *progress)
+{
+    struct task *t = __sched_task(L, NULL);
+    if (t && t->suspended) {
+        t->suspended = 0;
+        *tm = t->tm;
+        if (progress)
+            *progress = t->progress;
+        return 1;
+    }
+    timeout_init(tm, s->sock_timeout);
+    if (progress)
+        *progress = 0;
+    return 0;
+}
 
-    if (CHECK_ERRNO(EINPROGRESS)) {
-        /* Connecting in progress with timeout, wait until we have the result of
-         * the connection attempt or timeout.
-         */
-        int timeout = __waitfd(s, EVENT_WRITABLE, &tm);
-        if (timeout == 1) {
-            errstr = ERROR_TIMEOUT;
-            goto err;
-        } else if (timeout == 0) {
-            // In case of EINPROGRESS, use getsockopt(SO_ERROR) to get the real
-            // error, when the connection attempt finished.
-            socklen_t ret_size = sizeof(ret);
-            getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &ret, &ret_size);
-            if (ret == EISCONN) {
-                errno = 0;
-            } else {
-                errno = ret;
-            }
-        } else {
-            errstr = strerror(errno);
-            goto err;
-        }
+/**
+ * Record I/O activity on the socket, which postpones its idle timeout.
+ *
+ * The idle timer is not moved here, it is re-armed lazily when it expires (see
+ * __sched_reap), so busy sockets cost nothing.
+ */
+static void
+__sockobj_touch(lua_State *L, struct sockobj *s)
+{
+    if (s->idle_timeout > 0) {
+        int64_t now = __sched_clock(L);
+        s->last_active = now >= 0 ? now : timeout_gettime();
     }
+}
 
-    if (errno) {
-        errstr = strerror(errno);
-        goto err;
+/**
+ * Account a successful transfer on the socket, in the stats of the worker
+ * owning it (if any).
+ */
+static void
+__sockobj_account(lua_State *L, struct sockobj *s, size_t received, size_t sent)
+{
+    if (s->worker) {
+        s->worker->received += received;
+        s->worker->sent += sent;
     }
-    return 0;
+    __sockobj_touch(L, s);
+}
 
-err:
-    assert(errstr);
-    __sockobj_close(L, s);
-    lua_pushnil(L);
-    lua_pushstring(L, errstr);
-    return -1;
+#ifdef HAVE_IO_URING
+static char uring_key;      /* registry key of the io_uring, if selected */
+
+/**
+ * Returns the io_uring of the Lua state if the io_uring backend is in use,
+ * NULL otherwise. The backend is chosen per Lua state, each worker has its own.
+ *
+ * Coroutines managed by the scheduler always go through the poll path, so
+ * they do not block the scheduler.
+ */
+static struct uring *
+__sockobj_uring(lua_State *L)
+{
+    struct uring **ringp;
+    if (__sched_task(L, NULL))
+        return NULL;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &uring_key);
+    ringp = (struct uring **)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return ringp ? *ringp : NULL;
 }
 
 static int
-__sockobj_send(lua_State *L, struct sockobj *s, const char *buf, size_t len, size_t *sent, struct timeout *tm) {
-    char *errstr;
-    if (s->fd == -1) {
-        errstr = ERROR_CLOSED;
-        goto err;
+uring_gc(lua_State * L)
+{
+    struct uring **ringp = (struct uring **)lua_touserdata(L, 1);
+    if (*ringp) {
+        uring_delete(*ringp);
+        *ringp = NULL;
     }
+    return 0;
+}
+#endif
 
+/**
+ * Wait until the socket is readable, then receive data from it.
+ *
+ * With the io_uring backend, waiting and receiving take a single system call.
+ *
+ * `progress` is the number of bytes received so far by the operation, see
+ * __waitfd.
+ *
+ * Returns the number of bytes received (0 if the connection was closed), or
+ * -1 on error with errno set (ETIMEDOUT on timeout).
+ */
+static int
+__sockobj_recvwait(lua_State *L, struct sockobj *s, char *buf, size_t len, struct timeout *tm, size_t progress)
+{
+    int n;
+#ifdef HAVE_IO_URING
+    struct uring *ring = __sockobj_uring(L);
+    if (ring) {
+        n = uring_recv(ring, s->fd, buf, len, 0, timeout_left(tm, -1));
+        if (n > 0)
+            __sockobj_account(L, s, n, 0);
+        if (n >= 0 || !CHECK_ERRNO(EAGAIN))
+            return n;
+        // fall back to the poll path
+    }
+#endif
     while (1) {
-        int timeout = __waitfd(s, EVENT_WRITABLE, tm);
+        int timeout = __waitfd(L, s, EVENT_READABLE, tm, progress);
         if (timeout == -1) {
-            errstr = strerror(errno);
-            goto err;
+            return -1;
         } else if (timeout == 1) {
-            errstr = ERROR_TIMEOUT;
-            goto err;
-        } else {
-            int n = send(s->fd, buf, len, 0);
-            if (n < 0) {
-                switch (errno) {
-                case EINTR:
-                case EAGAIN:
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (s->fd == -1) {
+            // closed while waiting
+            return 0;
+        }
+        n = recv(s->fd, buf, len, 0);
+        if (n > 0)
+            __sockobj_account(L, s, n, 0);
+        if (n >= 0 || (!CHECK_ERRNO(EINTR) && !CHECK_ERRNO(EAGAIN)))
+            return n;
+    }
+}
+
+/**
+ * Send the iovcnt buffers of iov with a single system call (sendmsg if there
+ * are several of them).
+ */
+static int
+__sendv(int fd, const struct iovec *iov, int iovcnt, int flags)
+{
+    struct msghdr msg;
+    if (iovcnt == 1)
+        return send(fd, iov->iov_base, iov->iov_len, flags);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(fd, &msg, flags);
+}
+
+/**
+ * Wait until the socket is writable, then send the iovcnt buffers of iov on
+ * it. Only the first IOV_MAX buffers are sent.
+ *
+ * `progress` is the number of bytes sent so far by the operation, see
+ * __waitfd.
+ *
+ * Returns the number of bytes sent, or -1 on error with errno set (ETIMEDOUT
+ * on timeout).
+ */
+static int
+__sockobj_sendwait(lua_State *L, struct sockobj *s, const struct iovec *iov, int iovcnt, int flags, struct timeout *tm, size_t progress)
+{
+    int n;
+    if (iovcnt > IOV_MAX)
+        iovcnt = IOV_MAX;
+#ifdef HAVE_IO_URING
+    struct uring *ring = __sockobj_uring(L);
+    if (ring) {
+        if (iovcnt == 1) {
+            n = uring_send(ring, s->fd, iov->iov_base, iov->iov_len, flags, timeout_left(tm, -1));
+        } else {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = (struct iovec *)iov;
+            msg.msg_iovlen = iovcnt;
+            n = uring_sendmsg(ring, s->fd, &msg, flags, timeout_left(tm, -1));
+        }
+        if (n > 0)
+            __sockobj_account(L, s, 0, n);
+        if (n >= 0 || !CHECK_ERRNO(EAGAIN))
+            return n;
+        // fall back to the poll path
+    }
+#endif
+    while (1) {
+        int timeout = __waitfd(L, s, EVENT_WRITABLE, tm, progress);
+        if (timeout == -1) {
+            return -1;
+        } else if (timeout == 1) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (s->fd == -1) {
+            // closed while waiting
+            errno = EPIPE;
+            return -1;
+        }
+        n = __sendv(s->fd, iov, iovcnt, flags);
+#ifdef HAVE_ZEROCOPY
+        if (flags & MSG_ZEROCOPY) {
+            if (n > 0) {
+                s->zc->next++;
+            } else if (n == -1 && CHECK_ERRNO(ENOBUFS)) {
+                // Too many sends in flight, this one is copied.
+                n = __sendv(s->fd, iov, iovcnt, flags & ~MSG_ZEROCOPY);
+            }
+        }
+#endif
+        if (n > 0)
+            __sockobj_account(L, s, 0, n);
+        if (n >= 0 || (!CHECK_ERRNO(EINTR) && !CHECK_ERRNO(EAGAIN)))
+            return n;
+    }
+}
+
+int
+__select(int nfds, fd_set * readfds, fd_set * writefds, fd_set * errorfds,
+         struct timeout *tm)
+{
+    int ret;
+    do {
+        struct timeval tv = { 0, 0 };
+        int64_t t = timeout_left(tm, -1);
+        if (t >= 0) {
+            // rounded up to microseconds
+            t = (t + 999) / 1000;
+            tv.tv_sec = t / 1000000;
+            tv.tv_usec = t % 1000000;
+        }
+
+        ret = select(nfds, readfds, writefds, errorfds, (t >= 0) ? &tv : NULL);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+/**
+ * Get the address length according to the socket object's address family.
+ * Return 1 if the family is known, 0 otherwise. The length is returned through
+ * len_ret.
+ */
+static int
+__getsockaddrlen(struct sockobj *s, socklen_t * len_ret)
+{
+    switch (s->sock_family) {
+    case AF_UNIX:
+        *len_ret = sizeof(struct sockaddr_un);
+        return 1;
+    case AF_INET:
+        *len_ret = sizeof(struct sockaddr_in);
+        return 1;
+    case AF_INET6:
+        *len_ret = sizeof(struct sockaddr_in6);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Resolve name for family, with the cache of resolver.c, within the timeout tm
+ * of the operation, which goes on with what is left of it.
+ *
+ * The resolution runs on a helper thread: a coroutine managed by the scheduler
+ * is suspended meanwhile, then the operation is restarted and gets the result
+ * from the cache. `progress` is the progress of the operation, see __waitfd.
+ *
+ * Returns 0 on success, or -1 with nil and an error message pushed.
+ */
+static int
+__sockobj_resolve(lua_State *L, struct timeout *tm, const char *name, int family, struct resolver_result *res, size_t progress)
+{
+    struct task *t = __sched_task(L, NULL);
+    int stale = 0;
+    int fd, ret;
+
+    if (t && t->resolvefd != -1) {
+        // Resumed, the resolution waited for is done or timed out.
+        __sched_closefd(L, t->resolvefd);
+        close(t->resolvefd);
+        t->resolvefd = -1;
+        t->suspended = 0;
+        t->woken = 0;
+        *tm = t->tm;
+        stale = 1;
+    } else {
+        // An operation resumed after the resolution keeps its address.
+        stale = t && t->suspended;
+    }
+
+    while ((ret = resolver_lookup(name, family, stale, res, &fd)) == 0) {
+        if (t)
+            t->resolvefd = fd;
+        ret = __waitrawfd(L, fd, EVENT_READABLE, tm, progress);
+        if (t)
+            t->resolvefd = -1;
+        __sched_closefd(L, fd);
+        close(fd);
+        if (ret == -1) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return -1;
+        } else if (ret == 1) {
+            lua_pushnil(L);
+            lua_pushstring(L, ERROR_TIMEOUT);
+            return -1;
+        }
+        stale = 1;
+    }
+    if (ret == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return -1;
+    }
+    if (res->error) {
+        lua_pushnil(L);
+        lua_pushstring(L, res->error == EAI_SYSTEM ? strerror(res->syserror) : gai_strerror(res->error));
+        return -1;
+    }
+    return 0;
+}
+
+/* 
+ * Convert a string specifying a host name or one of a few symbolic names to a
+ * numeric IP address.
+ *
+ * Set the address of name for family af (AF_UNSPEC for any) in addr_ret. name
+ * is a numeric IPv4 or IPv6 address, or a host name, then the first address
+ * it resolves to within the timeout tm is used (see __sockobj_resolve).
+ *
+ * Returns 0 on success, or -1 with nil and an error message pushed.
+ */
+static int
+__sockobj_setipaddr(lua_State *L, struct timeout *tm, const char *name, struct sockaddr *addr_ret, size_t addr_ret_size, int af, size_t progress)
+{
+    struct resolver_result res;
+    int d1, d2, d3, d4;
+    char ch;
+    memset((void *)addr_ret, 0, addr_ret_size);
+    
+    if (af != AF_INET6
+        && sscanf(name, "%d.%d.%d.%d%c", &d1, &d2, &d3, &d4, &ch) == 4
+        && 0 <= d1 && d1 <= 255
+        && 0 <= d2 && d2 <= 255
+        && 0 <= d3 && d3 <= 255
+        && 0 <= d4 && d4 <= 255) {
+        struct sockaddr_in *sin;
+        sin = (struct sockaddr_in *)addr_ret;
+        sin->sin_addr.s_addr = htonl(((long)d1 << 24) | ((long)d2 << 16) | ((long)d3 << 8) | ((long)d4 << 0));
+        sin->sin_family = AF_INET;
+        return 0;
+    }
+    if (af != AF_INET && addr_ret_size >= sizeof(struct sockaddr_in6) && strchr(name, ':')) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr_ret;
+        if (inet_pton(AF_INET6, name, &sin6->sin6_addr) == 1) {
+            sin6->sin6_family = AF_INET6;
+            return 0;
+        }
+    }
+
+    if (__sockobj_resolve(L, tm, name, af, &res, progress) == -1)
+        return -1;
+    if (res.naddrs == 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, gai_strerror(EAI_NONAME));
+        return -1;
+    }
+    if (res.addrlens[0] > addr_ret_size) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(EAFNOSUPPORT));
+        return -1;
+    }
+    memcpy((char *)addr_ret, &res.addrs[0], res.addrlens[0]);
+    return 0;
+}
+
+/**
+ * Whether name is a numeric IPv4 or IPv6 address.
+ */
+static int
+__isnumerichost(const char *name)
+{
+    struct in6_addr in6;
+    return inet_pton(AF_INET, name, &in6) == 1 || inet_pton(AF_INET6, name, &in6) == 1;
+}
+
+/**
+ * Set the port of an IPv4 or IPv6 address, and returns its length.
+ */
+static socklen_t
+__setport(sockaddr_t *addr, int port)
+{
+    if (addr->sa.sa_family == AF_INET6) {
+        addr->in6.sin6_port = htons(port);
+        return sizeof(addr->in6);
+    }
+    addr->in.sin_port = htons(port);
+    return sizeof(addr->in);
+}
+
+/**
+ * Parse socket address arguments.
+ *
+ * Socket addresses are represented as follows:
+
+ *  - A single string is used for the AF_UNIX address family.
+ *  - Two arguments (host, port) is used for the AF_INET/AF_INET6 address
+ *    families, where host is a string representing either a hostname in
+ *    Internet Domain Notation like 'www.example.com', an IPv4 address like
+ *    '8.8.8.8' or an IPv6 address like '2001:db8::1', and port is an number.
+ *    Once the socket exists, host names resolve to addresses of its family.
+
+ * If you use a hostname in the host portion of IPv4/IPv6 socket address, the
+ * program may show a nondeterministic behavior, as we use the first address
+ * returned from the DNS resolution. The socket address will be resolved
+ * differently into an actual IPv4/v6 address, depending on the results from DNS
+ * resolution and/or the host configuration. For deterministic behavior use a
+ * numeric address in host portion.
+ *
+ * This method assumed that address arguments start after offset index.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+__sockobj_getaddrfromarg(lua_State * L, struct sockobj *s, struct sockaddr *addr_ret,
+                     socklen_t * len_ret, int offset)
+{
+    int n;
+    n = lua_gettop(L);
+    if (n != 1 + offset && n != 2 + offset) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "expecting %d or %d arguments"
+        " (including the object itself), but seen %d", offset + 1, offset + 2, n);
+        return -1;
+    }
+
+    if (n == 2 + offset) {
+        sockaddr_t *addr = (sockaddr_t *)addr_ret;
+        struct timeout tm;
+        const char *host;
+        int port;
+        int af = AF_UNSPEC;
+        host = luaL_checkstring(L, 1 + offset);
+        port = luaL_checknumber(L, 2 + offset);
+        if (s->fd != -1 && (s->sock_family == AF_INET || s->sock_family == AF_INET6))
+            af = s->sock_family;
+        timeout_init(&tm, s->sock_timeout);
+        if (__sockobj_setipaddr(L, &tm, host, addr_ret, sizeof(*addr), af, 0) != 0) {
+            return -1;
+        }
+        s->sock_family = addr->sa.sa_family;
+        *len_ret = __setport(addr, port);
+    } else {
+        s->sock_family = AF_UNIX;
+    }
+    if (s->sock_family == AF_UNIX) {
+        struct sockaddr_un *addr = (struct sockaddr_un *)addr_ret;
+        const char *path = luaL_checkstring(L, 1 + offset);
+        addr->sun_family = AF_UNIX;
+        strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+        *len_ret = sizeof(*addr);
+    }
+    return 0;
+}
+
+/**
+ * Push address info: a table {host, port} for IPv4/IPv6 addresses, the path
+ * for unix domain ones.
+ *
+ * In case of success, a value associated with address info pushed on the stack;
+ * In case of error, a nil value with a string describing the error pushed on
+ * the stack.
+ */
+static int
+__sockobj_makeaddr(lua_State * L, struct sockobj *s, struct sockaddr *addr,
+               socklen_t addrlen)
+{
+    switch (addr->sa_family) {
+    case AF_INET:
+    case AF_INET6:
+        {
+            char buf[NI_MAXHOST];
+            int port = addr->sa_family == AF_INET ?
+                ntohs(((struct sockaddr_in *)addr)->sin_port) :
+                ntohs(((struct sockaddr_in6 *)addr)->sin6_port);
+            int err = getnameinfo(addr, addrlen, buf, sizeof(buf), NULL, 0,
+                                  NI_NUMERICHOST);
+            if (err) {
+                lua_pushnil(L);
+                lua_pushstring(L, err == EAI_SYSTEM ? strerror(errno) : gai_strerror(err));
+                return -1;
+            }
+            lua_newtable(L);
+            lua_pushnumber(L, 1);
+            lua_pushstring(L, buf);
+            lua_settable(L, -3);
+            lua_pushnumber(L, 2);
+            lua_pushnumber(L, port);
+            lua_settable(L, -3);
+            return 0;
+        }
+    case AF_UNIX:
+        {
+            struct sockaddr_un *a = (struct sockaddr_un *)addr;
+#ifdef linux
+            if (a->sun_path[0] == 0) { /* Linux abstract namespace */
+                addrlen -= offset(struct sockaddr_un, sun_path);
+                lua_pushlstring(L, a->sun_path, addrlen);
+            } else
+#endif
+            {
+                /* regular NULL-terminated string */
+                lua_pushstring(L, a->sun_path);
+            }
+            return 0;
+        }
+    default:
+        /* If we don't know the address family, return it as an {int, bytes}
+         * table. */
+        lua_newtable(L);
+        lua_pushnumber(L, 1);
+        lua_pushnumber(L, addr->sa_family);
+        lua_settable(L, -3);
+        lua_pushnumber(L, 2);
+        lua_pushstring(L, addr->sa_data);
+        lua_settable(L, -3);
+        return 0;
+    }
+}
+
+/**
+ * Make sure the message vectors of the socket hold at least count messages of
+ * size bytes each. They only grow, so a socket receiving batches of the same
+ * shape allocates them once.
+ *
+ * Returns the message vectors, or NULL if out of memory.
+ */
+static struct msgslab *
+__sockobj_slab(struct sockobj *s, unsigned int count, size_t size)
+{
+    struct msgslab *slab = s->slab;
+    if (slab && slab->count >= count && slab->size >= size)
+        return slab;
+    if (slab) {
+        if (count < slab->count)
+            count = slab->count;
+        if (size < slab->size)
+            size = slab->size;
+    }
+    // A single allocation, the arrays are laid out by decreasing alignment.
+    slab = malloc(sizeof(struct msgslab) + count * (sizeof(mmsghdr_t) + sizeof(sockaddr_t) + sizeof(struct iovec) + size));
+    if (slab == NULL)
+        return NULL;
+    slab->count = count;
+    slab->size = size;
+    slab->msgs = (mmsghdr_t *)(slab + 1);
+    slab->addrs = (sockaddr_t *)(slab->msgs + count);
+    slab->iov = (struct iovec *)(slab->addrs + count);
+    slab->data = (char *)(slab->iov + count);
+    free(s->slab);
+    s->slab = slab;
+    return slab;
+}
+
+/**
+ * Generic socket object creation.
+ */
+struct sockobj *
+__sockobj_create(lua_State *L, const char *tname)
+{
+    struct sockobj *s =
+        (struct sockobj *)lua_newuserdata(L, sizeof(struct sockobj));
+    if (!s) {
+        return NULL;
+    }
+    s->fd = -1;
+    s->sock_timeout = -1;
+    s->sock_family = 0;
+    s->sock_flags = 0;
+    s->sock_opts = 0;
+    s->gso_size = 0;
+    s->buf = NULL;
+    s->wbuf = NULL;
+    s->wbuf_size = 0;
+    s->slab = NULL;
+    s->zc = NULL;
+    s->idle_timeout = -1;
+    s->last_active = 0;
+    timer_init(&s->idle, TIMER_IDLE, s);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &worker_key);
+    s->worker = (struct worker *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    s->pool = NULL;
+    luaL_setmetatable(L, tname);
+    return s;
+}
+
+/* Value types of socket options */
+#define SOCKOPT_BOOL    0
+#define SOCKOPT_INT     1
+#define SOCKOPT_TIME    2       /* a duration, in seconds for Lua */
+
+/* Socket types an option applies to */
+#define SOCKOPT_TCP     0x1
+#define SOCKOPT_UDP     0x2
+
+/* Socket option of setopt/getopt */
+struct sockopt {
+    const char *name;           /* OPT_* */
+    int types;                  /* SOCKOPT_TCP and/or SOCKOPT_UDP */
+    int level;
+    int optname;                /* -1 if not supported on this platform */
+    int type;                   /* SOCKOPT_* value type */
+    int scale;                  /* SOCKOPT_TIME: units of optname per second */
+    int max;                    /* SOCKOPT_INT: max value, 0 if unbounded */
+    int sockflag;               /* SOCKOBJ_* flag mirroring it, 0 if none */
+    int offset;                 /* of the int of sockobj mirroring it, -1 if none */
+    int reset;                  /* default value, -1 if it can not be restored */
+};
+
+/* Options which may not be supported on this platform, -1 if not */
+#ifdef TCP_CORK
+#define OPTNAME_TCP_CORK TCP_CORK
+#else
+#define OPTNAME_TCP_CORK -1
+#endif
+#ifdef TCP_QUICKACK
+#define OPTNAME_TCP_QUICKACK TCP_QUICKACK
+#else
+#define OPTNAME_TCP_QUICKACK -1
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+#define OPTNAME_TCP_NOTSENT_LOWAT TCP_NOTSENT_LOWAT
+#else
+#define OPTNAME_TCP_NOTSENT_LOWAT -1
+#endif
+#ifdef TCP_DEFER_ACCEPT
+#define OPTNAME_TCP_DEFER_ACCEPT TCP_DEFER_ACCEPT
+#else
+#define OPTNAME_TCP_DEFER_ACCEPT -1
+#endif
+#ifdef TCP_USER_TIMEOUT
+#define OPTNAME_TCP_USER_TIMEOUT TCP_USER_TIMEOUT
+#else
+#define OPTNAME_TCP_USER_TIMEOUT -1
+#endif
+#ifdef SO_REUSEPORT
+#define OPTNAME_SO_REUSEPORT SO_REUSEPORT
+#else
+#define OPTNAME_SO_REUSEPORT -1
+#endif
+#ifdef SO_BUSY_POLL
+#define OPTNAME_SO_BUSY_POLL SO_BUSY_POLL
+#else
+#define OPTNAME_SO_BUSY_POLL -1
+#endif
+#ifdef SO_PRIORITY
+#define OPTNAME_SO_PRIORITY SO_PRIORITY
+#else
+#define OPTNAME_SO_PRIORITY -1
+#endif
+#ifdef UDP_SEGMENT
+#define OPTNAME_UDP_SEGMENT UDP_SEGMENT
+#else
+#define OPTNAME_UDP_SEGMENT -1
+#endif
+#ifdef UDP_GRO
+#define OPTNAME_UDP_GRO UDP_GRO
+#else
+#define OPTNAME_UDP_GRO -1
+#endif
+
+/*
+ * Options mirrored by the socket object may be set before the socket exists,
+ * they are applied when it is created. IP_TOS is IPV6_TCLASS for IPv6 sockets.
+ * Options set on a connection are reset before it goes to a keepalive pool,
+ * the buffer sizes lock the autotuning of the kernel for good.
+ */
+static const struct sockopt sockopts[] = {
+    {OPT_TCP_NODELAY, SOCKOPT_TCP, IPPROTO_TCP, TCP_NODELAY, SOCKOPT_BOOL, 0, 0, 0, -1, 0},
+    {OPT_TCP_KEEPALIVE, SOCKOPT_TCP, SOL_SOCKET, SO_KEEPALIVE, SOCKOPT_BOOL, 0, 0, 0, -1, 0},
+    {OPT_TCP_REUSEADDR, SOCKOPT_TCP, SOL_SOCKET, SO_REUSEADDR, SOCKOPT_BOOL, 0, 0, SOCKOBJ_REUSEADDR, -1, 0},
+    {OPT_TCP_REUSEPORT, SOCKOPT_TCP, SOL_SOCKET, OPTNAME_SO_REUSEPORT, SOCKOPT_BOOL, 0, 0, SOCKOBJ_REUSEPORT, -1, 0},
+    {OPT_TCP_CORK, SOCKOPT_TCP, IPPROTO_TCP, OPTNAME_TCP_CORK, SOCKOPT_BOOL, 0, 0, SOCKOBJ_CORK, -1, 0},
+    {OPT_TCP_QUICKACK, SOCKOPT_TCP, IPPROTO_TCP, OPTNAME_TCP_QUICKACK, SOCKOPT_BOOL, 0, 0, 0, -1, 1},
+    {OPT_TCP_NOTSENT_LOWAT, SOCKOPT_TCP, IPPROTO_TCP, OPTNAME_TCP_NOTSENT_LOWAT, SOCKOPT_INT, 0, 0, 0, -1, 0},
+    {OPT_TCP_DEFER_ACCEPT, SOCKOPT_TCP, IPPROTO_TCP, OPTNAME_TCP_DEFER_ACCEPT, SOCKOPT_TIME, 1, 0, 0, -1, 0},
+    {OPT_TCP_USER_TIMEOUT, SOCKOPT_TCP, IPPROTO_TCP, OPTNAME_TCP_USER_TIMEOUT, SOCKOPT_TIME, 1000, 0, 0, -1, 0},
+    {OPT_UDP_SEGMENT, SOCKOPT_UDP, IPPROTO_UDP, OPTNAME_UDP_SEGMENT, SOCKOPT_INT, 0, UINT16_MAX, 0, offsetof(struct sockobj, gso_size), 0},
+    {OPT_UDP_GRO, SOCKOPT_UDP, IPPROTO_UDP, OPTNAME_UDP_GRO, SOCKOPT_BOOL, 0, 0, SOCKOBJ_GRO, -1, 0},
+    {OPT_SO_RCVBUF, SOCKOPT_TCP | SOCKOPT_UDP, SOL_SOCKET, SO_RCVBUF, SOCKOPT_INT, 0, 0, 0, -1, -1},
+    {OPT_SO_SNDBUF, SOCKOPT_TCP | SOCKOPT_UDP, SOL_SOCKET, SO_SNDBUF, SOCKOPT_INT, 0, 0, 0, -1, -1},
+    {OPT_SO_REUSEPORT, SOCKOPT_TCP | SOCKOPT_UDP, SOL_SOCKET, OPTNAME_SO_REUSEPORT, SOCKOPT_BOOL, 0, 0, SOCKOBJ_REUSEPORT, -1, 0},
+    {OPT_SO_BUSY_POLL, SOCKOPT_TCP | SOCKOPT_UDP, SOL_SOCKET, OPTNAME_SO_BUSY_POLL, SOCKOPT_TIME, 1000000, 0, 0, -1, 0},
+    {OPT_SO_PRIORITY, SOCKOPT_TCP | SOCKOPT_UDP, SOL_SOCKET, OPTNAME_SO_PRIORITY, SOCKOPT_INT, 0, 0, 0, -1, 0},
+    {OPT_IP_TOS, SOCKOPT_TCP | SOCKOPT_UDP, IPPROTO_IP, IP_TOS, SOCKOPT_INT, 0, UINT8_MAX, 0, -1, 0},
+    {NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+};
+
+static char sockopt_key;    /* registry key of the table of options by name */
+
+/**
+ * Returns the option named by the string at index idx, for a socket of the
+ * given type (SOCKOPT_TCP or SOCKOPT_UDP), raising an error if there is none.
+ *
+ * Option names are keys of a table, so finding one costs a lookup of an
+ * interned string.
+ */
+static const struct sockopt *
+__sockopt_check(lua_State *L, int idx, int type)
+{
+    const struct sockopt *o;
+    luaL_checkstring(L, idx);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &sockopt_key);
+    lua_pushvalue(L, idx);
+    lua_rawget(L, -2);
+    o = (const struct sockopt *)lua_touserdata(L, -1);
+    lua_pop(L, 2);
+    if (o == NULL || !(o->types & type))
+        luaL_error(L, "unexpected option: %s", lua_tostring(L, idx));
+    return o;
+}
+
+/**
+ * Returns the level and name of option o for a socket of family.
+ */
+static void
+__sockopt_name(const struct sockopt *o, int family, int *level, int *optname)
+{
+    *level = o->level;
+    *optname = o->optname;
+#ifdef IPV6_TCLASS
+    if (o->optname == IP_TOS && o->level == IPPROTO_IP && family == AF_INET6) {
+        *level = IPPROTO_IPV6;
+        *optname = IPV6_TCLASS;
+    }
+#else
+    (void)family;
+#endif
+}
+
+/**
+ * Apply to the socket of s the options set before it existed.
+ *
+ * Returns 0 on success, or -1 with nil and an error message pushed.
+ */
+static int
+__sockobj_applyopts(lua_State *L, struct sockobj *s, int type)
+{
+    const struct sockopt *o;
+    int applied = 0;
+
+    for (o = sockopts; o->name; o++) {
+        int level, optname, value = 0;
+        if (!(o->types & (type == SOCK_STREAM ? SOCKOPT_TCP : SOCKOPT_UDP)) || o->optname == -1)
+            continue;
+        if (o->sockflag) {
+            // Options with several names share their flag.
+            value = (s->sock_flags & o->sockflag & ~applied) != 0;
+            applied |= o->sockflag;
+        } else if (o->offset != -1)
+            value = *(int *)((char *)s + o->offset);
+        if (value == 0)
+            continue;
+        __sockopt_name(o, s->sock_family, &level, &optname);
+        if (setsockopt(s->fd, level, optname, (void *)&value, sizeof(value)) == -1) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "failed to set %s: %s", o->name, strerror(errno));
+            return -1;
+        }
+        s->sock_opts |= 1u << (o - sockopts);
+    }
+#ifdef HAVE_ZEROCOPY
+    if (s->zc && s->zc->threshold > 0) {
+        int flag = 1;
+        if (setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, (void *)&flag, sizeof(flag)) == -1) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "failed to enable zerocopy: %s", strerror(errno));
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Reset the options set on the socket of s to their defaults, before the
+ * connection goes to a keepalive pool, for another socket object.
+ *
+ * Returns 0 on success, -1 if an option can not be reset.
+ */
+static int
+__sockobj_resetopts(struct sockobj *s)
+{
+    const struct sockopt *o;
+
+    for (o = sockopts; o->name; o++) {
+        int level, optname, value = o->reset;
+        if (!(s->sock_opts & (1u << (o - sockopts))))
+            continue;
+        if (value == -1)
+            return -1;
+        __sockopt_name(o, s->sock_family, &level, &optname);
+        if (setsockopt(s->fd, level, optname, (void *)&value, sizeof(value)) == -1)
+            return -1;
+    }
+    s->sock_opts = 0;
+#ifdef HAVE_ZEROCOPY
+    if (s->zc) {
+        int flag = 0;
+        if (setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, (void *)&flag, sizeof(flag)) == -1)
+            return -1;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Generic socket fd creation.
+ */
+static int
+__sockobj_createsocket(lua_State *L, struct sockobj *s, int type)
+{
+    int fd;
+    assert(s->fd == -1);
+
+    if ((fd = socket(s->sock_family, type, 0)) == -1) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+    s->fd = fd;
+
+    // 100% non-blocking
+    __setblocking(s->fd, 0);
+
+    if (__sockobj_applyopts(L, s, type) == -1) {
+        close(s->fd);
+        s->fd = -1;
+        s->sock_opts = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Push a tcp socket object for a connection accepted on s.
+ */
+static void
+__tcpsock_pushclient(lua_State *L, struct sockobj *s, int clientfd)
+{
+    struct sockobj *client = __sockobj_create(L, TCPSOCK_TYPENAME);
+    client->fd = clientfd;
+    client->sock_family = s->sock_family;
+    if (s->worker)
+        s->worker->accepted++;
+}
+
+/**
+ * Close associated socket and buffers.
+ */
+static int
+__sockobj_close(lua_State *L, struct sockobj *s)
+{
+    if (timer_pending(&s->idle)) {
+        struct scheduler *sched = __sched_get(L);
+        timerwheel_del(&sched->wheel, &s->idle);
+    }
+#ifdef HAVE_ZEROCOPY
+    __zclinger_reap(L);
+    if (s->fd != -1 && s->zc && s->zc->npins > 0) {
+        // The data of the sends in flight is released once they complete.
+        __zerocopy_reap(L, s);
+        if (s->zc->npins > 0)
+            __zerocopy_linger(L, s);
+    }
+#endif
+    if (s->fd != -1) {
+        __sched_closefd(L, s->fd);
+        if (close(s->fd) != 0) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return -1;
+        }
+        s->fd = -1;
+        s->sock_opts = 0;
+    }
+    if (s->buf) {
+        buffer_delete(s->buf);
+        s->buf = NULL;
+    }
+    if (s->wbuf) {
+        buffer_delete(s->wbuf);
+        s->wbuf = NULL;
+    }
+    if (s->slab) {
+        free(s->slab);
+        s->slab = NULL;
+    }
+    __zerocopy_free(L, s);
+    if (s->pool) {
+        free(s->pool);
+        s->pool = NULL;
+    }
+    return 0;
+}
+
+/**
+ * Generic socket connection.
+ */
+static int
+__sockobj_connect(lua_State *L, struct sockobj *s, struct sockaddr *addr, socklen_t len, struct timeout *tm)
+{
+    int ret;
+    char *errstr = NULL;
+    assert(s->fd > 0);
+
+    if (addr) {
+#ifdef HAVE_IO_URING
+        struct uring *ring = __sockobj_uring(L);
+        int64_t left = timeout_left(tm, -1);
+        // Without time left, uring_connect does not try (see uring.h).
+        if (ring && left != 0) {
+            errno = 0;
+            if (uring_connect(ring, s->fd, addr, len, left) == -1) {
+                if (CHECK_ERRNO(ETIMEDOUT)) {
+                    errstr = ERROR_TIMEOUT;
+                    goto err;
+                } else if (CHECK_ERRNO(EAGAIN) || CHECK_ERRNO(EALREADY)) {
+                    // fall back to the poll path
+                    errno = EINPROGRESS;
+                }
+            }
+        } else
+#endif
+        {
+            errno = 0;
+            ret = connect(s->fd, addr, len);
+        }
+    } else {
+        // Resumed, the connection attempt is in progress.
+        errno = EINPROGRESS;
+    }
+
+    if (CHECK_ERRNO(EINPROGRESS)) {
+        /* Connecting in progress with timeout, wait until we have the result of
+         * the connection attempt or timeout.
+         */
+        int timeout = __waitfd(L, s, EVENT_WRITABLE, tm, 0);
+        if (timeout == 1) {
+            errstr = ERROR_TIMEOUT;
+            goto err;
+        } else if (timeout == 0) {
+            // In case of EINPROGRESS, use getsockopt(SO_ERROR) to get the real
+            // error, when the connection attempt finished.
+            socklen_t ret_size = sizeof(ret);
+            getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &ret, &ret_size);
+            if (ret == EISCONN) {
+                errno = 0;
+            } else {
+                errno = ret;
+            }
+        } else {
+            errstr = strerror(errno);
+            goto err;
+        }
+    }
+
+    if (errno) {
+        errstr = strerror(errno);
+        goto err;
+    }
+    return 0;
+
+err:
+    assert(errstr);
+    __sockobj_close(L, s);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return -1;
+}
+
+static int
+__sockobj_send(lua_State *L, struct sockobj *s, const struct iovec *iov, int iovcnt, size_t *sent, struct timeout *tm) {
+    char *errstr;
+    if (s->fd == -1) {
+        errstr = ERROR_CLOSED;
+        goto err;
+    }
+    if (iovcnt > IOV_MAX) {
+        // a datagram can not be split
+        errstr = strerror(EMSGSIZE);
+        goto err;
+    }
+
+    int n = __sockobj_sendwait(L, s, iov, iovcnt, 0, tm, 0);
+    if (n < 0) {
+        switch (errno) {
+        case ETIMEDOUT:
+            errstr = ERROR_TIMEOUT;
+            goto err;
+        case EPIPE:
+            // EPIPE means the connection was closed.
+            errstr = ERROR_CLOSED;
+            goto err;
+        default:
+            errstr = strerror(errno);
+            goto err;
+        }
+    }
+    *sent = n;
+    return 0;
+
+err:
+    assert(errstr);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return -1;
+}
+
+static int
+__sockobj_sendto(lua_State *L, struct sockobj *s, const char *buf, size_t len, size_t *sent, struct sockaddr *addr, socklen_t addrlen, struct timeout *tm) {
+    char *errstr;
+    if (s->fd == -1) {
+        errstr = ERROR_CLOSED;
+        goto err;
+    }
+
+    while (1) {
+        int timeout = __waitfd(L, s, EVENT_WRITABLE, tm, 0);
+        if (timeout == -1) {
+            errstr = strerror(errno);
+            goto err;
+        } else if (timeout == 1) {
+            errstr = ERROR_TIMEOUT;
+            goto err;
+        } else if (s->fd == -1) {
+            // closed while waiting
+            errstr = ERROR_CLOSED;
+            goto err;
+        } else {
+            int n = sendto(s->fd, buf, len, 0, addr, addrlen);
+            if (n < 0) {
+                switch (errno) {
+                case EINTR:
+                case EAGAIN:
+                    continue;
+                case EPIPE:
+                    // EPIPE means the connection was closed.
+                    errstr = ERROR_CLOSED;
+                    goto err;
+                default:
+                    errstr = strerror(errno);
+                    goto err;
+                }
+            } else {
+                __sockobj_account(L, s, 0, n);
+                *sent = n;
+                return 0;
+            }
+        }
+    }
+
+err:
+    assert(errstr);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return -1;
+}
+
+/**
+ * Send all the iovcnt buffers of iov, in order. iov is updated as buffers are
+ * (partially) sent.
+ */
+static int
+__sockobj_write(lua_State *L, struct sockobj *s, struct iovec *iov, int iovcnt, int flags) {
+    char *errstr;
+    size_t total_sent = 0;
+    size_t len = 0;
+    size_t skip;
+    int i;
+    if (s->fd == -1) {
+        errstr = ERROR_CLOSED;
+        goto err;
+    }
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    struct timeout tm;
+    __sockobj_inittimeout(L, s, &tm, &total_sent);
+    skip = total_sent;
+    while (total_sent < len) {
+        // Skip the bytes already sent, which may span several buffers.
+        while (skip >= iov->iov_len) {
+            skip -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        iov->iov_base = (char *)iov->iov_base + skip;
+        iov->iov_len -= skip;
+        int n = __sockobj_sendwait(L, s, iov, iovcnt, flags, &tm, total_sent);
+        if (n < 0) {
+            switch (errno) {
+            case ETIMEDOUT:
+                errstr = ERROR_TIMEOUT;
+                goto err;
+            case EPIPE:
+                // EPIPE means the connection was closed.
+                errstr = ERROR_CLOSED;
+                goto err;
+            default:
+                errstr = strerror(errno);
+                goto err;
+            }
+        }
+        total_sent += n;
+        skip = n;
+    }
+
+    assert(total_sent == len);
+    lua_pushinteger(L, total_sent);
+    return 0;
+
+err:
+    assert(errstr);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return -1;
+}
+
+/**
+ * Send the data pending in the write buffer of the socket, if any.
+ *
+ * With MSG_MORE in flags, the kernel may hold back the last partial segment
+ * until more data is sent. Otherwise, a segment held back by a previous send is
+ * pushed out too, unless the user corked the socket.
+ *
+ * Returns 0 on success, or -1 with nil and an error message pushed.
+ */
+static int
+__sockobj_flush(lua_State *L, struct sockobj *s, int flags)
+{
+    if (s->wbuf && buffer_size(s->wbuf) > 0) {
+        struct iovec iov;
+        iov.iov_base = s->wbuf->pos;
+        iov.iov_len = buffer_size(s->wbuf);
+        int ret = __sockobj_write(L, s, &iov, 1, flags);
+        // Sent, or lost with the connection.
+        buffer_consume(s->wbuf, buffer_size(s->wbuf));
+        if (ret == -1)
+            return -1;
+        lua_pop(L, 1);
+    } else if ((s->sock_flags & SOCKOBJ_MORE) && !(flags & MSG_MORE)) {
+#ifdef TCP_CORK
+        if (s->fd != -1 && !(s->sock_flags & SOCKOBJ_CORK)) {
+            // Uncorking pushes the segment held back.
+            int flag = 0;
+            setsockopt(s->fd, IPPROTO_TCP, TCP_CORK, (void *)&flag, sizeof(flag));
+        }
+#endif
+    }
+    if (flags & MSG_MORE) {
+        s->sock_flags |= SOCKOBJ_MORE;
+    } else {
+        s->sock_flags &= ~SOCKOBJ_MORE;
+    }
+    return 0;
+}
+
+static int
+__sockobj_recv(lua_State *L, struct sockobj *s, char *buf, size_t buffersize, size_t *received, struct timeout *tm)
+{
+    char *errstr = NULL;
+
+    if (s->fd == -1) {
+        errstr = ERROR_CLOSED;
+        goto err;
+    }
+
+    int bytes_read = __sockobj_recvwait(L, s, buf, buffersize, tm, 0);
+    if (bytes_read > 0) {
+        *received = bytes_read;
+        return 0;
+    } else if (bytes_read == 0) {
+        errstr = ERROR_CLOSED;
+        goto err;
+    } else if (CHECK_ERRNO(ETIMEDOUT)) {
+        errstr = ERROR_TIMEOUT;
+        goto err;
+    } else {
+        errstr = strerror(errno);
+        goto err;
+    }
+
+err:
+    assert(errstr);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return -1;
+}
+
+/**
+ * recvfrom(), which also reads the segment size of a datagram coalesced by UDP
+ * GRO into segsize, if GRO is enabled on the socket. Otherwise, or if the
+ * datagram was not coalesced, the segment size is the size of the datagram.
+ *
+ * A coalesced datagram larger than len would lose whole segments, it fails
+ * with EMSGSIZE instead.
+ */
+static ssize_t
+__recvfrom(struct sockobj *s, char *buf, size_t len, struct sockaddr *addr, socklen_t *addrlen, size_t *segsize)
+{
+    ssize_t n;
+#ifdef UDP_GRO
+    if (s->sock_flags & SOCKOBJ_GRO) {
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = addr;
+        msg.msg_namelen = addrlen ? *addrlen : 0;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        n = recvmsg(s->fd, &msg, 0);
+        if (n < 0)
+            return n;
+        if (msg.msg_flags & MSG_TRUNC) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (addrlen)
+            *addrlen = msg.msg_namelen;
+        *segsize = n;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int size;
+                memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+                *segsize = size;
+            }
+        }
+        return n;
+    }
+#endif
+    n = recvfrom(s->fd, buf, len, 0, addr, addrlen);
+    if (n >= 0)
+        *segsize = n;
+    return n;
+}
+
+static int
+__sockobj_recvfrom(lua_State *L, struct sockobj *s, char *buf, size_t buffersize, size_t *received, struct sockaddr *addr, socklen_t *addrlen, size_t *segsize, struct timeout *tm)
+{
+    char *errstr = NULL;
+
+    if (s->fd == -1) {
+        errstr = ERROR_CLOSED;
+        goto err;
+    }
+
+    while (1) {
+        int timeout = __waitfd(L, s, EVENT_READABLE, tm, 0);
+        if (timeout == -1) {
+            errstr = strerror(errno);
+            goto err;
+        } else if (timeout == 1) {
+            errstr = ERROR_TIMEOUT;
+            goto err;
+        } else if (s->fd == -1) {
+            // closed while waiting
+            errstr = ERROR_CLOSED;
+            goto err;
+        } else {
+            int bytes_read = __recvfrom(s, buf, buffersize, addr, addrlen, segsize);
+            if (bytes_read > 0) {
+                __sockobj_account(L, s, bytes_read, 0);
+                *received = bytes_read;
+                return 0;
+            } else if (bytes_read == 0) {
+                errstr = ERROR_CLOSED;
+                goto err;
+            } else {
+                switch (errno) {
+                case EINTR:
+                case EAGAIN:
+                    // do nothing, continue
+                    continue;
+                default:
+                    errstr = strerror(errno);
+                    goto err;
+                }
+            }
+        }
+    }
+
+err:
+    assert(errstr);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return -1;
+}
+/**
+ * tcpsock, err = socket.tcp()
+ */
+static int
+socket_tcp(lua_State * L)
+{
+    struct sockobj *s = __sockobj_create(L, TCPSOCK_TYPENAME);
+    if (!s) {
+        return luaL_error(L, "out of memory");
+    }
+    return 1;
+}
+
+/**
+ * udpsock, err = socket.udp()
+ */
+static int
+socket_udp(lua_State * L)
+{
+    struct sockobj *s = __sockobj_create(L, UDPSOCK_TYPENAME);
+    if (!s) {
+        return luaL_error(L, "out of memory");
+    }
+    return 1;
+}
+
+/**
+ * addrs, err = socket.resolve(host, timeout?)
+ *
+ * Resolve host to its IPv4 and IPv6 addresses, on a helper thread: the calling
+ * coroutine is suspended meanwhile if it runs under socket.run().
+ *
+ * In case of success, it returns an array of address strings. Otherwise, it
+ * returns nil and a string describing the error.
+ */
+static int
+socket_resolve(lua_State * L)
+{
+    const char *host = luaL_checkstring(L, 1);
+    struct timeout tm;
+    struct resolver_result res;
+    char buf[INET6_ADDRSTRLEN];
+    int i;
+
+    timeout_init(&tm, luaL_optnumber(L, 2, -1));
+    if (__sockobj_resolve(L, &tm, host, AF_UNSPEC, &res, 0) == -1)
+        return 2;
+
+    lua_createtable(L, res.naddrs, 0);
+    for (i = 0; i < res.naddrs; i++) {
+        sockaddr_t *addr = (sockaddr_t *)&res.addrs[i];
+        if (addr->sa.sa_family == AF_INET6)
+            inet_ntop(AF_INET6, &addr->in6.sin6_addr, buf, sizeof(buf));
+        else
+            inet_ntop(AF_INET, &addr->in.sin_addr, buf, sizeof(buf));
+        lua_pushstring(L, buf);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+/**
+ * ok = socket.setdnsttl(ttl, negative_ttl?)
+ *
+ * Set how long, in seconds, resolved names are cached (60 by default) and how
+ * long failures are (5 by default, unchanged if omitted or negative). 0
+ * disables caching.
+ */
+static int
+socket_setdnsttl(lua_State * L)
+{
+    double ttl = luaL_checknumber(L, 1);
+    double negative_ttl = luaL_optnumber(L, 2, -1);
+    luaL_argcheck(L, ttl >= 0, 1, "ttl should not be negative");
+    resolver_setttl(timeout_fromsec(ttl), timeout_fromsec(negative_ttl));
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * ok, err = socket.sethost(name, addrs, delay?)
+ *
+ * Resolve name to addrs, an array of IPv4 and IPv6 address strings, instead of
+ * asking the system, as if it were in the hosts file. If delay is given, they
+ * are returned delay seconds after each lookup, as by a slow name server. addrs
+ * nil resolves name again.
+ */
+static int
+socket_sethost(lua_State * L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    double delay = luaL_optnumber(L, 3, 0);
+    struct resolver_result res;
+    int i, n;
+
+    memset(&res, 0, sizeof(res));
+    if (!lua_isnil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        n = (int)lua_rawlen(L, 2);
+        luaL_argcheck(L, n <= RESOLVER_MAXADDRS, 2, "too many addresses");
+        for (i = 0; i < n; i++) {
+            sockaddr_t *addr = (sockaddr_t *)&res.addrs[i];
+            const char *s;
+            lua_rawgeti(L, 2, i + 1);
+            s = lua_tostring(L, -1);
+            if (s && inet_pton(AF_INET, s, &addr->in.sin_addr) == 1) {
+                addr->in.sin_family = AF_INET;
+                res.addrlens[i] = sizeof(struct sockaddr_in);
+            } else if (s && inet_pton(AF_INET6, s, &addr->in6.sin6_addr) == 1) {
+                addr->in6.sin6_family = AF_INET6;
+                res.addrlens[i] = sizeof(struct sockaddr_in6);
+            } else {
+                return luaL_argerror(L, 2, "address strings expected");
+            }
+            lua_pop(L, 1);
+        }
+        res.naddrs = n;
+    }
+    if (resolver_sethost(name, lua_isnil(L, 2) ? NULL : &res, timeout_fromsec(delay)) == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static void
+__collect_fds(lua_State * L, int tab, fd_set * set, int *max_fd)
+{
+    if (lua_isnil(L, tab))
+        return;
+
+    luaL_checktype(L, tab, LUA_TTABLE);
+
+    int i = 1;
+    while (1) {
+        int fd = -1;
+        lua_pushnumber(L, i);
+        lua_gettable(L, tab);   // get ith fd
+
+        if (lua_isnil(L, -1)) {
+            // end of table loop
+            lua_pop(L, 1);
+            break;
+        }
+
+        if (lua_isnumber(L, -1)) {
+            fd = lua_tonumber(L, -1);
+            if (fd < 0) {
+                fd = -1;
+            }
+        } else {
+            // ignore
+            lua_pop(L, 1);
+            continue;
+        }
+
+        if (fd != -1) {
+            if (fd >= FD_SETSIZE) {
+                luaL_argerror(L, tab, "descriptor too large for set size");
+            }
+            if (*max_fd < fd) {
+                *max_fd = fd;
+            }
+            FD_SET(fd, set);
+        }
+
+        lua_pop(L, 1);
+        i++;
+    }
+}
+
+static void
+__return_fd(lua_State * L, fd_set * set, int max_fd)
+{
+    int fd;
+    int i = 1;
+    lua_newtable(L);
+    for (fd = 0; fd < max_fd; fd++) {
+        if (FD_ISSET(fd, set)) {
+            lua_pushnumber(L, i);
+            lua_pushnumber(L, fd);
+            lua_settable(L, -3);
+        }
+    }
+}
+
+/**
+ * readfds, writefds, err = socket.select(readfds, writefds[, timeout=-1])
+ *
+ *  `readfds`, `writefds` are all table of fds (which was returned from
+ *  sockobj:fileno()).
+ */
+static int
+socket_select(lua_State * L)
+{
+    int max_fd = -1;
+    fd_set rset, wset;
+    struct timeout tm;
+    double timeout = luaL_optnumber(L, 3, -1);
+    timeout_init(&tm, timeout);
+    FD_ZERO(&rset);
+    FD_ZERO(&wset);
+    __collect_fds(L, 1, &rset, &max_fd);
+    __collect_fds(L, 2, &wset, &max_fd);
+
+    int ret = __select(max_fd + 1, &rset, &wset, NULL, &tm);
+    if (ret > 0) {
+        __return_fd(L, &rset, max_fd + 1);
+        __return_fd(L, &wset, max_fd + 1);
+        return 2;
+    } else if (ret == 0) {
+        lua_pushnil(L);
+        lua_pushnil(L);
+        lua_pushstring(L, ERROR_TIMEOUT);
+        return 3;
+    } else {
+        lua_pushnil(L);
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 3;
+    }
+}
+
+/**
+ * Check whether the given argument is a socket object (tcp or udp).
+ */
+static struct sockobj *
+__checksockobj(lua_State *L, int idx)
+{
+    struct sockobj *s = luaL_testudata(L, idx, TCPSOCK_TYPENAME);
+    if (s == NULL)
+        s = luaL_testudata(L, idx, UDPSOCK_TYPENAME);
+    if (s == NULL)
+        luaL_argerror(L, idx, "socket object expected");
+    return s;
+}
+
+/**
+ * poller, err = socket.poller()
+ *
+ * Create a persistent poller object. Sockets are registered once, and the
+ * cost of poller:wait() grows with the number of ready sockets only.
+ */
+static int
+socket_poller(lua_State * L)
+{
+#ifdef HAVE_EPOLL
+    struct pollerobj *p =
+        (struct pollerobj *)lua_newuserdata(L, sizeof(struct pollerobj));
+    p->epfd = -1;
+    p->nevents = 0;
+    p->events = NULL;
+    luaL_setmetatable(L, POLLER_TYPENAME);
+
+    // fd -> socket object map, used to return socket objects from wait()
+    lua_newtable(L);
+    lua_setuservalue(L, -2);
+
+    p->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (p->epfd == -1) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "failed to create poller: %s", strerror(errno));
+        return 2;
+    }
+    p->events = malloc(POLLER_NEVENTS * sizeof(struct epoll_event));
+    if (p->events == NULL) {
+        return luaL_error(L, "out of memory");
+    }
+    p->nevents = POLLER_NEVENTS;
+    return 1;
+#else
+    lua_pushnil(L);
+    lua_pushstring(L, "poller is not supported on this platform");
+    return 2;
+#endif
+}
+
+#ifdef HAVE_EPOLL
+/**
+ * Remove the socket object at index 2 from the fd -> socket object map of the
+ * poller at index 1, whatever fd it was registered with.
+ *
+ * Returns 1 if it was registered, 0 otherwise.
+ */
+static int
+__poller_forget(lua_State *L)
+{
+    int found = 0;
+    lua_getuservalue(L, 1);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        if (lua_rawequal(L, -1, 2)) {
+            // Clearing a field during the traversal is allowed.
+            lua_pushvalue(L, -2);
+            lua_pushnil(L);
+            lua_rawset(L, -5);
+            found = 1;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return found;
+}
+
+static int
+__poller_ctl(lua_State *L, int op)
+{
+    struct pollerobj *p = getpollerobj(L);
+    struct sockobj *s = __checksockobj(L, 2);
+    struct epoll_event ev;
+    char *errstr = NULL;
+
+    if (p->epfd == -1) {
+        return luaL_error(L, "poller is closed");
+    }
+    if (s->fd == -1) {
+        // Closing the fd removed it from epoll already, the socket object is
+        // still to be forgotten, under the fd it was registered with.
+        if (op == EPOLL_CTL_DEL && __poller_forget(L))
+            goto done;
+        errstr = ERROR_CLOSED;
+        goto err;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = s->fd;
+    if (op != EPOLL_CTL_DEL) {
+        int events = luaL_checkinteger(L, 3);
+        if (events & EVENT_READABLE)
+            ev.events |= EPOLLIN;
+        if (events & EVENT_WRITABLE)
+            ev.events |= EPOLLOUT;
+        if (lua_toboolean(L, 4))
+            ev.events |= EPOLLET;
+    }
+    if (epoll_ctl(p->epfd, op, s->fd, &ev) == -1) {
+        errstr = strerror(errno);
+        goto err;
+    }
+
+    lua_getuservalue(L, 1);
+    if (op == EPOLL_CTL_DEL) {
+        lua_pushnil(L);
+    } else {
+        lua_pushvalue(L, 2);
+    }
+    lua_rawseti(L, -2, s->fd);
+    lua_pop(L, 1);
+
+done:
+    lua_pushboolean(L, 1);
+    return 1;
+
+err:
+    assert(errstr);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return 2;
+}
+
+/**
+ * ok, err = poller:register(sock, events[, edge=false])
+ *
+ * Start watching a socket. `events` is socket.EVENT_READABLE,
+ * socket.EVENT_WRITABLE or their sum. If `edge` is true, the socket is
+ * reported only when its readiness changes (edge-triggered), otherwise it is
+ * reported as long as it stays ready (level-triggered).
+ */
+static int
+poller_register(lua_State * L)
+{
+    return __poller_ctl(L, EPOLL_CTL_ADD);
+}
+
+/**
+ * ok, err = poller:modify(sock, events[, edge=false])
+ */
+static int
+poller_modify(lua_State * L)
+{
+    return __poller_ctl(L, EPOLL_CTL_MOD);
+}
+
+/**
+ * ok, err = poller:unregister(sock)
+ */
+static int
+poller_unregister(lua_State * L)
+{
+    return __poller_ctl(L, EPOLL_CTL_DEL);
+}
+
+/**
+ * readsocks, writesocks, err = poller:wait([timeout=-1])
+ *
+ * Wait for registered sockets to become ready. Returns two tables of socket
+ * objects. Sockets with a pending error or hangup are reported in both tables,
+ * so the next operation on them returns the error. A timeout of 0 polls the
+ * sockets without waiting.
+ */
+static int
+poller_wait(lua_State * L)
+{
+    struct pollerobj *p = getpollerobj(L);
+    struct timeout tm;
+    double timeout = luaL_optnumber(L, 2, -1);
+    int ret, i, nr = 0, nw = 0;
+
+    if (p->epfd == -1) {
+        return luaL_error(L, "poller is closed");
+    }
+
+    // 0 means no limit to timeout_init.
+    timeout_init(&tm, timeout);
+    do {
+        ret = __epoll_wait(p->epfd, p->events, p->nevents, timeout == 0 ? 0 : timeout_left(&tm, -1));
+    } while (ret == -1 && CHECK_ERRNO(EINTR));
+
+    if (ret < 0) {
+        lua_pushnil(L);
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 3;
+    } else if (ret == 0) {
+        lua_pushnil(L);
+        lua_pushnil(L);
+        lua_pushstring(L, ERROR_TIMEOUT);
+        return 3;
+    }
+
+    lua_getuservalue(L, 1);
+    lua_createtable(L, ret, 0);
+    lua_createtable(L, ret, 0);
+    for (i = 0; i < ret; i++) {
+        struct epoll_event *ev = &p->events[i];
+        uint32_t error = ev->events & (EPOLLERR | EPOLLHUP);
+        lua_rawgeti(L, -3, ev->data.fd);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            continue;
+        }
+        if (ev->events & (EPOLLIN | error)) {
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, -4, ++nr);
+        }
+        if (ev->events & (EPOLLOUT | error)) {
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, -3, ++nw);
+        }
+        lua_pop(L, 1);
+    }
+
+    // All slots used, there may be more ready sockets, grow for next time.
+    if (ret == p->nevents) {
+        struct epoll_event *events =
+            realloc(p->events, 2 * p->nevents * sizeof(struct epoll_event));
+        if (events) {
+            p->events = events;
+            p->nevents *= 2;
+        }
+    }
+    return 2;
+}
+#endif
+
+/**
+ * ok, err = poller:close()
+ */
+static int
+poller_close(lua_State * L)
+{
+    struct pollerobj *p = getpollerobj(L);
+    if (p->epfd != -1) {
+        close(p->epfd);
+        p->epfd = -1;
+    }
+#ifdef HAVE_EPOLL
+    if (p->events) {
+        free(p->events);
+        p->events = NULL;
+    }
+#endif
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int
+poller_tostring(lua_State * L)
+{
+    struct pollerobj *p = getpollerobj(L);
+    lua_pushfstring(L, "<poller: %d>", p->epfd);
+    return 1;
+}
+
+#ifdef HAVE_EPOLL
+/**
+ * Resume a task, then requeue or release it according to how it returned.
+ */
+static void
+__sched_resume(lua_State *L, struct scheduler *sched, struct task *t)
+{
+    int nargs = t->nargs;
+    int nresults;
+    int status;
+
+    t->nargs = 0;
+    sched->current = t;
+    status = compat_resume(t->co, L, nargs, &nresults);
+    sched->current = NULL;
+
+    if (status == LUA_YIELD) {
+        lua_pop(t->co, nresults);
+        if (!t->parked) {
+            // yielded by coroutine.yield(), let others run first
+            __sched_ready(sched, t);
+        }
+        return;
+    }
+
+    if (status != LUA_OK) {
+        const char *msg = lua_tostring(t->co, -1);
+        luaL_traceback(L, t->co, msg ? msg : "(error object is not a string)", 0);
+        fprintf(stderr, "ssocket: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+
+    __sched_unpark(sched, t);
+    if (t->prev) {
+        t->prev->succ = t->succ;
+    } else {
+        sched->tasks = t->succ;
+    }
+    if (t->succ)
+        t->succ->prev = t->prev;
+    luaL_unref(L, LUA_REGISTRYINDEX, t->ref);
+    sched->ntasks--;
+    if (t->resolvefd != -1)
+        close(t->resolvefd);
+    free(t);
+}
+
+/**
+ * Returns the scheduler of the Lua state, creates it if it does not exist.
+ * Returns NULL on error (errno is set).
+ */
+static struct scheduler *
+__sched_create(lua_State *L)
+{
+    struct scheduler *sched = __sched_get(L);
+    if (sched)
+        return sched;
+    sched = (struct scheduler *)lua_newuserdata(L, sizeof(struct scheduler));
+    memset(sched, 0, sizeof(struct scheduler));
+    sched->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sched->epfd == -1) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    sched->now = timeout_gettime();
+    timerwheel_init(&sched->wheel, __sched_ticks(sched->now, 0));
+    luaL_setmetatable(L, SCHEDULER_TYPENAME);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &scheduler_key);
+    return sched;
+}
+
+/**
+ * Close an idle socket whose idle timer expired, or re-arm the timer if the
+ * socket has been active since it was armed.
+ */
+static void
+__sched_reap(lua_State *L, struct scheduler *sched, struct sockobj *s, int64_t now)
+{
+    int64_t deadline = s->last_active + timeout_fromsec(s->idle_timeout);
+    if (s->idle_timeout <= 0 || s->fd == -1)
+        return;
+    if (deadline > now) {
+        __sched_addtimer(sched, &s->idle, deadline);
+        return;
+    }
+    // waiters are woken up and get ERROR_CLOSED
+    if (__sockobj_close(L, s) == -1)
+        lua_pop(L, 2);
+}
+
+static int
+sched_gc(lua_State * L)
+{
+    struct scheduler *sched = (struct scheduler *)lua_touserdata(L, 1);
+    // Detach all timers, sockets may be collected after the scheduler.
+    timerwheel_expire(&sched->wheel, UINT64_MAX);
+    while (sched->tasks) {
+        struct task *t = sched->tasks;
+        sched->tasks = t->succ;
+        if (t->resolvefd != -1)
+            close(t->resolvefd);
+        free(t);
+    }
+    sched->ntasks = 0;
+    sched->runq_head = sched->runq_tail = NULL;
+    if (sched->fds) {
+        free(sched->fds);
+        sched->fds = NULL;
+    }
+    sched->nfds = 0;
+    if (sched->epfd != -1) {
+        close(sched->epfd);
+        sched->epfd = -1;
+    }
+    return 0;
+}
+#endif
+
+/**
+ * co, err = socket.spawn(func, ...)
+ *
+ * Create a coroutine running func(...) under the scheduler (cosocket mode).
+ * Within it, socket operations which would block yield to the scheduler
+ * instead, so other coroutines keep running. The coroutine starts at the next
+ * iteration of socket.run().
+ */
+static int
+socket_spawn(lua_State * L)
+{
+#ifdef HAVE_EPOLL
+    struct scheduler *sched;
+    struct task *t;
+    lua_State *co;
+    int nargs = lua_gettop(L) - 1;
+
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+
+    sched = __sched_create(L);
+    if (sched == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "failed to create scheduler: %s", strerror(errno));
+        return 2;
+    }
+
+    t = malloc(sizeof(struct task));
+    if (t == NULL) {
+        return luaL_error(L, "out of memory");
+    }
+    memset(t, 0, sizeof(struct task));
+    t->fd = -1;
+    t->resolvefd = -1;
+    timer_init(&t->timer, TIMER_TASK, t);
+    t->nargs = nargs;
+
+    co = lua_newthread(L);
+    lua_insert(L, 1);
+    lua_xmove(L, co, nargs + 1);    /* func and args */
+    lua_pushvalue(L, 1);
+    t->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    t->co = co;
+
+    t->succ = sched->tasks;
+    if (sched->tasks)
+        sched->tasks->prev = t;
+    sched->tasks = t;
+    sched->ntasks++;
+    __sched_ready(sched, t);
+    return 1;
+#else
+    lua_pushnil(L);
+    lua_pushstring(L, "scheduler is not supported on this platform");
+    return 2;
+#endif
+}
+
+/**
+ * ok, err = socket.run()
+ *
+ * Run the scheduler until all spawned coroutines are finished.
+ *
+ * Errors raised in coroutines are reported on stderr, the others keep
+ * running.
+ */
+static int
+socket_run(lua_State * L)
+{
+#ifdef HAVE_EPOLL
+    struct epoll_event events[SCHED_NEVENTS];
+    struct scheduler *sched = __sched_get(L);
+    if (sched == NULL) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    if (sched->running) {
+        return luaL_error(L, "scheduler is already running");
+    }
+
+    sched->running = 1;
+    sched->now = timeout_gettime();
+    while (sched->ntasks > 0) {
+        struct task *t;
+        struct timer *timer, *next;
+        int n, i;
+        int64_t timeout = -1;
+
+        // Run tasks ready so far, tasks made ready by them run next round.
+        t = sched->runq_head;
+        sched->runq_head = sched->runq_tail = NULL;
+        while (t) {
+            struct task *next = t->next;
+            __sched_resume(L, sched, t);
+            t = next;
+        }
+        if (sched->ntasks == 0)
+            break;
+
+        if (sched->runq_head) {
+            timeout = 0;
+        } else if (sched->wheel.count > 0) {
+            // The wheel lags behind if timers were added out of the loop.
+            uint64_t ticks = timerwheel_timeout(&sched->wheel);
+            uint64_t lag = __sched_ticks(sched->now, 0) - sched->wheel.now;
+            ticks = ticks > lag ? ticks - lag : 0;
+            timeout = ticks < (uint64_t)(INT64_MAX / 1000) ? (int64_t)ticks * 1000 : INT64_MAX;
+        }
+
+        n = __epoll_wait(sched->epfd, events, SCHED_NEVENTS, timeout);
+        // The only clock read of the iteration, tasks use the cached clock.
+        sched->now = timeout_gettime();
+        if (n == -1 && !CHECK_ERRNO(EINTR)) {
+            sched->running = 0;
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+
+        for (i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            uint32_t ev = events[i].events;
+            uint32_t error = ev & (EPOLLERR | EPOLLHUP);
+            struct fdwaiters *w = &sched->fds[fd];
+            int unwanted = 0;
+            if (ev & (EPOLLIN | error)) {
+                if (w->reader) {
+                    __sched_wake(sched, w->reader, 1);
+                } else {
+                    unwanted = 1;
+                }
+            }
+            if (ev & (EPOLLOUT | error)) {
+                if (w->writer) {
+                    __sched_wake(sched, w->writer, 1);
+                } else {
+                    unwanted = 1;
+                }
+            }
+            // Registrations are kept after waking up waiters, they are very
+            // likely to wait again. Drop them only when they are not wanted.
+            if (unwanted)
+                __sched_watch(sched, fd);
+        }
+
+        // Turn the wheel even without timers, so it keeps up with the clock.
+        timer = timerwheel_expire(&sched->wheel, __sched_ticks(sched->now, 0));
+        for (; timer; timer = next) {
+            next = timer->next;
+            if (timer->kind == TIMER_IDLE) {
+                __sched_reap(L, sched, (struct sockobj *)timer->data, sched->now);
+            } else {
+                t = (struct task *)timer->data;
+                // it may be woken up by a socket reaped just before
+                if (t->parked)
+                    __sched_wake(sched, t, 0);
+            }
+        }
+    }
+    sched->running = 0;
+
+    lua_pushboolean(L, 1);
+    return 1;
+#else
+    lua_pushnil(L);
+    lua_pushstring(L, "scheduler is not supported on this platform");
+    return 2;
+#endif
+}
+
+/**
+ * socket.sleep(seconds)
+ *
+ * Sleep for given seconds. In a coroutine created by socket.spawn(), only the
+ * coroutine sleeps, and socket.sleep(0) lets other coroutines run.
+ */
+static int
+socket_sleep(lua_State * L)
+{
+    double seconds = luaL_checknumber(L, 1);
+    struct scheduler *sched;
+    struct task *t = __sched_task(L, &sched);
+
+    // Where the coroutine cannot yield (a metamethod, a sort comparator),
+    // the whole thread sleeps.
+    if (t && compat_isyieldable(L)) {
+        if (seconds > 0)
+            __sched_park(sched, t, -1, EVENT_NONE, sched->now + timeout_fromsec(seconds));
+        return lua_yield(L, 0);
+    }
+
+    if (seconds > 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)seconds;
+        ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1.0e9);
+        while (nanosleep(&ts, &ts) == -1 && CHECK_ERRNO(EINTR))
+            ;
+    }
+    return 0;
+}
+
+/*** Relay ***/
+
+/* One direction of a relay, from a socket to the other */
+struct relaydir {
+    struct buffer *head;        /* data read ahead from the source, sent first */
+#ifdef HAVE_SPLICE
+    int pipe[2];
+#else
+    char data[RELAY_BUFSIZE];
+    size_t pos;
+#endif
+    size_t pending;             /* bytes read but not sent yet */
+    uint64_t bytes;             /* bytes sent */
+    int eof;                    /* end of stream read from the source */
+    int shut;                   /* end of stream sent to the destination */
+};
+
+/* State of socket.relay(), kept on the stack while it is suspended */
+struct relay {
+    int epfd;                   /* waits for both sockets at once, -1 if none */
+    int events[2];              /* registered in epfd, -1 if not registered */
+    struct relaydir dir[2];     /* dir[0] from a to b, dir[1] from b to a */
+};
+
+/**
+ * Release the pipes and buffers of the relay, on top of the stack. It is safe
+ * to call it twice.
+ */
+static int
+relay_gc(lua_State * L)
+{
+    struct relay *r = (struct relay *)lua_touserdata(L, -1);
+    int i;
+    if (r->epfd != -1) {
+        close(r->epfd);
+        r->epfd = -1;
+    }
+    for (i = 0; i < 2; i++) {
+        struct relaydir *d = &r->dir[i];
+#ifdef HAVE_SPLICE
+        if (d->pipe[0] != -1) {
+            close(d->pipe[0]);
+            close(d->pipe[1]);
+            d->pipe[0] = d->pipe[1] = -1;
+        }
+#endif
+        if (d->head) {
+            buffer_delete(d->head);
+            d->head = NULL;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Push a new relay from a to b. Data read ahead by a and b is taken over once
+ * the relay is set up, it stays with the sockets otherwise.
+ *
+ * Returns NULL on error, with errno set.
+ */
+static struct relay *
+__relay_create(lua_State *L, struct sockobj *a, struct sockobj *b)
+{
+    struct relay *r = (struct relay *)lua_newuserdata(L, sizeof(struct relay));
+    int i;
+    memset(r, 0, sizeof(*r));
+    r->epfd = -1;
+    r->events[0] = r->events[1] = -1;
+#ifdef HAVE_SPLICE
+    for (i = 0; i < 2; i++)
+        r->dir[i].pipe[0] = r->dir[i].pipe[1] = -1;
+#endif
+    luaL_setmetatable(L, RELAY_TYPENAME);
+
+#ifdef HAVE_SPLICE
+    for (i = 0; i < 2; i++) {
+        if (pipe2(r->dir[i].pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+            return NULL;
+    }
+#endif
+#ifdef HAVE_EPOLL
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd == -1)
+        return NULL;
+#endif
+    (void)i;
+    r->dir[0].head = a->buf;
+    a->buf = NULL;
+    r->dir[1].head = b->buf;
+    b->buf = NULL;
+    return r;
+}
+
+/**
+ * Give the data read ahead and not sent yet back to the sockets it was taken
+ * from, in front of anything they read since.
+ */
+static void
+__relay_giveback(struct relay *r, struct sockobj *socks[2])
+{
+    int i;
+    for (i = 0; i < 2; i++) {
+        struct relaydir *d = &r->dir[i];
+        struct sockobj *src = socks[i];
+        if (d->head == NULL || buffer_size(d->head) == 0 || src->fd == -1)
+            continue;
+        if (src->buf) {
+            size_t size = buffer_size(src->buf);
+            if (buffer_reserve(d->head, size) == -1)
+                continue;
+            memcpy(d->head->last, src->buf->pos, size);
+            d->head->last += size;
+            buffer_delete(src->buf);
+        }
+        src->buf = d->head;
+        d->head = NULL;
+    }
+}
+
+/* Whether the direction has data read but not sent */
+#define __relay_busy(d) ((d)->pending > 0 || ((d)->head && buffer_size((d)->head) > 0))
+
+/**
+ * Read from fd into the direction, which is empty, without blocking.
+ *
+ * Returns the number of bytes read, 0 at the end of stream, or -1 on error
+ * with errno set.
+ */
+static ssize_t
+__relay_in(struct relaydir *d, int fd)
+{
+    ssize_t n;
+#ifdef HAVE_SPLICE
+    n = splice(fd, NULL, d->pipe[1], NULL, RELAY_BUFSIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+    n = recv(fd, d->data, RELAY_BUFSIZE, 0);
+    d->pos = 0;
+#endif
+    if (n > 0)
+        d->pending = n;
+    return n;
+}
+
+/**
+ * Send the data of the direction to fd, without blocking: data read ahead
+ * first, then data read by __relay_in.
+ *
+ * Returns the number of bytes sent, or -1 on error with errno set.
+ */
+static ssize_t
+__relay_out(struct relaydir *d, int fd)
+{
+    ssize_t n;
+    if (d->head && buffer_size(d->head) > 0) {
+        n = send(fd, d->head->pos, buffer_size(d->head), 0);
+        if (n > 0)
+            buffer_consume(d->head, n);
+        return n;
+    }
+#ifdef HAVE_SPLICE
+    n = splice(d->pipe[0], NULL, fd, NULL, d->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+    n = send(fd, d->data + d->pos, d->pending, 0);
+    if (n > 0)
+        d->pos += n;
+#endif
+    if (n > 0)
+        d->pending -= n;
+    return n;
+}
+
+/**
+ * Wait until one of the sockets is ready for the events it waits for.
+ *
+ * See __waitrawfd for the return value.
+ */
+static int
+__relay_wait(lua_State *L, struct relay *r, int fds[2], int events[2], struct timeout *tm)
+{
+#ifdef HAVE_EPOLL
+    int i;
+    for (i = 0; i < 2; i++) {
+        struct epoll_event ev;
+        int op;
+        if (events[i] == r->events[i] || (events[i] == 0 && r->events[i] == -1))
+            continue;
+        // A socket not waited for is removed, a hang up would be reported
+        // again and again otherwise.
+        memset(&ev, 0, sizeof(ev));
+        ev.data.fd = fds[i];
+        if (events[i] & EVENT_READABLE)
+            ev.events |= EPOLLIN;
+        if (events[i] & EVENT_WRITABLE)
+            ev.events |= EPOLLOUT;
+        if (events[i] == 0)
+            op = EPOLL_CTL_DEL;
+        else
+            op = r->events[i] == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        if (epoll_ctl(r->epfd, op, fds[i], &ev) == -1)
+            return -1;
+        r->events[i] = events[i] == 0 ? -1 : events[i];
+    }
+    // The epoll instance is readable when a socket is ready, a coroutine
+    // can wait for both sockets at once.
+    return __waitrawfd(L, r->epfd, EVENT_READABLE, tm, 0);
+#else
+    struct pollfd pollfds[2];
+    int ret;
+    (void)L;
+    (void)r;
+    // A negative fd is ignored, a hang up would be reported again and again
+    // otherwise.
+    pollfds[0].fd = events[0] ? fds[0] : -1;
+    pollfds[0].events = events[0];
+    pollfds[1].fd = events[1] ? fds[1] : -1;
+    pollfds[1].events = events[1];
+    do {
+        int64_t left = timeout_left(tm, -1);
+        if (left == 0)
+            return 1;
+        ret = poll(pollfds, 2, timeout_ms(left));
+    } while (ret == -1 && CHECK_ERRNO(EINTR));
+    if (ret < 0)
+        return -1;
+    return ret == 0 ? 1 : 0;
+#endif
+}
+
+/**
+ * sent, received, err = socket.relay(a, b, opts?)
+ *
+ * Relay data between tcp sockets a and b in both directions, until the end of
+ * stream is relayed both ways, or an error occurs.
+ *
+ * opts is a table of options:
+ *  - idle: seconds without data relayed before giving up, no limit by default
+ *  - halfclose: false to return as soon as a side ends its stream, instead of
+ *    shutting down the other side for writing and relaying the other way until
+ *    it ends its stream too
+ *
+ * It returns the number of bytes relayed from a to b and from b to a. In case
+ * of error, it returns nil, a string describing the error and these numbers.
+ */
+static int
+socket_relay(lua_State * L)
+{
+    struct sockobj *a = (struct sockobj *)luaL_checkudata(L, 1, TCPSOCK_TYPENAME);
+    struct sockobj *b = (struct sockobj *)luaL_checkudata(L, 2, TCPSOCK_TYPENAME);
+    struct sockobj *socks[2];
+    struct relay *r;
+    double idle = -1;
+    int halfclose = 1;
+    char *errstr = NULL;
+    int i;
+
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_getfield(L, 3, "idle");
+        idle = luaL_optnumber(L, -1, -1);
+        lua_getfield(L, 3, "halfclose");
+        if (!lua_isnil(L, -1))
+            halfclose = lua_toboolean(L, -1);
+        lua_pop(L, 2);
+    }
+    socks[0] = a;
+    socks[1] = b;
+
+    /* The relay is kept on the stack while suspended (the continuation sees the
+     * same stack), so that data in flight survives restarts. */
+    r = (struct relay *)luaL_testudata(L, 4, RELAY_TYPENAME);
+    if (r == NULL) {
+        lua_settop(L, 3);
+        if (a->fd == -1 || b->fd == -1) {
+            errstr = ERROR_CLOSED;
+            goto err;
+        }
+        // Data written before goes first.
+        for (i = 0; i < 2; i++) {
+            if (__sockobj_flush(L, socks[i], 0) == -1)
+                return 2;
+        }
+        r = __relay_create(L, a, b);
+        if (r == NULL) {
+            errstr = strerror(errno);
+            goto err;
+        }
+    }
+
+    struct timeout tm;
+    if (!__sockobj_inittimeout(L, a, &tm, NULL))
+        timeout_init(&tm, idle);
+
+    while (1) {
+        int fds[2], events[2] = {0, 0};
+        int progress = 0;
+        if (a->fd == -1 || b->fd == -1) {
+            errstr = ERROR_CLOSED;
+            goto err;
+        }
+        fds[0] = a->fd;
+        fds[1] = b->fd;
+        for (i = 0; i < 2; i++) {
+            struct relaydir *d = &r->dir[i];
+            struct sockobj *src = socks[i], *dst = socks[1 - i];
+            ssize_t n;
+            if (__relay_busy(d)) {
+                n = __relay_out(d, dst->fd);
+                if (n > 0) {
+                    d->bytes += n;
+                    __sockobj_account(L, dst, 0, n);
+                    progress = 1;
+                } else if (CHECK_ERRNO(EAGAIN)) {
+                    events[1 - i] |= EVENT_WRITABLE;
+                } else if (!CHECK_ERRNO(EINTR)) {
+                    errstr = CHECK_ERRNO(EPIPE) || CHECK_ERRNO(ECONNRESET) ? ERROR_CLOSED : strerror(errno);
+                    goto err;
+                }
+            }
+            if (!__relay_busy(d)) {
+                // Returning at the first end of stream, nothing more is read
+                // once one was, only data in flight is sent.
+                if (!d->eof && (halfclose || !(r->dir[0].eof || r->dir[1].eof))) {
+                    n = __relay_in(d, src->fd);
+                    if (n > 0) {
+                        __sockobj_account(L, src, n, 0);
+                        progress = 1;
+                    } else if (n == 0) {
+                        d->eof = 1;
+                    } else if (CHECK_ERRNO(EAGAIN)) {
+                        events[i] |= EVENT_READABLE;
+                    } else if (!CHECK_ERRNO(EINTR)) {
+                        errstr = CHECK_ERRNO(ECONNRESET) ? ERROR_CLOSED : strerror(errno);
+                        goto err;
+                    }
+                }
+                if (d->eof && !d->shut) {
+                    // Everything was sent, pass the end of stream on, unless
+                    // returning at the first one.
+                    if (halfclose)
+                        shutdown(dst->fd, SHUT_WR);
+                    d->shut = 1;
+                }
+            }
+        }
+        if (r->dir[0].shut && r->dir[1].shut)
+            break;
+        if (!halfclose && (r->dir[0].shut || r->dir[1].shut) &&
+                !__relay_busy(&r->dir[0]) && !__relay_busy(&r->dir[1]))
+            break;
+        if (progress) {
+            timeout_init(&tm, idle);
+            continue;
+        }
+        int timeout = __relay_wait(L, r, fds, events, &tm);
+        if (timeout == -1) {
+            errstr = strerror(errno);
+            goto err;
+        } else if (timeout == 1) {
+            errstr = ERROR_TIMEOUT;
+            goto err;
+        }
+    }
+
+    lua_pushinteger(L, (lua_Integer)r->dir[0].bytes);
+    lua_pushinteger(L, (lua_Integer)r->dir[1].bytes);
+    lua_pushvalue(L, 4);
+    relay_gc(L);
+    lua_pop(L, 1);
+    return 2;
+
+err:
+    assert(errstr);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    r = (struct relay *)luaL_testudata(L, 4, RELAY_TYPENAME);
+    lua_pushinteger(L, r ? (lua_Integer)r->dir[0].bytes : 0);
+    lua_pushinteger(L, r ? (lua_Integer)r->dir[1].bytes : 0);
+    if (r) {
+        // Do not wait for a collection to release the pipes and epoll fd.
+        __relay_giveback(r, socks);
+        lua_pushvalue(L, 4);
+        relay_gc(L);
+        lua_pop(L, 1);
+    }
+    return 4;
+}
+
+/*** Workers ***/
+
+int luaopen_ssocket(lua_State * L);
+
+/**
+ * Get the CPUs the process may run on, at most `max`.
+ *
+ * Returns the number of CPUs.
+ */
+static int
+__worker_cpus(int *cpus, int max)
+{
+    int n = 0;
+#ifdef HAVE_SCHED_AFFINITY
+    cpu_set_t set;
+    int cpu;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+            if (CPU_ISSET(cpu, &set))
+                cpus[n++] = cpu;
+        }
+        return n;
+    }
+#endif
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (n = 0; n < ncpus && n < max; n++)
+        cpus[n] = n;
+    return n > 0 ? n : 1;
+}
+
+/**
+ * Steer connections to the listener of the worker pinned to the CPU which
+ * handles them, with a classic BPF program attached to the reuseport group.
+ *
+ * Listeners join the group in order of listen(), i.e. in order of worker ids.
+ * Connections handled by another CPU are spread by CPU number.
+ */
+static int
+__worker_steer(struct worker *workers, int n)
+{
+#if defined(HAVE_REUSEPORT_CBPF) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    struct sock_filter *code;
+    struct sock_fprog prog;
+    int i, len = 0, ret;
+
+    code = malloc(sizeof(struct sock_filter) * (2 * n + 3));
+    if (code == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    // A = current CPU
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (i = 0; i < n; i++) {
+        if (workers[i].cpu < 0)
+            continue;
+        // if (A == cpu) return i
+        code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, workers[i].cpu, 0, 1);
+        code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    // return A % n
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n);
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+    prog.len = len;
+    prog.filter = code;
+    ret = setsockopt(workers[0].listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+    free(code);
+    return ret;
+#else
+    (void)workers;
+    (void)n;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/**
+ * Call sock:method(...) in the Lua state of a worker, arguments are on the top
+ * of the stack.
+ *
+ * Returns NULL on success, the error message (on the top of the stack)
+ * otherwise.
+ */
+static const char *
+__worker_callmethod(lua_State *W, int sock, const char *method, int nargs)
+{
+    lua_getfield(W, sock, method);
+    lua_insert(W, -(nargs + 1));
+    lua_pushvalue(W, sock);
+    lua_insert(W, -(nargs + 1));
+    if (lua_pcall(W, nargs + 1, 2, 0) != LUA_OK)
+        return lua_tostring(W, -1);
+    if (lua_isnil(W, -2))
+        return lua_tostring(W, -1);
+    lua_pop(W, 2);
+    return NULL;
+}
+
+/**
+ * Create the Lua state of a worker, with the script function, its listener
+ * and its info table on the stack.
+ *
+ * Returns NULL on success, the error message otherwise.
+ */
+static const char *
+__worker_create(lua_State *L, struct worker *w, int nworkers, const char *script, const char *host, int port, int backlog)
+{
+    static const char *paths[] = { "path", "cpath" };
+    lua_State *W;
+    struct sockobj *s;
+    const char *errstr;
+    int i;
+
+    W = luaL_newstate();
+    if (W == NULL)
+        return "out of memory";
+    w->L = W;
+    luaL_openlibs(W);
+
+    // Modules are found as in the calling state.
+    lua_getglobal(L, "package");
+    lua_getglobal(W, "package");
+    for (i = 0; i < 2; i++) {
+        lua_getfield(L, -1, paths[i]);
+        if (lua_isstring(L, -1)) {
+            lua_pushstring(W, lua_tostring(L, -1));
+            lua_setfield(W, -2, paths[i]);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    lua_pop(W, 1);
+
+    // Sockets created in the state account to the worker.
+    lua_pushlightuserdata(W, w);
+    lua_rawsetp(W, LUA_REGISTRYINDEX, &worker_key);
+
+    luaL_requiref(W, "ssocket", luaopen_ssocket, 0);    /* 1: module */
+    lua_createtable(W, 0, 3);                           /* 2: socket.worker */
+    lua_pushinteger(W, w->id);
+    lua_setfield(W, -2, "id");
+    lua_pushinteger(W, w->cpu);
+    lua_setfield(W, -2, "cpu");
+    lua_pushinteger(W, nworkers);
+    lua_setfield(W, -2, "n");
+    lua_pushvalue(W, -1);
+    lua_setfield(W, 1, "worker");
+
+    if (luaL_loadfile(W, script) != LUA_OK)             /* 3: script */
+        return lua_tostring(W, -1);
+
+    s = __sockobj_create(W, TCPSOCK_TYPENAME);          /* 4: listener */
+    s->sock_flags |= SOCKOBJ_REUSEADDR | SOCKOBJ_REUSEPORT;
+    lua_pushstring(W, host);
+    lua_pushinteger(W, port);
+    if ((errstr = __worker_callmethod(W, 4, "bind", 2)) != NULL)
+        return errstr;
+    lua_pushinteger(W, backlog);
+    if ((errstr = __worker_callmethod(W, 4, "listen", 1)) != NULL)
+        return errstr;
+    w->listenfd = s->fd;
+
+    lua_pushvalue(W, 2);                                /* 5: info */
+    return NULL;
+}
+
+static void *
+__worker_main(void *arg)
+{
+    struct worker *w = (struct worker *)arg;
+    lua_State *W = w->L;
+
+#ifdef HAVE_SCHED_AFFINITY
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+
+    if (lua_pcall(W, 2, 0, 0) != LUA_OK) {
+        const char *msg = lua_tostring(W, -1);
+        w->error = strdup(msg ? msg : "(error object is not a string)");
+    }
+    return NULL;
+}
+
+static void
+__worker_pushstats(lua_State *L, struct worker *w)
+{
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, w->id);
+    lua_setfield(L, -2, "id");
+    lua_pushinteger(L, w->cpu);
+    lua_setfield(L, -2, "cpu");
+    lua_pushnumber(L, (lua_Number)w->accepted);
+    lua_setfield(L, -2, "accepted");
+    lua_pushnumber(L, (lua_Number)w->received);
+    lua_setfield(L, -2, "received");
+    lua_pushnumber(L, (lua_Number)w->sent);
+    lua_setfield(L, -2, "sent");
+    if (w->error) {
+        lua_pushstring(L, w->error);
+        lua_setfield(L, -2, "error");
+    }
+}
+
+/**
+ * stats, err = socket.workers(options)
+ *
+ * Run a Lua script in N threads, each with its own Lua state and its own TCP
+ * listener bound to the same address with SO_REUSEPORT, so the kernel spreads
+ * connections across them.
+ *
+ * Options:
+ *  script      path of the script, called with the listener and the worker
+ *              info table (also available as socket.worker)
+ *  host, port  address to listen on
+ *  n           number of workers, defaults to the number of CPUs
+ *  backlog     defaults to 128
+ *  pin         pin worker i to the i-th CPU
+ *  steer       steer connections to the worker pinned to the CPU handling
+ *              them, defaults to pin
+ *
+ * Blocks until all workers return, then returns an array of per-worker stats.
+ */
+static int
+socket_workers(lua_State * L)
+{
+    struct worker *workers;
+    const char *script, *host, *errstr = NULL;
+    int port, n, backlog, pin, steer;
+    int cpus[CPU_SETSIZE_MAX];
+    int ncpus, i, started = 0;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "script");
+    lua_getfield(L, 1, "host");
+    lua_getfield(L, 1, "port");
+    lua_getfield(L, 1, "n");
+    lua_getfield(L, 1, "backlog");
+    lua_getfield(L, 1, "pin");
+    lua_getfield(L, 1, "steer");
+    script = luaL_checkstring(L, 2);
+    host = luaL_checkstring(L, 3);
+    port = luaL_checkinteger(L, 4);
+    ncpus = __worker_cpus(cpus, CPU_SETSIZE_MAX);
+    n = luaL_optinteger(L, 5, ncpus);
+    backlog = luaL_optinteger(L, 6, 128);
+    pin = lua_toboolean(L, 7);
+    steer = lua_isnil(L, 8) ? pin : lua_toboolean(L, 8);
+    if (n < 1)
+        return luaL_argerror(L, 1, "n must be positive");
+
+    workers = calloc(n, sizeof(struct worker));
+    if (workers == NULL)
+        return luaL_error(L, "out of memory");
+
+    for (i = 0; i < n; i++) {
+        struct worker *w = &workers[i];
+        w->id = i + 1;
+        w->cpu = pin ? cpus[i % ncpus] : -1;
+        w->listenfd = -1;
+        errstr = __worker_create(L, w, n, script, host, port, backlog);
+        if (errstr) {
+            lua_pushfstring(L, "worker %d: %s", w->id, errstr);
+            goto err;
+        }
+    }
+    if (steer) {
+        if (__worker_steer(workers, n) == -1) {
+            lua_pushfstring(L, "failed to steer connections: %s", strerror(errno));
+            goto err;
+        }
+    }
+
+    for (; started < n; started++) {
+        struct worker *w = &workers[started];
+        int ret = pthread_create(&w->thread, NULL, __worker_main, w);
+        if (ret != 0) {
+            lua_pushfstring(L, "failed to create worker: %s", strerror(ret));
+            goto err;
+        }
+    }
+
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++) {
+        struct worker *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        __worker_pushstats(L, w);
+        lua_rawseti(L, -2, i + 1);
+        lua_close(w->L);
+        free(w->error);
+    }
+    free(workers);
+    return 1;
+
+err:
+    // Workers started so far run until they return.
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+    for (i = 0; i < n; i++) {
+        if (workers[i].L)
+            lua_close(workers[i].L);
+        free(workers[i].error);
+    }
+    free(workers);
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;
+}
+
+/*** Bytes ***/
+
+/**
+ * Translate string.sub() style indices i and j into an offset and a length in
+ * a buffer of len bytes.
+ */
+static void
+__slice(lua_Integer i, lua_Integer j, size_t len, size_t *offset, size_t *count)
+{
+    if (i < 0)
+        i = (lua_Integer)len + i + 1;
+    if (i < 1)
+        i = 1;
+    if (j < 0)
+        j = (lua_Integer)len + j + 1;
+    if (j > (lua_Integer)len)
+        j = (lua_Integer)len;
+    if (i > j) {
+        *offset = 0;
+        *count = 0;
+    } else {
+        *offset = (size_t)(i - 1);
+        *count = (size_t)(j - i + 1);
+    }
+}
+
+/**
+ * Get the data to send at index idx, a string or a bytes object.
+ *
+ * If slice is non-zero, optional indices i and j at idx + 1 and idx + 2
+ * select a part of the data, as in string.sub(). No copy is made either way.
+ */
+static const char *
+__checkdata(lua_State *L, int idx, size_t *len, int slice)
+{
+    const char *data;
+    size_t size;
+    struct bytesobj *b = (struct bytesobj *)luaL_testudata(L, idx, BYTES_TYPENAME);
+    if (b) {
+        data = b->data;
+        size = b->len;
+    } else {
+        data = luaL_checklstring(L, idx, &size);
+    }
+    if (!slice) {
+        *len = size;
+        return data;
+    }
+    size_t offset;
+    __slice(luaL_optinteger(L, idx + 1, 1), luaL_optinteger(L, idx + 2, -1), size, &offset, len);
+    return data + offset;
+}
+
+/**
+ * Get the data to send at index idx as buffers: a string or bytes object (with
+ * optional i and j, see __checkdata), or an array of them, whose elements may
+ * also be slices {data, i, j}. No copy is made.
+ *
+ * The buffers are stored from iov[first], the first ones are left to the
+ * caller. Up to n buffers are stored in iov. A larger array is allocated as a
+ * userdata pushed on the stack, so that it is collected with it.
+ */
+static struct iovec *
+__checkiov(lua_State *L, int idx, struct iovec *iov, int n, int first, int *iovcnt)
+{
+    size_t len;
+    int i, count;
+    if (lua_type(L, idx) != LUA_TTABLE) {
+        iov[first].iov_base = (char *)__checkdata(L, idx, &len, 1);
+        iov[first].iov_len = len;
+        *iovcnt = first + 1;
+        return iov;
+    }
+    count = first + (int)lua_rawlen(L, idx);
+    if (count > n)
+        iov = (struct iovec *)lua_newuserdata(L, count * sizeof(struct iovec));
+    for (i = first; i < count; i++) {
+        int top;
+        lua_rawgeti(L, idx, i - first + 1);
+        top = lua_gettop(L);
+        if (lua_type(L, top) == LUA_TTABLE) {
+            lua_rawgeti(L, top, 1);
+            lua_rawgeti(L, top, 2);
+            lua_rawgeti(L, top, 3);
+            iov[i].iov_base = (char *)__checkdata(L, top + 1, &len, 1);
+        } else {
+            iov[i].iov_base = (char *)__checkdata(L, top, &len, 0);
+        }
+        iov[i].iov_len = len;
+        lua_settop(L, top - 1);
+    }
+    *iovcnt = count;
+    return iov;
+}
+
+/**
+ * bytes = socket.bytes(capacity)
+ *
+ * Create a mutable buffer of capacity bytes, which can be filled in place by
+ * tcpsock:readinto(), tcpsock:recvinto() or udpsock:recvinto(), and sent with
+ * write() or send() without being copied into a Lua string.
+ */
+static int
+socket_bytes(lua_State * L)
+{
+    lua_Integer capacity = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, capacity >= 0, 1, "capacity should not be negative");
+    struct bytesobj *b = (struct bytesobj *)lua_newuserdata(L, sizeof(struct bytesobj) + (size_t)capacity);
+    b->size = (size_t)capacity;
+    b->len = 0;
+    luaL_getmetatable(L, BYTES_TYPENAME);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+/**
+ * n = #bytes
+ *
+ * Return the number of bytes filled.
+ */
+static int
+bytes_len(lua_State * L)
+{
+    struct bytesobj *b = getbytesobj(L, 1);
+    lua_pushinteger(L, (lua_Integer)b->len);
+    return 1;
+}
+
+static int
+bytes_tostring(lua_State * L)
+{
+    struct bytesobj *b = getbytesobj(L, 1);
+    lua_pushfstring(L, "<bytes: %d/%d>", (int)b->len, (int)b->size);
+    return 1;
+}
+
+/**
+ * capacity = bytes:capacity()
+ */
+static int
+bytes_capacity(lua_State * L)
+{
+    struct bytesobj *b = getbytesobj(L, 1);
+    lua_pushinteger(L, (lua_Integer)b->size);
+    return 1;
+}
+
+/**
+ * data = bytes:sub([i [, j]])
+ *
+ * Copy the filled bytes from i to j into a string, as string.sub() does.
+ */
+static int
+bytes_sub(lua_State * L)
+{
+    struct bytesobj *b = getbytesobj(L, 1);
+    size_t offset, count;
+    __slice(luaL_optinteger(L, 2, 1), luaL_optinteger(L, 3, -1), b->len, &offset, &count);
+    lua_pushlstring(L, b->data + offset, count);
+    return 1;
+}
+
+/*** sock_* methods are common to tcpsocket or udpsocket ***/
+
+/**
+ * fd = sockobj:fileno()
+ *
+ * Return the integer file descriptor of the socket.
+ */
+static int
+sockobj_fileno(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    lua_pushnumber(L, s->fd);
+    return 1;
+}
+
+/**
+ * ok, err = sockobj:close()
+ *
+ * Close the socket.
+ */
+static int
+sockobj_close(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+
+    // Buffered data is sent if possible, the socket is closed anyway.
+    if (__sockobj_flush(L, s, 0) == -1)
+        lua_pop(L, 2);
+
+    if (__sockobj_close(L, s) == -1)
+        return 2;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * Collect the socket. Data left in its write buffer is dropped, as a collected
+ * socket can not wait for it to be sent.
+ */
+static int
+sockobj_gc(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    __sockobj_close(L, s);
+    return 0;
+}
+
+static int
+sockobj_tostring(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    assert(lua_getmetatable(L, -1));
+    luaL_getmetatable(L, TCPSOCK_TYPENAME);
+    if (lua_rawequal(L, -1, -2)) {
+        lua_pop(L, 2);
+        lua_pushfstring(L, "<tcpsock: %d>", s->fd);
+    } else {
+        lua_pop(L, 2);
+        lua_pushfstring(L, "<udpsock: %d>", s->fd);
+    }
+    return 1;
+}
+
+/**
+ * sockobj:settimeout(timeout)
+ *
+ * Set the timeout in seconds for subsequent socket operations.
+ * A negative timeout indicates that timeout is disabled, which is default.
+ */
+static int
+sockobj_settimeout(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    double timeout = (double)luaL_checknumber(L, 2);
+    s->sock_timeout = timeout;
+    return 0;
+}
+
+/*
+ * timeout = sockobj:gettimeout()
+ *
+ * Returns the timeout in seconds associated with socket.
+ * A negative timeout indicates that timeout is disabled, which is default.
+ */
+static int
+sockobj_gettimeout(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    lua_pushnumber(L, s->sock_timeout);
+    return 1;
+}
+
+/**
+ * ok, err = sockobj:setidletimeout(timeout)
+ *
+ * Close the socket once it has had no I/O activity for timeout seconds.
+ * Idle sockets are closed by socket.run(), coroutines waiting on them get
+ * ERROR_CLOSED. A negative timeout disables it, which is default.
+ */
+static int
+sockobj_setidletimeout(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    double timeout = (double)luaL_checknumber(L, 2);
+#ifdef HAVE_EPOLL
+    struct scheduler *sched = __sched_get(L);
+    if (timer_pending(&s->idle))
+        timerwheel_del(&sched->wheel, &s->idle);
+    s->idle_timeout = timeout;
+    if (timeout > 0 && s->fd != -1) {
+        sched = __sched_create(L);
+        if (sched == NULL) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "failed to create scheduler: %s", strerror(errno));
+            return 2;
+        }
+        __sockobj_touch(L, s);
+        __sched_addtimer(sched, &s->idle, s->last_active + timeout_fromsec(timeout));
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+#else
+    (void)s;
+    (void)timeout;
+    lua_pushnil(L);
+    lua_pushstring(L, "scheduler is not supported on this platform");
+    return 2;
+#endif
+}
+
+/**
+ * timeout = sockobj:getidletimeout()
+ *
+ * Returns the idle timeout in seconds associated with socket.
+ */
+static int
+sockobj_getidletimeout(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    lua_pushnumber(L, s->idle_timeout);
+    return 1;
+}
+
+/**
+ * n, err = sockobj:recvinto(bytes)
+ *
+ * Receive up to the capacity of bytes into bytes, without creating a Lua
+ * string: a single datagram for udp sockets, whatever is available for tcp
+ * sockets.
+ */
+static int
+sockobj_recvinto(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    struct bytesobj *b = getbytesobj(L, 2);
+    luaL_argcheck(L, b->size > 0, 2, "capacity should not be zero");
+    size_t received = 0;
+
+    if (__sockobj_flush(L, s, 0) == -1)
+        return 2;
+
+    b->len = 0;
+    if (s->buf && buffer_size(s->buf) > 0) {
+        // Data already read ahead by read/readuntil comes first.
+        received = buffer_size(s->buf);
+        if (received > b->size)
+            received = b->size;
+        memcpy(b->data, s->buf->pos, received);
+        buffer_consume(s->buf, received);
+    } else {
+        struct timeout tm;
+        __sockobj_inittimeout(L, s, &tm, NULL);
+        if (__sockobj_recv(L, s, b->data, b->size, &received, &tm) == -1)
+            return 2;
+    }
+
+    b->len = received;
+    lua_pushinteger(L, (lua_Integer)received);
+    return 1;
+}
+
+/* Connection attempts raced by tcpsock:connect, see __tcpsock_race */
+struct connrace {
+    int epfd;                   /* waits for all attempts at once, -1 if none */
+    int naddrs;
+    int next;                   /* next address to try */
+    int fds[RESOLVER_MAXADDRS]; /* attempts in progress, -1 if none */
+    sockaddr_t addrs[RESOLVER_MAXADDRS];
+    socklen_t lens[RESOLVER_MAXADDRS];
+    int64_t next_start;         /* time to start the next attempt */
+    int error;                  /* errno of the last attempt which failed */
+    struct timeout tm;          /* of the whole connect */
+};
+
+/**
+ * Close the attempts in progress of the race, on top of the stack. It is safe
+ * to call it twice.
+ */
+static int
+connrace_gc(lua_State * L)
+{
+    struct connrace *r = (struct connrace *)lua_touserdata(L, -1);
+    int i;
+    for (i = 0; i < r->naddrs; i++) {
+        if (r->fds[i] != -1) {
+            __sched_closefd(L, r->fds[i]);
+            close(r->fds[i]);
+            r->fds[i] = -1;
+        }
+    }
+    if (r->epfd != -1) {
+        __sched_closefd(L, r->epfd);
+        close(r->epfd);
+        r->epfd = -1;
+    }
+    return 0;
+}
+
+/**
+ * Push a race between the addresses of res, with port.
+ *
+ * Addresses are tried alternating families, starting with the first one, which
+ * getaddrinfo() prefers (RFC 8305, section 4).
+ */
+static struct connrace *
+__connrace_create(lua_State *L, struct resolver_result *res, int port, struct timeout *tm)
+{
+    struct connrace *r = (struct connrace *)lua_newuserdata(L, sizeof(struct connrace));
+    int used[RESOLVER_MAXADDRS] = {0};
+    int i, family;
+
+    r->epfd = -1;
+    r->naddrs = 0;
+    r->next = 0;
+    r->next_start = 0;
+    r->error = ECONNREFUSED;
+    r->tm = *tm;
+    for (i = 0; i < RESOLVER_MAXADDRS; i++)
+        r->fds[i] = -1;
+    luaL_setmetatable(L, CONNRACE_TYPENAME);
+
+    family = res->addrs[0].ss_family;
+    while (r->naddrs < res->naddrs) {
+        // The next address of the family, or of any family if none is left.
+        int pick = -1;
+        for (i = 0; i < res->naddrs && pick == -1; i++) {
+            if (!used[i] && res->addrs[i].ss_family == family)
+                pick = i;
+        }
+        for (i = 0; i < res->naddrs && pick == -1; i++) {
+            if (!used[i])
+                pick = i;
+        }
+        used[pick] = 1;
+        memcpy(&r->addrs[r->naddrs], &res->addrs[pick], res->addrlens[pick]);
+        r->lens[r->naddrs] = __setport(&r->addrs[r->naddrs], port);
+        r->naddrs++;
+        family = family == AF_INET6 ? AF_INET : AF_INET6;
+    }
+    return r;
+}
+
+/**
+ * Start a connection attempt to the next address of the race.
+ *
+ * Returns 1 if connected right away, 0 otherwise (the attempt is in progress or
+ * failed).
+ */
+static int
+__connrace_start(lua_State *L, struct sockobj *s, struct connrace *r)
+{
+    int i = r->next++;
+    int ret;
+
+    // The socket gets the options set on s.
+    s->sock_family = r->addrs[i].sa.sa_family;
+    if (__sockobj_createsocket(L, s, SOCK_STREAM) == -1) {
+        lua_pop(L, 2);
+        r->error = errno;
+        return 0;
+    }
+    r->fds[i] = s->fd;
+    s->fd = -1;
+    ret = connect(r->fds[i], SAS2SA(&r->addrs[i]), r->lens[i]);
+    if (ret == 0)
+        return 1;
+    if (CHECK_ERRNO(EINPROGRESS)) {
+#ifdef HAVE_EPOLL
+        if (r->epfd != -1) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLOUT;
+            ev.data.fd = r->fds[i];
+            epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->fds[i], &ev);
+        }
+#endif
+        return 0;
+    }
+    r->error = errno;
+    close(r->fds[i]);
+    r->fds[i] = -1;
+    return 0;
+}
+
+/**
+ * Race the connection attempts of r, at index 5 of the stack, in the Happy
+ * Eyeballs way (RFC 8305): the next address is tried if the attempts in
+ * progress did not succeed within CONNECT_DELAY, or as soon as they failed. The
+ * first attempt to succeed gives the socket of s, the others are closed.
+ *
+ * In a coroutine, it waits on an epoll instance watching all the attempts;
+ * the operation is restarted with r when woken up.
+ *
+ * Returns 0 on success, or -1 with nil and an error message pushed.
+ */
+static int
+__tcpsock_race(lua_State *L, struct sockobj *s, struct connrace *r)
+{
+    struct pollfd pollfds[RESOLVER_MAXADDRS];
+    int which[RESOLVER_MAXADDRS];
+    struct task *t = __sched_task(L, NULL);
+    char *errstr = NULL;
+    int winner = -1;
+    int i, n;
+
+#ifdef HAVE_EPOLL
+    if (t && compat_isyieldable(L) && r->epfd == -1) {
+        r->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (r->epfd == -1) {
+            errstr = strerror(errno);
+            goto err;
+        }
+    }
+#endif
+
+    while (winner == -1) {
+        int64_t now = timeout_gettime();
+        int64_t left = timeout_left(&r->tm, now);
+        if (left == 0) {
+            errstr = ERROR_TIMEOUT;
+            goto err;
+        }
+
+        // Attempts in progress, and those done.
+        n = 0;
+        for (i = 0; i < r->next; i++) {
+            if (r->fds[i] != -1) {
+                pollfds[n].fd = r->fds[i];
+                pollfds[n].events = POLLOUT;
+                pollfds[n].revents = 0;
+                which[n++] = i;
+            }
+        }
+        if (n > 0 && poll(pollfds, n, 0) > 0) {
+            for (i = 0; i < n && winner == -1; i++) {
+                int err = 0;
+                socklen_t errlen = sizeof(err);
+                if (pollfds[i].revents == 0)
                     continue;
-                case EPIPE:
-                    // EPIPE means the connection was closed.
-                    errstr = ERROR_CLOSED;
-                    goto err;
-                default:
-                    errstr = strerror(errno);
-                    goto err;
+                getsockopt(pollfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+                if (err == 0 || err == EISCONN) {
+                    winner = which[i];
+                } else {
+                    r->error = err;
+                    __sched_closefd(L, pollfds[i].fd);
+                    close(pollfds[i].fd);
+                    r->fds[which[i]] = -1;
+                    pollfds[i].fd = -1;
                 }
-            } else {
-                *sent = n;
-                return 0;
             }
+            if (winner != -1)
+                break;
+            for (i = 0, n = 0; i < r->next; i++)
+                n += r->fds[i] != -1;
+        }
+
+        // Next attempt, now if none is in progress.
+        if (r->next < r->naddrs && (n == 0 || now >= r->next_start)) {
+            i = r->next;
+            if (__connrace_start(L, s, r))
+                winner = i;
+            r->next_start = now + timeout_fromsec(CONNECT_DELAY);
+            continue;
+        }
+        if (n == 0) {
+            // All the attempts failed.
+            errstr = strerror(r->error);
+            goto err;
+        }
+
+        // Wait for an attempt to finish, or the time to start the next one.
+        struct timeout step = r->tm;
+        if (r->next < r->naddrs) {
+            int64_t delay = r->next_start - now;
+            if (left < 0 || delay < left) {
+                step.tm_timeout = delay > 0 ? delay : 1;
+                step.tm_deadline = now + step.tm_timeout;
+            }
+        }
+#ifdef HAVE_EPOLL
+        if (r->epfd != -1) {
+            if (__waitrawfd(L, r->epfd, EVENT_READABLE, &step, 0) == -1) {
+                errstr = strerror(errno);
+                goto err;
+            }
+            continue;
+        }
+#endif
+        for (i = 0, n = 0; i < r->next; i++) {
+            if (r->fds[i] != -1) {
+                pollfds[n].fd = r->fds[i];
+                pollfds[n].events = POLLOUT;
+                n++;
+            }
+        }
+        if (poll(pollfds, n, timeout_ms(timeout_left(&step, now))) == -1 && !CHECK_ERRNO(EINTR)) {
+            errstr = strerror(errno);
+            goto err;
+        }
+    }
+
+    s->fd = r->fds[winner];
+    s->sock_family = r->addrs[winner].sa.sa_family;
+    r->fds[winner] = -1;
+    lua_pushvalue(L, 5);
+    connrace_gc(L);
+    lua_pop(L, 1);
+    return 0;
+
+err:
+    assert(errstr);
+    lua_pushvalue(L, 5);
+    connrace_gc(L);
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return -1;
+}
+
+/* Idle connection kept by tcpsock:setkeepalive */
+struct pooledconn {
+    int fd;
+    int family;
+    int64_t expires;            /* 0 if it never expires */
+};
+
+/* Keepalive pool of connections to an address, see tcpsock:setkeepalive */
+struct pool {
+    int size;                   /* capacity */
+    int n;
+    struct pooledconn conns[];  /* oldest first */
+};
+
+static char pool_key;       /* registry key of the table of keepalive pools */
+
+/**
+ * Close the idle connections of the pool.
+ */
+static int
+pool_gc(lua_State * L)
+{
+    struct pool *p = (struct pool *)lua_touserdata(L, 1);
+    while (p->n > 0)
+        close(p->conns[--p->n].fd);
+    return 0;
+}
+
+/**
+ * Returns the keepalive pool named name. If it does not exist, it is created
+ * with room for size connections, or NULL is returned if size is 0.
+ */
+static struct pool *
+__pool_get(lua_State *L, const char *name, int size)
+{
+    struct pool *p;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &pool_key);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        if (size == 0)
+            return NULL;
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &pool_key);
+    }
+    lua_getfield(L, -1, name);
+    // The pool is referenced by the table of pools, it stays valid once popped.
+    p = (struct pool *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (p == NULL && size > 0) {
+        p = (struct pool *)lua_newuserdata(L, sizeof(struct pool) + size * sizeof(struct pooledconn));
+        p->size = size;
+        p->n = 0;
+        luaL_setmetatable(L, POOL_TYPENAME);
+        lua_setfield(L, -2, name);
+    }
+    lua_pop(L, 1);
+    return p;
+}
+
+/**
+ * Returns 1 if the idle connection fd is still usable: the peer did not close
+ * it, nor sent anything unexpected.
+ */
+static int
+__pool_alive(int fd)
+{
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1 &&
+        (CHECK_ERRNO(EAGAIN) || CHECK_ERRNO(EWOULDBLOCK));
+}
+
+/**
+ * Give s the most recently pooled connection of its pool which is still alive,
+ * closing the expired and dead ones met on the way.
+ *
+ * Returns 1 if s got a connection, 0 otherwise, or -1 with nil and an error
+ * message pushed if the options of s can not be applied to it.
+ */
+static int
+__tcpsock_reuse(lua_State *L, struct sockobj *s)
+{
+    struct pool *p = __pool_get(L, s->pool, 0);
+    int64_t now = timeout_gettime();
+    if (p == NULL)
+        return 0;
+    while (p->n > 0) {
+        struct pooledconn *c = &p->conns[--p->n];
+        if ((c->expires == 0 || c->expires > now) && __pool_alive(c->fd)) {
+            s->fd = c->fd;
+            s->sock_family = c->family;
+            // As if the socket was created for s, SO_ZEROCOPY in particular.
+            if (__sockobj_applyopts(L, s, SOCK_STREAM) == -1) {
+                close(s->fd);
+                s->fd = -1;
+                s->sock_opts = 0;
+                return -1;
+            }
+            return 1;
+        }
+        close(c->fd);
+    }
+    return 0;
+}
+
+/**
+ * Wait for the handshake of s, whose first payload went in the SYN, to
+ * complete, and tell whether the server took the data. It does not if it
+ * rejected the cookie, the data is then sent again once connected.
+ *
+ * Returns 1 if the server took the data, 0 if not, or -1 with nil and an error
+ * message pushed.
+ */
+static int
+__tcpsock_syndata(lua_State *L, struct sockobj *s)
+{
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    char *errstr = NULL;
+
+    struct timeout tm;
+    __sockobj_inittimeout(L, s, &tm, NULL);
+    while (1) {
+        if (getsockopt(s->fd, IPPROTO_TCP, TCP_INFO, (void *)&info, &len) == -1) {
+            errstr = strerror(errno);
+            goto err;
+        }
+        if (info.tcpi_state == TCP_CLOSE) {
+            int err = 0;
+            socklen_t errlen = sizeof(err);
+            getsockopt(s->fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen);
+            errstr = strerror(err ? err : ECONNRESET);
+            goto err;
+        }
+        if (info.tcpi_state != TCP_SYN_SENT)
+            return (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+        // The socket becomes writable once connected.
+        int timeout = __waitfd(L, s, EVENT_WRITABLE, &tm, 0);
+        if (timeout == -1) {
+            errstr = strerror(errno);
+            goto err;
+        } else if (timeout == 1) {
+            errstr = ERROR_TIMEOUT;
+            goto err;
         }
     }
 
@@ -488,425 +4572,1210 @@ err:
     lua_pushnil(L);
     lua_pushstring(L, errstr);
     return -1;
+#else
+    // The data went in the SYN, whether the server took it is unknown.
+    (void)L;
+    (void)s;
+    return 1;
+#endif
 }
 
+/**
+ * Send the first payload of tcpsock:connect, options.data with the options at
+ * index opts of the stack, and push the results of connect.
+ */
 static int
-__sockobj_sendto(lua_State *L, struct sockobj *s, const char *buf, size_t len, size_t *sent, struct sockaddr *addr, socklen_t addrlen, struct timeout *tm) {
-    char *errstr;
+__tcpsock_senddata(lua_State *L, struct sockobj *s, int opts)
+{
+    struct iovec iov;
+    size_t len;
+    int syndata = 0;
+
+    if (!(s->sock_flags & SOCKOBJ_HANDSHAKE)) {
+        lua_getfield(L, opts, "data");
+        iov.iov_base = (void *)lua_tolstring(L, -1, &len);
+        iov.iov_len = len;
+        s->sock_flags |= SOCKOBJ_FASTOPEN;
+        // Restarted with the progress when resumed.
+        if (__sockobj_write(L, s, &iov, 1, 0) == -1)
+            goto err;
+        lua_pop(L, 2);
+    }
+    if (s->sock_flags & SOCKOBJ_SYNDATA) {
+        // Restarted at the handshake when resumed.
+        s->sock_flags |= SOCKOBJ_HANDSHAKE;
+        syndata = __tcpsock_syndata(L, s);
+        if (syndata == -1)
+            goto err;
+    }
+    s->sock_flags &= ~(SOCKOBJ_FASTOPEN | SOCKOBJ_SYNDATA | SOCKOBJ_HANDSHAKE);
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    lua_pushboolean(L, syndata);
+    return 3;
+
+err:
+    s->sock_flags &= ~(SOCKOBJ_FASTOPEN | SOCKOBJ_SYNDATA | SOCKOBJ_HANDSHAKE);
+    if (__sockobj_close(L, s) == -1)
+        lua_pop(L, 2);
+    return 2;
+}
+
+/**
+ * Connect s to addr and send options.data, with the options at index opts of
+ * the stack, using TCP Fast Open: if a cookie of the server is cached,
+ * TCP_FASTOPEN_CONNECT defers the handshake to the first send, so the data goes
+ * in the SYN. Otherwise, a cookie is requested and the data is sent once
+ * connected.
+ */
+static int
+__tcpsock_fastopen(lua_State *L, struct sockobj *s, struct sockaddr *addr, socklen_t len, int opts)
+{
+    int deferred = 0;
+#ifdef TCP_FASTOPEN_CONNECT
+    int flag = 1;
+    // Not supported by unix domain sockets, nor older kernels.
+    deferred = setsockopt(s->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (void *)&flag, sizeof(flag)) == 0;
+#endif
+    errno = 0;
+    if (connect(s->fd, addr, len) == 0) {
+        if (deferred)
+            s->sock_flags |= SOCKOBJ_SYNDATA;
+    } else if (!CHECK_ERRNO(EINPROGRESS)) {
+        const char *errstr = strerror(errno);
+        if (__sockobj_close(L, s) == -1)
+            lua_pop(L, 2);
+        lua_pushnil(L);
+        lua_pushstring(L, errstr);
+        return 2;
+    }
+    // Sending waits for the connection to be established, if it is not.
+    return __tcpsock_senddata(L, s, opts);
+}
+
+/**
+ * ok, err = tcpsock:connect(host, port, options?)
+ * ok, err = tcpsock:connect("unix:/path/to/unix-domain.sock", options?)
+ * ok, err, fastopen = tcpsock:connect(host, port, {data = data})
+ *
+ * Attempts to connect to TCP socket object to a remote server or to a stream
+ * unix domain socket file.
+ *
+ * An idle connection of the keepalive pool, named "host:port", the path of the
+ * unix domain socket, or options.pool, is reused if any (see
+ * tcpsock:setkeepalive).
+ *
+ * If host resolves to several addresses, IPv6 and IPv4 ones are raced, see
+ * __tcpsock_race. Unless options.data is set: the data is then sent as soon as
+ * possible, in the SYN with TCP Fast Open (see __tcpsock_fastopen), and
+ * fastopen tells whether it was. Only the first address is tried, as the others
+ * would get the data too.
+ */
+static int
+tcpsock_connect(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    struct task *t = __sched_task(L, NULL);
+    struct resolver_result res;
+    struct connrace *r;
+    sockaddr_t addr;
+    socklen_t len;
+    struct timeout tm;
+    const char *host;
+    int nargs, opts, data;
+
+    // host and port, or path, then the options
+    nargs = lua_type(L, 3) == LUA_TNUMBER || lua_type(L, 3) == LUA_TSTRING ? 3 : 2;
+    opts = nargs + 1;
+
+    if (s->sock_flags & SOCKOBJ_FASTOPEN) {
+        // Resumed in cosocket mode, the first payload is being sent.
+        return __tcpsock_senddata(L, s, opts);
+    }
+    r = (struct connrace *)luaL_testudata(L, 5, CONNRACE_TYPENAME);
+    if (r) {
+        // Resumed in cosocket mode, connection attempts are racing.
+        __sockobj_inittimeout(L, s, &tm, NULL);
+        if (__tcpsock_race(L, s, r) == -1)
+            return 2;
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    if (t && t->resolvefd != -1) {
+        // Resumed in cosocket mode, the host name is resolved. The connection
+        // gets what is left of the timeout (see __sockobj_resolve).
+        tm = t->tm;
+    } else if (__sockobj_inittimeout(L, s, &tm, NULL)) {
+        // Resumed in cosocket mode, the connection attempt is in progress.
+        if (s->fd == -1) {
+            lua_pushnil(L);
+            lua_pushstring(L, ERROR_CLOSED);
+            return 2;
+        }
+        if (__sockobj_connect(L, s, NULL, 0, &tm) == -1)
+            return 2;
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    if (s->fd > 0) {
+        return luaL_error(L, "already connected");
+    }
+    host = luaL_checkstring(L, 2);
+    // The stack is kept as is when resumed, with the race at index 5.
+    lua_settop(L, opts);
+    if (lua_isnil(L, opts)) {
+        lua_newtable(L);
+        lua_replace(L, opts);
+    }
+    luaL_checktype(L, opts, LUA_TTABLE);
+
+    lua_getfield(L, opts, "pool");
+    if (lua_isnil(L, -1)) {
+        if (nargs == 3)
+            lua_pushfstring(L, "%s:%d", host, (int)luaL_checknumber(L, 3));
+        else
+            lua_pushstring(L, host);
+    } else if (!lua_isstring(L, -1)) {
+        return luaL_argerror(L, opts, "pool name must be a string");
+    }
+    free(s->pool);
+    s->pool = strdup(lua_tostring(L, -1));
+    if (s->pool == NULL)
+        return luaL_error(L, "out of memory");
+    lua_getfield(L, opts, "data");
+    data = !lua_isnil(L, -1);
+    if (data)
+        luaL_argcheck(L, lua_isstring(L, -1), opts, "data must be a string");
+    lua_settop(L, opts);
+
+    switch (__tcpsock_reuse(L, s)) {
+    case -1:
+        return 2;
+    case 1:
+        if (data)
+            return __tcpsock_senddata(L, s, opts);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    if (nargs == 2) {
+        s->sock_family = AF_UNIX;
+        addr.un.sun_family = AF_UNIX;
+        strncpy(addr.un.sun_path, host, sizeof(addr.un.sun_path) - 1);
+        len = sizeof(addr.un);
+    } else {
+        int port = luaL_checknumber(L, 3);
+        if (__isnumerichost(host)) {
+            if (__sockobj_setipaddr(L, &tm, host, SAS2SA(&addr), sizeof(addr), AF_UNSPEC, 0) == -1)
+                return 2;
+        } else {
+            if (__sockobj_resolve(L, &tm, host, AF_UNSPEC, &res, 0) == -1)
+                return 2;
+            if (res.naddrs == 0) {
+                lua_pushnil(L);
+                lua_pushstring(L, gai_strerror(EAI_NONAME));
+                return 2;
+            }
+            if (res.naddrs > 1 && !data) {
+                r = __connrace_create(L, &res, port, &tm);
+                if (__tcpsock_race(L, s, r) == -1)
+                    return 2;
+                lua_pushboolean(L, 1);
+                return 1;
+            }
+            memcpy(&addr, &res.addrs[0], res.addrlens[0]);
+        }
+        s->sock_family = addr.sa.sa_family;
+        len = __setport(&addr, port);
+    }
+    if (__sockobj_createsocket(L, s, SOCK_STREAM) == -1) {
+        return 2;
+    }
+    if (data)
+        return __tcpsock_fastopen(L, s, SAS2SA(&addr), len, opts);
+    if (__sockobj_connect(L, s, SAS2SA(&addr), len, &tm) == -1)
+        return 2;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * ok, err = tcpsock:setkeepalive(timeout?, size?)
+ *
+ * Put the connection in its keepalive pool (see tcpsock:connect), for a later
+ * connect to the same address to reuse it, and close the socket object. The
+ * connection is closed if it stays idle for timeout seconds (60 by default, <=
+ * 0 to keep it as long as possible), or if size connections (30 by default)
+ * are already idle in the pool, the oldest one. The size of a pool is set when
+ * it is created.
+ *
+ * The write buffer is flushed first. A connection with unread data, or closed
+ * by the peer, can not be reused: it is closed, and nil and a string
+ * describing the error are returned.
+ */
+static int
+tcpsock_setkeepalive(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    double timeout = luaL_optnumber(L, 2, POOL_TIMEOUT);
+    int size = luaL_optinteger(L, 3, POOL_SIZE);
+    char *errstr = NULL;
+    struct pool *p;
+    struct pooledconn *c;
+    int64_t now;
+    int i, j;
+    char ch;
+    ssize_t n;
+
+    luaL_argcheck(L, size > 0, 3, "pool size must be positive");
     if (s->fd == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, ERROR_CLOSED);
+        return 2;
+    }
+    if (s->pool == NULL) {
+        errstr = "not connected by connect";
+        goto err;
+    }
+    if (__sockobj_flush(L, s, 0) == -1) {
+        __sockobj_close(L, s);
+        return 2;
+    }
+    if (s->buf && buffer_size(s->buf) > 0) {
+        errstr = "unread data in buffer";
+        goto err;
+    }
+    n = recv(s->fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n == 0) {
         errstr = ERROR_CLOSED;
         goto err;
+    } else if (n > 0) {
+        errstr = "unread data in buffer";
+        goto err;
+    } else if (!CHECK_ERRNO(EAGAIN) && !CHECK_ERRNO(EWOULDBLOCK)) {
+        errstr = strerror(errno);
+        goto err;
     }
-
-    while (1) {
-        int timeout = __waitfd(s, EVENT_WRITABLE, tm);
-        if (timeout == -1) {
-            errstr = strerror(errno);
+#ifdef HAVE_ZEROCOPY
+    if (s->zc && s->zc->npins > 0) {
+        __zerocopy_reap(L, s);
+        if (s->zc->npins > 0) {
+            // Completions would be reported to the next user of the connection.
+            errstr = "zerocopy sends in progress";
             goto err;
-        } else if (timeout == 1) {
-            errstr = ERROR_TIMEOUT;
-            goto err;
-        } else {
-            int n = sendto(s->fd, buf, len, 0, addr, addrlen);
-            if (n < 0) {
-                switch (errno) {
-                case EINTR:
-                case EAGAIN:
+        }
+    }
+#endif
+    // The next user gets the connection as if it was new, uncorked.
+    if (__sockobj_resetopts(s) == -1) {
+        errstr = "socket options can not be reset";
+        goto err;
+    }
+
+    p = __pool_get(L, s->pool, size);
+    now = timeout_gettime();
+    // Drop the expired connections, then the oldest one if the pool is full.
+    for (i = 0, j = 0; i < p->n; i++) {
+        if (p->conns[i].expires != 0 && p->conns[i].expires <= now)
+            close(p->conns[i].fd);
+        else
+            p->conns[j++] = p->conns[i];
+    }
+    p->n = j;
+    if (p->n == p->size) {
+        close(p->conns[0].fd);
+        memmove(&p->conns[0], &p->conns[1], --p->n * sizeof(struct pooledconn));
+    }
+    c = &p->conns[p->n++];
+    c->fd = s->fd;
+    c->family = s->sock_family;
+    c->expires = timeout > 0 ? now + timeout_fromsec(timeout) : 0;
+
+    __sched_detachfd(L, s->fd);
+    s->fd = -1;
+    __sockobj_close(L, s);
+    lua_pushboolean(L, 1);
+    return 1;
+
+err:
+    assert(errstr);
+    if (__sockobj_close(L, s) == -1)
+        lua_pop(L, 2);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return 2;
+}
+
+/* Connections made by socket.connect_many */
+struct connmany {
+    int epfd;                   /* waits for all connections, -1 if none */
+    int n;                      /* number of targets */
+    int next;                   /* next target to start */
+    struct timeout tm;          /* of the whole batch */
+    struct pollfd fds[];        /* connections in progress, fd -1 if none */
+};
+
+/**
+ * Close the epoll instance of the batch, on top of the stack. It is safe to
+ * call it twice.
+ */
+static int
+connmany_gc(lua_State * L)
+{
+    struct connmany *cm = (struct connmany *)lua_touserdata(L, -1);
+    if (cm->epfd != -1) {
+        __sched_closefd(L, cm->epfd);
+        close(cm->epfd);
+        cm->epfd = -1;
+    }
+    return 0;
+}
+
+/**
+ * Record the error of target i, at index 4 of the stack, and close its socket,
+ * at index 5.
+ */
+static void
+__connmany_fail(lua_State *L, struct connmany *cm, int i, const char *errstr)
+{
+    struct sockobj *s;
+    lua_pushstring(L, errstr);
+    lua_rawseti(L, 4, i + 1);
+    lua_rawgeti(L, 5, i + 1);
+    s = (struct sockobj *)lua_touserdata(L, -1);
+    if (s && __sockobj_close(L, s) == -1)
+        lua_pop(L, 2);
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_rawseti(L, 5, i + 1);
+    cm->fds[i].fd = -1;
+}
+
+/**
+ * Start the connection to target i, {host, port} or {path} at index 1 of the
+ * stack: its socket, at index 5, takes an idle connection of its keepalive pool
+ * if any, or starts a non-blocking connect. Failures are recorded at index 4.
+ *
+ * Resolving a host name may suspend the operation, the socket is then kept for
+ * when it is resumed.
+ */
+static void
+__connmany_start(lua_State *L, struct connmany *cm, int i)
+{
+    struct sockobj *s;
+    const char *host;
+    sockaddr_t addr;
+    socklen_t len;
+    int64_t left;
+    int port;
+
+    cm->fds[i].fd = -1;
+    cm->fds[i].events = POLLOUT;
+    lua_rawgeti(L, 1, i + 1);
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    host = lua_tostring(L, -2);
+    port = (int)lua_tonumber(L, -1);
+
+    lua_rawgeti(L, 5, i + 1);
+    s = (struct sockobj *)lua_touserdata(L, -1);
+    if (s == NULL) {
+        lua_pop(L, 1);
+        s = __sockobj_create(L, TCPSOCK_TYPENAME);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, 5, i + 1);
+        if (lua_isnil(L, -2))
+            lua_pushstring(L, host);
+        else
+            lua_pushfstring(L, "%s:%d", host, port);
+        s->pool = strdup(lua_tostring(L, -1));
+        lua_pop(L, 1);
+        if (s->pool == NULL) {
+            __connmany_fail(L, cm, i, strerror(ENOMEM));
+            goto done;
+        }
+        switch (__tcpsock_reuse(L, s)) {
+        case -1:
+            __connmany_fail(L, cm, i, lua_tostring(L, -1));
+            lua_pop(L, 2);
+            goto done;
+        case 1:
+            goto done;
+        }
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    if (lua_isnil(L, -2)) {
+        s->sock_family = AF_UNIX;
+        addr.un.sun_family = AF_UNIX;
+        strncpy(addr.un.sun_path, host, sizeof(addr.un.sun_path) - 1);
+        len = sizeof(addr.un);
+    } else {
+        // Resolved within what is left for the batch.
+        left = timeout_left(&cm->tm, -1);
+        if (left == 0) {
+            __connmany_fail(L, cm, i, ERROR_TIMEOUT);
+            goto done;
+        }
+        if (__sockobj_setipaddr(L, &cm->tm, host, SAS2SA(&addr), sizeof(addr), AF_UNSPEC, 0) == -1) {
+            __connmany_fail(L, cm, i, lua_tostring(L, -1));
+            lua_pop(L, 2);
+            goto done;
+        }
+        s->sock_family = addr.sa.sa_family;
+        len = __setport(&addr, port);
+    }
+    if (__sockobj_createsocket(L, s, SOCK_STREAM) == -1) {
+        __connmany_fail(L, cm, i, lua_tostring(L, -1));
+        lua_pop(L, 2);
+        goto done;
+    }
+    if (connect(s->fd, SAS2SA(&addr), len) == 0)
+        goto done;
+    if (!CHECK_ERRNO(EINPROGRESS)) {
+        __connmany_fail(L, cm, i, strerror(errno));
+        goto done;
+    }
+    cm->fds[i].fd = s->fd;
+#ifdef HAVE_EPOLL
+    if (cm->epfd != -1) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLOUT;
+        ev.data.fd = s->fd;
+        epoll_ctl(cm->epfd, EPOLL_CTL_ADD, s->fd, &ev);
+    }
+#endif
+
+done:
+    lua_pop(L, 4);
+}
+
+/**
+ * socks, errs = socket.connect_many(targets, timeout?)
+ *
+ * Connect to all the targets at once, each a table {host, port} or {path} of
+ * the arguments of tcpsock:connect, within timeout seconds.
+ *
+ * Returns a table mapping the indices of the targets connected to their
+ * sockets and, if some failed, a table mapping their indices to a string
+ * describing the error, nil otherwise.
+ *
+ * In a coroutine, it waits on an epoll instance watching all the connections;
+ * the operation is restarted when woken up, with the state at index 3 of the
+ * stack and the results at indices 4 and 5.
+ */
+static int
+socket_connect_many(lua_State * L)
+{
+    struct task *t = __sched_task(L, NULL);
+    struct connmany *cm;
+    const char *errstr;
+    int i;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    cm = (struct connmany *)luaL_testudata(L, 3, CONNMANY_TYPENAME);
+    if (cm == NULL) {
+        double timeout = luaL_optnumber(L, 2, -1);
+        int n = (int)lua_rawlen(L, 1);
+        for (i = 1; i <= n; i++) {
+            lua_rawgeti(L, 1, i);
+            if (lua_istable(L, -1))
+                lua_rawgeti(L, -1, 1);
+            else
+                lua_pushnil(L);
+            if (!lua_isstring(L, -1))
+                return luaL_error(L, "bad target #%d: table {host, port} or {path} expected", i);
+            lua_pop(L, 2);
+        }
+        lua_settop(L, 2);
+        cm = (struct connmany *)lua_newuserdata(L, sizeof(struct connmany) + n * sizeof(struct pollfd));
+        cm->epfd = -1;
+        cm->n = n;
+        cm->next = 0;
+        timeout_init(&cm->tm, timeout);
+        luaL_setmetatable(L, CONNMANY_TYPENAME);
+        lua_newtable(L);
+        lua_newtable(L);
+#ifdef HAVE_EPOLL
+        if (t && compat_isyieldable(L)) {
+            cm->epfd = epoll_create1(EPOLL_CLOEXEC);
+            if (cm->epfd == -1) {
+                lua_pushnil(L);
+                lua_pushstring(L, strerror(errno));
+                return 2;
+            }
+        }
+#endif
+    } else if (t) {
+        // Resumed in cosocket mode.
+        t->suspended = 0;
+    }
+
+    while (cm->next < cm->n) {
+        __connmany_start(L, cm, cm->next);
+        cm->next++;
+    }
+
+    while (1) {
+        int64_t left;
+        int pending = 0;
+
+        // Connections done.
+        if (poll(cm->fds, cm->n, 0) > 0) {
+            for (i = 0; i < cm->n; i++) {
+                int err = 0;
+                socklen_t errlen = sizeof(err);
+                if (cm->fds[i].fd == -1 || cm->fds[i].revents == 0)
+                    continue;
+                getsockopt(cm->fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+                if (err != 0 && err != EISCONN) {
+                    __connmany_fail(L, cm, i, strerror(err));
                     continue;
-                case EPIPE:
-                    // EPIPE means the connection was closed.
-                    errstr = ERROR_CLOSED;
-                    goto err;
-                default:
-                    errstr = strerror(errno);
-                    goto err;
                 }
-            } else {
-                *sent = n;
-                return 0;
+#ifdef HAVE_EPOLL
+                if (cm->epfd != -1)
+                    epoll_ctl(cm->epfd, EPOLL_CTL_DEL, cm->fds[i].fd, NULL);
+#endif
+                cm->fds[i].fd = -1;
             }
         }
+        for (i = 0; i < cm->n; i++)
+            pending += cm->fds[i].fd != -1;
+        if (pending == 0)
+            break;
+
+        left = timeout_left(&cm->tm, -1);
+        if (left == 0)
+            break;
+#ifdef HAVE_EPOLL
+        if (cm->epfd != -1) {
+            if (__waitrawfd(L, cm->epfd, EVENT_READABLE, &cm->tm, 0) == -1)
+                break;
+            continue;
+        }
+#endif
+        if (poll(cm->fds, cm->n, timeout_ms(left)) == -1 && !CHECK_ERRNO(EINTR))
+            break;
     }
 
-err:
-    assert(errstr);
+    // Timed out, or failed to wait.
+    errstr = timeout_left(&cm->tm, -1) == 0 ? ERROR_TIMEOUT : strerror(errno);
+    for (i = 0; i < cm->n; i++) {
+        if (cm->fds[i].fd != -1)
+            __connmany_fail(L, cm, i, errstr);
+    }
+    lua_pushvalue(L, 3);
+    connmany_gc(L);
+    lua_pop(L, 1);
+
+    lua_pushvalue(L, 5);
+    lua_pushvalue(L, 4);
     lua_pushnil(L);
-    lua_pushstring(L, errstr);
-    return -1;
+    if (lua_next(L, -2) == 0) {
+        // No error.
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    } else {
+        lua_pop(L, 2);
+    }
+    return 2;
 }
 
+/**
+ * ok, err = tcpsock:bind(host, port)
+ * ok, err = tcpsock:connect("unix:/path/to/unix-domain.sock")
+ */
 static int
-__sockobj_write(lua_State *L, struct sockobj *s, const char *buf, size_t len) {
-    char *errstr;
-    size_t total_sent = 0;
-    if (s->fd == -1) {
-        errstr = ERROR_CLOSED;
-        goto err;
+tcpsock_bind(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    sockaddr_t addr;
+    socklen_t len;
+    char *errstr = NULL;
+
+    if (s->fd > 0) {
+        return luaL_error(L, "already bound");
+    }
+    if (__sockobj_getaddrfromarg(L, s, SAS2SA(&addr), &len, 1)) {
+        return 2;
+    }
+    if (__sockobj_createsocket(L, s, SOCK_STREAM) == -1) {
+        return 2;
     }
 
-    struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
-    while (1) {
-        int timeout = __waitfd(s, EVENT_WRITABLE, &tm);
-        if (timeout == -1) {
-            errstr = strerror(errno);
-            goto err;
-        } else if (timeout == 1) {
-            errstr = ERROR_TIMEOUT;
-            goto err;
-        } else {
-            int n = send(s->fd, buf + total_sent, len - total_sent, 0);
-            if (n < 0) {
-                switch (errno) {
-                case EINTR:
-                case EAGAIN:
-                    continue;
-                case EPIPE:
-                    // EPIPE means the connection was closed.
-                    errstr = ERROR_CLOSED;
-                    goto err;
-                default:
-                    errstr = strerror(errno);
-                    goto err;
-                }
-            } else {
-                total_sent += n;
-                if (len - total_sent <= 0) {
-                    break;
-                }
-            }
-        }
+    if (bind(s->fd, SAS2SA(&addr), len) < 0) {
+        errstr = strerror(errno);
+        goto err;
     }
 
-    assert(total_sent == len);
-    lua_pushinteger(L, total_sent);
-    return 0;
+    lua_pushboolean(L, 1);
+    return 1;
 
 err:
     assert(errstr);
     lua_pushnil(L);
     lua_pushstring(L, errstr);
-    return -1;
+    return 2;
 }
 
+/**
+ * ok, err = tcpsock:listen(backlog, fastopen?)
+ *
+ * Listen for connections make to the socket.
+ * The backlog argument specifies the maximum number of queue connections and
+ * should be at least 0.
+ * If fastopen is > 0, TCP Fast Open is enabled: clients with a cookie may send
+ * data in their SYN, and up to fastopen of such connections may wait for the
+ * handshake to complete.
+ */
 static int
-__sockobj_recv(lua_State *L, struct sockobj *s, char *buf, size_t buffersize, size_t *received, struct timeout *tm)
+tcpsock_listen(lua_State * L)
 {
+    struct sockobj *s = getsockobj(L);
+    int backlog;
+    int fastopen;
+    int ret;
     char *errstr = NULL;
-
-    if (s->fd == -1) {
-        errstr = ERROR_CLOSED;
-        goto err;
+    backlog = luaL_checknumber(L, 2);
+    fastopen = luaL_optinteger(L, 3, 0);
+    /* To avoid problems on systems that don't allow a negative backlog, force
+     * minimu value of 0. */
+    if (backlog < 0) {
+        backlog = 0;
     }
-
-    while (1) {
-        int timeout = __waitfd(s, EVENT_READABLE, tm);
-        if (timeout == -1) {
+    if (fastopen > 0) {
+#ifdef TCP_FASTOPEN
+        if (setsockopt(s->fd, IPPROTO_TCP, TCP_FASTOPEN, (void *)&fastopen, sizeof(fastopen)) < 0) {
             errstr = strerror(errno);
             goto err;
-        } else if (timeout == 1) {
-            errstr = ERROR_TIMEOUT;
-            goto err;
-        } else {
-            int bytes_read = recv(s->fd, buf, buffersize, 0);
-            if (bytes_read > 0) {
-                *received = bytes_read;
-                return 0;
-            } else if (bytes_read == 0) {
-                errstr = ERROR_CLOSED;
-                goto err;
-            } else {
-                switch (errno) {
-                case EINTR:
-                case EAGAIN:
-                    // do nothing, continue
-                    continue;
-                default:
-                    errstr = strerror(errno);
-                    goto err;
-                }
-            }
         }
+#else
+        errstr = strerror(ENOPROTOOPT);
+        goto err;
+#endif
+    }
+    ret = listen(s->fd, backlog);
+    if (ret < 0) {
+        errstr = strerror(errno);
+        goto err;
     }
 
+    lua_pushboolean(L, 1);
+    return 1;
+
 err:
     assert(errstr);
     lua_pushnil(L);
     lua_pushstring(L, errstr);
-    return -1;
+    return 2;
 }
 
+/**
+ * sock, err = tcpsock:accept()
+ *
+ * Accept a connection. The socket must be bound to an address and listening for
+ * connections.
+ *
+ * In case of success, it returns a socket object usable to read/write data on
+ * the connection. Otherwise, it returns nil and a string describing the error.
+ */
 static int
-__sockobj_recvfrom(lua_State *L, struct sockobj *s, char *buf, size_t buffersize, size_t *received, struct sockaddr *addr, socklen_t *addrlen, struct timeout *tm)
+tcpsock_accept(lua_State * L)
 {
+    struct sockobj *s = getsockobj(L);
+    int clientfd = -1;
     char *errstr = NULL;
 
-    if (s->fd == -1) {
-        errstr = ERROR_CLOSED;
-        goto err;
+    struct timeout tm;
+    __sockobj_inittimeout(L, s, &tm, NULL);
+#ifdef HAVE_IO_URING
+    struct uring *ring = __sockobj_uring(L);
+    if (ring && s->fd != -1) {
+        clientfd = uring_accept(ring, s->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC, timeout_left(&tm, -1));
+        if (clientfd == -1) {
+            if (CHECK_ERRNO(ETIMEDOUT)) {
+                errstr = ERROR_TIMEOUT;
+                goto err;
+            } else if (!CHECK_ERRNO(EAGAIN)) {
+                errstr = strerror(errno);
+                goto err;
+            }
+            // fall back to the poll path
+        }
     }
-
-    while (1) {
-        int timeout = __waitfd(s, EVENT_READABLE, tm);
+#endif
+    while (clientfd == -1) {
+        if (s->fd == -1) {
+            errstr = ERROR_CLOSED;
+            goto err;
+        }
+        // Try first, the backlog is often not empty when we are called.
+        clientfd = __accept(s->fd);
+        if (clientfd != -1)
+            break;
+        if (CHECK_ERRNO(EINTR) || CHECK_ERRNO(ECONNABORTED))
+            continue;
+        if (!CHECK_ERRNO(EAGAIN)) {
+            errstr = strerror(errno);
+            goto err;
+        }
+        int timeout = __waitfd(L, s, EVENT_READABLE, &tm, 0);
         if (timeout == -1) {
             errstr = strerror(errno);
             goto err;
         } else if (timeout == 1) {
             errstr = ERROR_TIMEOUT;
             goto err;
-        } else {
-            int bytes_read = recvfrom(s->fd, buf, buffersize, 0, addr, addrlen);
-            if (bytes_read > 0) {
-                *received = bytes_read;
-                return 0;
-            } else if (bytes_read == 0) {
-                errstr = ERROR_CLOSED;
-                goto err;
-            } else {
-                switch (errno) {
-                case EINTR:
-                case EAGAIN:
-                    // do nothing, continue
-                    continue;
-                default:
-                    errstr = strerror(errno);
-                    goto err;
-                }
-            }
         }
     }
 
+    __sockobj_touch(L, s);
+    __tcpsock_pushclient(L, s, clientfd);
+    return 1;
+
 err:
     assert(errstr);
     lua_pushnil(L);
     lua_pushstring(L, errstr);
-    return -1;
-}
-/**
- * tcpsock, err = socket.tcp()
- */
-static int
-socket_tcp(lua_State * L)
-{
-    struct sockobj *s = __sockobj_create(L, TCPSOCK_TYPENAME);
-    if (!s) {
-        return luaL_error(L, "out of memory");
-    }
-    return 1;
+    return 2;
 }
 
 /**
- * udpsock, err = socket.udp()
+ * socks, err = tcpsock:acceptmany([max=64])
+ *
+ * Wait for at least one new connection, then accept up to max connections
+ * (all the backlog if less) in a single call. Returns an array of tcp socket
+ * objects.
  */
 static int
-socket_udp(lua_State * L)
-{
-    struct sockobj *s = __sockobj_create(L, UDPSOCK_TYPENAME);
-    if (!s) {
-        return luaL_error(L, "out of memory");
-    }
-    return 1;
-}
-
-static void
-__collect_fds(lua_State * L, int tab, fd_set * set, int *max_fd)
+tcpsock_acceptmany(lua_State * L)
 {
-    if (lua_isnil(L, tab))
-        return;
-
-    luaL_checktype(L, tab, LUA_TTABLE);
+    struct sockobj *s = getsockobj(L);
+    int max = luaL_optinteger(L, 2, ACCEPTMANY_MAX);
+    int n = 0;
+    char *errstr = NULL;
 
-    int i = 1;
-    while (1) {
-        int fd = -1;
-        lua_pushnumber(L, i);
-        lua_gettable(L, tab);   // get ith fd
+    luaL_argcheck(L, max > 0, 2, "max must be positive");
 
-        if (lua_isnil(L, -1)) {
-            // end of table loop
-            lua_pop(L, 1);
-            break;
+    struct timeout tm;
+    __sockobj_inittimeout(L, s, &tm, NULL);
+    while (n < max) {
+        int clientfd;
+        if (s->fd == -1) {
+            errstr = ERROR_CLOSED;
+            goto err;
         }
-
-        if (lua_isnumber(L, -1)) {
-            fd = lua_tonumber(L, -1);
-            if (fd < 0) {
-                fd = -1;
+        clientfd = __accept(s->fd);
+        if (clientfd == -1) {
+            if (CHECK_ERRNO(EINTR) || CHECK_ERRNO(ECONNABORTED))
+                continue;
+            if (n > 0) {
+                // backlog drained, errors are reported by the next call
+                break;
+            }
+            if (!CHECK_ERRNO(EAGAIN)) {
+                errstr = strerror(errno);
+                goto err;
+            }
+            // Nothing pushed yet, so the operation can be restarted.
+            int timeout = __waitfd(L, s, EVENT_READABLE, &tm, 0);
+            if (timeout == -1) {
+                errstr = strerror(errno);
+                goto err;
+            } else if (timeout == 1) {
+                errstr = ERROR_TIMEOUT;
+                goto err;
             }
-        } else {
-            // ignore
-            lua_pop(L, 1);
             continue;
         }
+        if (n == 0)
+            lua_createtable(L, max < ACCEPTMANY_MAX ? max : ACCEPTMANY_MAX, 0);
+        __tcpsock_pushclient(L, s, clientfd);
+        lua_rawseti(L, -2, ++n);
+    }
 
-        if (fd != -1) {
-            if (fd >= FD_SETSIZE) {
-                luaL_argerror(L, tab, "descriptor too large for set size");
-            }
-            if (*max_fd < fd) {
-                *max_fd = fd;
-            }
-            FD_SET(fd, set);
-        }
+    __sockobj_touch(L, s);
+    return 1;
 
-        lua_pop(L, 1);
-        i++;
-    }
+err:
+    assert(errstr);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return 2;
 }
 
-static void
-__return_fd(lua_State * L, fd_set * set, int max_fd)
+/**
+ * bytes, err = tcpsock:write(data, i?, j?)
+ * bytes, err = tcpsock:write({data, ...})
+ *
+ * This method is a synchronous operation that will not return until all the
+ * data has been flushed into the system socket send buffer or an error occurs.
+ *
+ * An array of data (strings, bytes objects or slices {data, i, j}) is sent
+ * as if it was concatenated, with sendmsg.
+ *
+ * In case of success, it returns the total number of bytes that have been sent.
+ * Otherwise, it returns nil and a string describing the error.
+ */
+static int
+tcpsock_write(lua_State * L)
 {
-    int fd;
-    int i = 1;
-    lua_newtable(L);
-    for (fd = 0; fd < max_fd; fd++) {
-        if (FD_ISSET(fd, set)) {
-            lua_pushnumber(L, i);
-            lua_pushnumber(L, fd);
-            lua_settable(L, -3);
+    struct sockobj *s = getsockobj(L);
+    struct iovec iovs[IOV_INLINE];
+    int iovcnt, i;
+    int flags = 0, zerocopy = 0;
+    size_t len = 0, pending;
+    /* iov[0] is left for the data pending in the write buffer */
+    struct iovec *iov = __checkiov(L, 2, iovs, IOV_INLINE, 1, &iovcnt);
+
+    for (i = 1; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    pending = s->wbuf ? buffer_size(s->wbuf) : 0;
+    if (s->wbuf_size > 0 && pending + len <= s->wbuf_size) {
+        // Coalesced with the next writes, up to the high watermark.
+        if (s->fd == -1) {
+            lua_pushnil(L);
+            lua_pushstring(L, ERROR_CLOSED);
+            return 2;
+        }
+        if (s->wbuf == NULL)
+            s->wbuf = buffer_create(s->wbuf_size);
+        if (s->wbuf == NULL || buffer_reserve(s->wbuf, len) == -1) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(ENOMEM));
+            return 2;
+        }
+        for (i = 1; i < iovcnt; i++) {
+            memcpy(s->wbuf->last, iov[i].iov_base, iov[i].iov_len);
+            s->wbuf->last += iov[i].iov_len;
+        }
+        lua_pushinteger(L, len);
+        return 1;
+    }
+
+    // The pending data and data are sent with a single call, more is likely
+    // to follow.
+    if (s->wbuf_size > 0)
+        flags |= MSG_MORE;
+
+#ifdef HAVE_ZEROCOPY
+    // Large writes are sent from the data itself, pinned until the kernel is
+    // done with it.
+    if (s->zc && s->zc->threshold > 0 && len >= s->zc->threshold && pending == 0 && s->fd != -1
+#ifdef HAVE_IO_URING
+        && __sockobj_uring(L) == NULL
+#endif
+        ) {
+        if (s->zc->npins > 0)
+            __zerocopy_reap(L, s);
+        if (__zerocopy_pin(L, s, 2) == 0) {
+            flags |= MSG_ZEROCOPY;
+            zerocopy = 1;
         }
     }
+#endif
+
+    iov[0].iov_base = pending ? s->wbuf->pos : NULL;
+    iov[0].iov_len = pending;
+    int ret = pending ? __sockobj_write(L, s, iov, iovcnt, flags)
+                      : __sockobj_write(L, s, iov + 1, iovcnt - 1, flags);
+#ifdef HAVE_ZEROCOPY
+    if (zerocopy)
+        __zerocopy_seal(L, s);
+#else
+    (void)zerocopy;
+#endif
+    if (pending)
+        buffer_consume(s->wbuf, pending);
+    if (ret == -1)
+        return 2;
+    if (flags & MSG_MORE)
+        s->sock_flags |= SOCKOBJ_MORE;
+    lua_pop(L, 1);
+    lua_pushinteger(L, len);
+    return 1;
 }
 
 /**
- * readfds, writefds, err = socket.select(readfds, writefds[, timeout=-1])
+ * Send up to len bytes of file fd from offset on the socket, without blocking.
  *
- *  `readfds`, `writefds` are all table of fds (which was returned from
- *  sockobj:fileno()).
+ * Without sendfile(), data is read into chunk, of SENDFILE_CHUNK bytes.
+ *
+ * Returns the number of bytes sent (0 at the end of the file), or -1 on error
+ * with errno set.
  */
-static int
-socket_select(lua_State * L)
+static ssize_t
+__sendfile(int sockfd, int fd, off_t offset, size_t len, char *chunk)
 {
-    int max_fd = -1;
-    fd_set rset, wset;
-    struct timeout tm;
-    double timeout = luaL_optnumber(L, 3, -1);
-    timeout_init(&tm, timeout);
-    FD_ZERO(&rset);
-    FD_ZERO(&wset);
-    __collect_fds(L, 1, &rset, &max_fd);
-    __collect_fds(L, 2, &wset, &max_fd);
+#ifdef HAVE_SENDFILE
+    (void)chunk;
+    return sendfile(sockfd, fd, &offset, len);
+#else
+    ssize_t n;
+    if (len > SENDFILE_CHUNK)
+        len = SENDFILE_CHUNK;
+    n = pread(fd, chunk, len, offset);
+    if (n <= 0)
+        return n;
+    return send(sockfd, chunk, n, 0);
+#endif
+}
 
-    int ret = __select(max_fd + 1, &rset, &wset, NULL, &tm);
-    if (ret > 0) {
-        __return_fd(L, &rset, max_fd + 1);
-        __return_fd(L, &wset, max_fd + 1);
-        return 2;
-    } else if (ret == 0) {
-        lua_pushnil(L);
-        lua_pushnil(L);
-        lua_pushstring(L, ERROR_TIMEOUT);
-        return 3;
-    } else {
-        lua_pushnil(L);
-        lua_pushnil(L);
-        lua_pushstring(L, strerror(errno));
-        return 3;
+/* File transfer of tcpsock:sendfile and tcpsock:readtofile, kept on the stack
+ * while suspended */
+struct filexfer {
+    int fd;                     /* -1 once released */
+    int opened;                 /* opened from a path, closed when released */
+    int pipe[2];                /* readtofile with splice(), -1 if none */
+    size_t len;                 /* bytes to transfer */
+    char *chunk;                /* without sendfile() or splice() */
+};
+
+/**
+ * Close the file of the transfer, on top of the stack, if it was opened from a
+ * path, and its pipe. It is safe to call it twice.
+ */
+static int
+filexfer_gc(lua_State * L)
+{
+    struct filexfer *x = (struct filexfer *)lua_touserdata(L, -1);
+    if (x->opened)
+        close(x->fd);
+    x->fd = -1;
+    x->opened = 0;
+    if (x->pipe[0] != -1) {
+        close(x->pipe[0]);
+        close(x->pipe[1]);
+        x->pipe[0] = x->pipe[1] = -1;
     }
+    return 0;
 }
 
-/*** sock_* methods are common to tcpsocket or udpsocket ***/
-
 /**
- * fd = sockobj:fileno()
+ * Push a transfer of the file at idx, a path opened with flags or a file
+ * descriptor, with chunk bytes of room.
  *
- * Return the integer file descriptor of the socket.
+ * Returns NULL on error, with errno set.
  */
-static int
-sockobj_fileno(lua_State * L)
+static struct filexfer *
+__filexfer_create(lua_State *L, int idx, int flags, size_t chunk)
 {
-    struct sockobj *s = getsockobj(L);
-    lua_pushnumber(L, s->fd);
-    return 1;
+    struct filexfer *x = (struct filexfer *)lua_newuserdata(L, sizeof(struct filexfer) + chunk);
+    x->fd = -1;
+    x->opened = 0;
+    x->pipe[0] = x->pipe[1] = -1;
+    x->len = 0;
+    x->chunk = chunk ? (char *)(x + 1) : NULL;
+    luaL_setmetatable(L, FILEXFER_TYPENAME);
+
+    if (lua_type(L, idx) == LUA_TNUMBER) {
+        x->fd = (int)lua_tointeger(L, idx);
+        return x;
+    }
+    x->fd = open(lua_tostring(L, idx), flags, 0666);
+    if (x->fd == -1)
+        return NULL;
+    x->opened = 1;
+    return x;
 }
 
 /**
- * ok, err = sockobj:close()
+ * sent, err, partial = tcpsock:sendfile(file, offset?, length?)
  *
- * Close the socket.
+ * Send length bytes (up to the end of the file by default) of file, a path or
+ * a file descriptor, from offset (0 by default). The data is not copied to user
+ * space, with sendfile().
+ *
+ * In case of success, it returns the number of bytes sent, which is less than
+ * length if the end of the file is reached. Otherwise, it returns nil, a string
+ * describing the error and the number of bytes sent so far, so that the
+ * transfer can be resumed from offset + partial.
  */
 static int
-sockobj_close(lua_State * L)
+tcpsock_sendfile(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
+    lua_Integer offset = luaL_optinteger(L, 3, 0);
+    lua_Integer length = luaL_optinteger(L, 4, -1);
+    struct filexfer *x;
+    char *errstr = NULL;
+    size_t chunk = 0;
+    size_t sent = 0;
+    struct stat st;
 
-    if (__sockobj_close(L, s) == -1)
-        return 2;
+    luaL_argcheck(L, offset >= 0, 3, "offset should not be negative");
+    if (lua_type(L, 2) != LUA_TNUMBER)
+        luaL_checkstring(L, 2);
+#ifndef HAVE_SENDFILE
+    chunk = SENDFILE_CHUNK;
+#endif
 
-    lua_pushboolean(L, 1);
-    return 1;
-}
+    /* The file is kept on the stack while suspended (the continuation sees the
+     * same stack), so that it is not opened again by each restart. */
+    x = (struct filexfer *)luaL_testudata(L, 5, FILEXFER_TYPENAME);
+    if (x == NULL) {
+        lua_settop(L, 4);
+        // Data written before goes first.
+        if (__sockobj_flush(L, s, 0) == -1) {
+            lua_pushinteger(L, 0);
+            return 3;
+        }
+        x = __filexfer_create(L, 2, O_RDONLY | O_CLOEXEC, chunk);
+        if (x == NULL) {
+            errstr = strerror(errno);
+            goto err;
+        }
+        if (length < 0) {
+            // up to the end of the file
+            if (fstat(x->fd, &st) == -1) {
+                errstr = strerror(errno);
+                goto err;
+            }
+            x->len = st.st_size > offset ? (size_t)(st.st_size - offset) : 0;
+        } else {
+            x->len = (size_t)length;
+        }
+    }
 
-static int
-sockobj_tostring(lua_State * L)
-{
-    struct sockobj *s = getsockobj(L);
-    assert(lua_getmetatable(L, -1));
-    luaL_getmetatable(L, TCPSOCK_TYPENAME);
-    if (lua_rawequal(L, -1, -2)) {
-        lua_pop(L, 2);
-        lua_pushfstring(L, "<tcpsock: %d>", s->fd);
-    } else {
-        lua_pop(L, 2);
-        lua_pushfstring(L, "<udpsock: %d>", s->fd);
+    struct timeout tm;
+    __sockobj_inittimeout(L, s, &tm, &sent);
+    while (sent < x->len) {
+        if (s->fd == -1) {
+            errstr = ERROR_CLOSED;
+            goto err;
+        }
+        ssize_t n = __sendfile(s->fd, x->fd, (off_t)offset + sent, x->len - sent, x->chunk);
+        if (n > 0) {
+            __sockobj_account(L, s, 0, n);
+            sent += n;
+            continue;
+        } else if (n == 0) {
+            // end of file
+            break;
+        }
+        if (CHECK_ERRNO(EINTR))
+            continue;
+        if (!CHECK_ERRNO(EAGAIN)) {
+            errstr = CHECK_ERRNO(EPIPE) ? ERROR_CLOSED : strerror(errno);
+            goto err;
+        }
+        int timeout = __waitfd(L, s, EVENT_WRITABLE, &tm, sent);
+        if (timeout == -1) {
+            errstr = strerror(errno);
+            goto err;
+        } else if (timeout == 1) {
+            errstr = ERROR_TIMEOUT;
+            goto err;
+        }
     }
+
+    lua_pushvalue(L, 5);
+    filexfer_gc(L);
+    lua_pop(L, 1);
+    lua_pushinteger(L, (lua_Integer)sent);
     return 1;
+
+err:
+    assert(errstr);
+    if (luaL_testudata(L, 5, FILEXFER_TYPENAME)) {
+        lua_pushvalue(L, 5);
+        filexfer_gc(L);
+        lua_pop(L, 1);
+    }
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    lua_pushinteger(L, (lua_Integer)sent);
+    return 3;
 }
 
 /**
- * sockobj:settimeout(timeout)
+ * ok, err = tcpsock:setwritebuffer(size)
  *
- * Set the timeout in seconds for subsequent socket operations.
- * A negative timeout indicates that timeout is disabled, which is default.
+ * Buffer writes up to size bytes (0 disables it, the default), so that small
+ * writes are sent together by the next write reaching size, by a read or by
+ * tcpsock:flush().
  */
 static int
-sockobj_settimeout(lua_State * L)
+tcpsock_setwritebuffer(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
-    double timeout = (double)luaL_checknumber(L, 2);
-    s->sock_timeout = timeout;
-    return 0;
+    lua_Integer size = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, size >= 0, 2, "size should not be negative");
+
+    if (s->wbuf && (size_t)buffer_size(s->wbuf) > (size_t)size) {
+        if (__sockobj_flush(L, s, 0) == -1)
+            return 2;
+    }
+    s->wbuf_size = (size_t)size;
+
+    lua_pushboolean(L, 1);
+    return 1;
 }
 
-/*
- * timeout = sockobj:gettimeout()
+/**
+ * ok, err = tcpsock:setzerocopy(threshold)
  *
- * Returns the timeout in seconds associated with socket.
- * A negative timeout indicates that timeout is disabled, which is default.
+ * Send writes of at least threshold bytes with MSG_ZEROCOPY (0 disables it,
+ * the default): the kernel reads the data from the Lua strings, which are
+ * kept alive until it reports the sends completed.
  */
 static int
-sockobj_gettimeout(lua_State * L)
+tcpsock_setzerocopy(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
-    lua_pushnumber(L, s->sock_timeout);
+    lua_Integer threshold = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, threshold >= 0, 2, "threshold should not be negative");
+
+#ifdef HAVE_ZEROCOPY
+    if (s->zc == NULL) {
+        if (threshold == 0) {
+            lua_pushboolean(L, 1);
+            return 1;
+        }
+        s->zc = (struct zerocopy *)calloc(1, sizeof(struct zerocopy));
+        if (s->zc == NULL) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(ENOMEM));
+            return 2;
+        }
+    }
+    if (s->fd != -1 && threshold > 0) {
+        int flag = 1;
+        if (setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, (void *)&flag, sizeof(flag)) == -1) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+    }
+    s->zc->threshold = (size_t)threshold;
+#else
+    (void)s;
+    if (threshold > 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(ENOPROTOOPT));
+        return 2;
+    }
+#endif
+
+    lua_pushboolean(L, 1);
     return 1;
 }
 
 /**
- * ok, err = tcpsock:connect(host, port)
- * ok, err = tcpsock:connect("unix:/path/to/unix-domain.sock")
+ * ok, err = tcpsock:flush()
  *
- * Attempts to connect to TCP socket object to a remote server or to a stream
- * unix domain socket file.
+ * Send the data buffered by tcpsock:write(), see tcpsock:setwritebuffer().
  */
 static int
-tcpsock_connect(lua_State * L)
+tcpsock_flush(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
-    sockaddr_t addr;
-    socklen_t len;
 
-    if (s->fd > 0) {
-        return luaL_error(L, "already connected");
-    }
-    if (__sockobj_getaddrfromarg(L, s, SAS2SA(&addr), &len, 1)) {
-        return 2;
-    }
-    if (__sockobj_createsocket(L, s, SOCK_STREAM) == -1) {
-        return 2;
-    }
-    if (__sockobj_connect(L, s, SAS2SA(&addr), len) == -1)
+    if (__sockobj_flush(L, s, 0) == -1)
         return 2;
 
     lua_pushboolean(L, 1);
@@ -914,234 +5783,348 @@ tcpsock_connect(lua_State * L)
 }
 
 /**
- * ok, err = tcpsock:bind(host, port)
- * ok, err = tcpsock:connect("unix:/path/to/unix-domain.sock")
+ * data, err, partial = tcpsock:read(size)
  */
 static int
-tcpsock_bind(lua_State * L)
+tcpsock_read(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
-    sockaddr_t addr;
-    socklen_t len;
+    size_t size = (int)luaL_checknumber(L, 2);
     char *errstr = NULL;
+    struct buffer *buf = NULL;
 
-    if (s->fd > 0) {
-        return luaL_error(L, "already bound");
-    }
-    if (__sockobj_getaddrfromarg(L, s, SAS2SA(&addr), &len, 1)) {
+    // A reply may depend on what was written.
+    if (__sockobj_flush(L, s, 0) == -1)
         return 2;
+
+    if (s->buf == NULL) {
+        s->buf = buffer_create(RECV_BUFSIZE);
     }
-    if (__sockobj_createsocket(L, s, SOCK_STREAM) == -1) {
-        return 2;
+    buf = s->buf;
+
+    if (s->fd == -1) {
+        errstr = ERROR_CLOSED;
+        goto err;
+    }
+
+    struct timeout tm;
+    __sockobj_inittimeout(L, s, &tm, NULL);
+
+again:
+    if (buffer_size(buf) >= size) {
+        goto success;
+    }
+
+    if (buffer_reserve(buf, RECV_BUFSIZE) == -1) {
+        errstr = strerror(ENOMEM);
+        goto err;
     }
-
-    if (bind(s->fd, SAS2SA(&addr), len) < 0) {
+    int bytes_read = __sockobj_recvwait(L, s, buf->last, buffer_available(buf), &tm, 0);
+    if (bytes_read > 0) {
+        buf->last += bytes_read;
+        goto again;
+    } else if (bytes_read == 0) {
+        errstr = ERROR_CLOSED;
+        goto err;
+    } else if (CHECK_ERRNO(ETIMEDOUT)) {
+        errstr = ERROR_TIMEOUT;
+        goto err;
+    } else {
         errstr = strerror(errno);
         goto err;
     }
 
-    lua_pushboolean(L, 1);
+success:
+    assert(buffer_size(buf) >= size);
+    lua_pushlstring(L, buf->pos, size);
+    buffer_consume(buf, size);
     return 1;
 
 err:
     assert(errstr);
     lua_pushnil(L);
     lua_pushstring(L, errstr);
-    return 2;
+    lua_pushlstring(L, buf->pos, buffer_size(buf));
+    buffer_consume(buf, buffer_size(buf));
+    return 3;
 }
 
 /**
- * ok, err = tcpsock:listen(backlog)
+ * n, err, filled = tcpsock:readinto(bytes, size?)
  *
- * Listen for connections make to the socket.
- * The backlog argument specifies the maximum number of queue connections and
- * should be at least 0.
+ * Read exactly size bytes (the capacity of bytes by default) into bytes,
+ * without creating a Lua string.
  */
 static int
-tcpsock_listen(lua_State * L)
+tcpsock_readinto(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
-    int backlog;
-    int ret;
+    struct bytesobj *b = getbytesobj(L, 2);
+    lua_Integer n = luaL_optinteger(L, 3, (lua_Integer)b->size);
+    luaL_argcheck(L, n >= 0 && (size_t)n <= b->size, 3, "size out of range");
+    size_t size = (size_t)n;
     char *errstr = NULL;
-    backlog = luaL_checknumber(L, 2);
-    /* To avoid problems on systems that don't allow a negative backlog, force
-     * minimu value of 0. */
-    if (backlog < 0) {
-        backlog = 0;
+    size_t filled;
+
+    if (__sockobj_flush(L, s, 0) == -1)
+        return 2;
+
+    struct timeout tm;
+    __sockobj_inittimeout(L, s, &tm, &filled);
+
+    // Data already read ahead by read/readuntil comes first.
+    if (s->buf && filled < size) {
+        size_t count = buffer_size(s->buf);
+        if (count > size - filled)
+            count = size - filled;
+        memcpy(b->data + filled, s->buf->pos, count);
+        buffer_consume(s->buf, count);
+        filled += count;
     }
-    ret = listen(s->fd, backlog);
-    if (ret < 0) {
-        errstr = strerror(ret);
+
+    if (filled < size && s->fd == -1) {
+        errstr = ERROR_CLOSED;
         goto err;
     }
 
-    lua_pushboolean(L, 1);
+    while (filled < size) {
+        b->len = filled;
+        int bytes_read = __sockobj_recvwait(L, s, b->data + filled, size - filled, &tm, filled);
+        if (bytes_read > 0) {
+            filled += bytes_read;
+        } else if (bytes_read == 0) {
+            errstr = ERROR_CLOSED;
+            goto err;
+        } else if (CHECK_ERRNO(ETIMEDOUT)) {
+            errstr = ERROR_TIMEOUT;
+            goto err;
+        } else {
+            errstr = strerror(errno);
+            goto err;
+        }
+    }
+
+    b->len = size;
+    lua_pushinteger(L, (lua_Integer)size);
     return 1;
 
 err:
     assert(errstr);
+    b->len = filled;
     lua_pushnil(L);
     lua_pushstring(L, errstr);
-    return 2;
+    lua_pushinteger(L, (lua_Integer)filled);
+    return 3;
 }
 
 /**
- * sock, err = tcpsock:accept()
- *
- * Accept a connection. The socket must be bound to an address and listening for
- * connections.
+ * Write all of data to fd, at its file position.
  *
- * In case of success, it returns a socket object usable to read/write data on
- * the connection. Otherwise, it returns nil and a string describing the error.
+ * Returns 0 on success, or -1 with errno set.
  */
 static int
-tcpsock_accept(lua_State * L)
+__writefile(int fd, const char *data, size_t len)
 {
-    struct sockobj *s = getsockobj(L);
-    sockaddr_t addr;
-    socklen_t addrlen;
-    int clientfd;
-    char *errstr = NULL;
-
-    if (!__getsockaddrlen(s, &addrlen)) {
-        errstr = strerror(errno);
-        goto err;
-    }
-
-    struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
-    int timeout = __waitfd(s, EVENT_READABLE, &tm);
-    if (timeout == -1) {
-        errstr = strerror(errno);
-        goto err;
-    } else if (timeout == 1) {
-        errstr = ERROR_TIMEOUT;
-        goto err;
-    } else {
-        clientfd = accept(s->fd, SAS2SA(&addr), &addrlen);
-        if (clientfd == -1) {
-            errstr = strerror(errno);
-            goto err;
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (CHECK_ERRNO(EINTR))
+                continue;
+            return -1;
         }
+        data += n;
+        len -= n;
     }
-
-    struct sockobj *client = __sockobj_create(L, TCPSOCK_TYPENAME);
-    client->fd = clientfd;
-    client->sock_family = s->sock_family;
-    if (!client) {
-        return luaL_error(L, "out of memory");
-    }
-    return 1;
-
-err:
-    assert(errstr);
-    lua_pushnil(L);
-    lua_pushstring(L, errstr);
-    return 2;
+    return 0;
 }
 
 /**
- * bytes, err = tcpsock:write(data)
+ * Move up to len bytes from sockfd to fd, at its file position, without
+ * blocking on the socket.
  *
- * This method is a synchronous operation that will not return until all the
- * data has been flushed into the system socket send buffer or an error occurs.
+ * With splice(), the data goes through pipefd and is not copied to user space.
+ * Otherwise, it is read into chunk, of READTOFILE_CHUNK bytes.
  *
- * In case of success, it returns the total number of bytes that have been sent.
- * Otherwise, it returns nil and a string describing the error.
+ * Returns the number of bytes moved, 0 at the end of stream, or -1 with errno
+ * set. On error, the data read from the socket is lost.
  */
-static int
-tcpsock_write(lua_State * L)
+static ssize_t
+__splicetofile(int sockfd, int pipefd[2], int fd, size_t len, char *chunk)
 {
-    struct sockobj *s = getsockobj(L);
-    size_t len;
-    const char *buf = luaL_checklstring(L, 2, &len);
-
-    if (__sockobj_write(L, s, buf, len) == -1)
-        return 2;
-
-    return 1;
+    ssize_t n;
+#ifdef HAVE_SPLICE
+    size_t left;
+    (void)chunk;
+    n = splice(sockfd, NULL, pipefd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n <= 0)
+        return n;
+    for (left = n; left > 0;) {
+        ssize_t m = splice(pipefd[0], NULL, fd, NULL, left, SPLICE_F_MOVE);
+        if (m == -1) {
+            if (CHECK_ERRNO(EINTR))
+                continue;
+            return -1;
+        }
+        left -= m;
+    }
+#else
+    (void)pipefd;
+    if (len > READTOFILE_CHUNK)
+        len = READTOFILE_CHUNK;
+    n = recv(sockfd, chunk, len, 0);
+    if (n <= 0)
+        return n;
+    if (__writefile(fd, chunk, n) == -1)
+        return -1;
+#endif
+    return n;
 }
 
 /**
- * data, err, partial = tcpsock:read(size)
+ * received, err, partial = tcpsock:readtofile(file, length?)
+ *
+ * Read length bytes from the socket (up to the end of stream by default) into
+ * file, a path, created or truncated, or a file descriptor, written at its
+ * file position. Data read ahead by read/readuntil is written first, then the
+ * rest is moved with splice(), in constant memory and without copying it to
+ * user space.
+ *
+ * In case of success, it returns the number of bytes written. Otherwise, it
+ * returns nil, a string describing the error and the number of bytes written
+ * so far.
  */
 static int
-tcpsock_read(lua_State * L)
+tcpsock_readtofile(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
-    size_t size = (int)luaL_checknumber(L, 2);
+    lua_Integer length = luaL_optinteger(L, 3, -1);
+    struct filexfer *x;
     char *errstr = NULL;
-    struct buffer *buf = NULL;
+    size_t chunk = 0;
+    size_t received;
 
-    if (s->buf == NULL) {
-        s->buf = buffer_create(RECV_BUFSIZE);
-    }
-    buf = s->buf;
+    if (lua_type(L, 2) != LUA_TNUMBER)
+        luaL_checkstring(L, 2);
+#ifndef HAVE_SPLICE
+    chunk = READTOFILE_CHUNK;
+#endif
 
-    if (s->fd == -1) {
-        errstr = ERROR_CLOSED;
-        goto err;
+    /* The file and the pipe are kept on the stack while suspended (the
+     * continuation sees the same stack), a path is created once. */
+    x = (struct filexfer *)luaL_testudata(L, 4, FILEXFER_TYPENAME);
+    if (x == NULL) {
+        lua_settop(L, 3);
+        if (__sockobj_flush(L, s, 0) == -1)
+            return 2;
+        x = __filexfer_create(L, 2, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, chunk);
+        if (x == NULL) {
+            received = 0;
+            errstr = strerror(errno);
+            goto err;
+        }
+        x->len = length < 0 ? (size_t)-1 : (size_t)length;
+#ifdef HAVE_SPLICE
+        if (pipe2(x->pipe, O_CLOEXEC) == -1) {
+            received = 0;
+            errstr = strerror(errno);
+            goto err;
+        }
+#endif
     }
 
     struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
-
-again:
-    if (buffer_size(buf) >= size) {
-        goto success;
+    __sockobj_inittimeout(L, s, &tm, &received);
+
+    // Data already read ahead by read/readuntil comes first.
+    if (s->buf && received < x->len) {
+        size_t count = buffer_size(s->buf);
+        if (count > x->len - received)
+            count = x->len - received;
+        if (__writefile(x->fd, s->buf->pos, count) == -1) {
+            errstr = strerror(errno);
+            goto err;
+        }
+        buffer_consume(s->buf, count);
+        received += count;
     }
 
-    while (1) {
-        int timeout = __waitfd(s, EVENT_READABLE, &tm);
+    while (received < x->len) {
+        if (s->fd == -1) {
+            errstr = ERROR_CLOSED;
+            goto err;
+        }
+        ssize_t n = __splicetofile(s->fd, x->pipe, x->fd, x->len - received, x->chunk);
+        if (n > 0) {
+            __sockobj_account(L, s, n, 0);
+            received += n;
+            continue;
+        } else if (n == 0) {
+            // end of stream
+            if (length < 0)
+                break;
+            errstr = ERROR_CLOSED;
+            goto err;
+        }
+        if (CHECK_ERRNO(EINTR))
+            continue;
+        if (!CHECK_ERRNO(EAGAIN)) {
+            errstr = CHECK_ERRNO(ECONNRESET) ? ERROR_CLOSED : strerror(errno);
+            goto err;
+        }
+        int timeout = __waitfd(L, s, EVENT_READABLE, &tm, received);
         if (timeout == -1) {
             errstr = strerror(errno);
             goto err;
         } else if (timeout == 1) {
             errstr = ERROR_TIMEOUT;
             goto err;
-        } else {
-            if (buffer_available(buf) < RECV_BUFSIZE) {
-                buffer_grow(buf, RECV_BUFSIZE - buffer_available(buf));
-            }
-            int bytes_read = recv(s->fd, buf->last, RECV_BUFSIZE, 0);
-            if (bytes_read > 0) {
-                buf->last += bytes_read;
-                goto again;
-            } else if (bytes_read == 0) {
-                errstr = ERROR_CLOSED;
-                goto err;
-            } else {
-                switch (errno) {
-                case EINTR:
-                case EAGAIN:
-                    // do nothing, continue
-                    continue;
-                default:
-                    errstr = strerror(errno);
-                    goto err;
-                }
-            }
         }
     }
 
-success:
-    assert(buffer_size(buf) >= size);
-    lua_pushlstring(L, buf->pos, size);
-    buf->pos += size;
-    buffer_shrink(buf);
+    lua_pushvalue(L, 4);
+    filexfer_gc(L);
+    lua_pop(L, 1);
+    lua_pushinteger(L, (lua_Integer)received);
     return 1;
 
 err:
     assert(errstr);
+    if (luaL_testudata(L, 4, FILEXFER_TYPENAME)) {
+        lua_pushvalue(L, 4);
+        filexfer_gc(L);
+        lua_pop(L, 1);
+    }
     lua_pushnil(L);
     lua_pushstring(L, errstr);
-    lua_pushlstring(L, buf->pos, buf->last - buf->pos);
-    buf->pos = buf->last;
-    buffer_shrink(buf);
+    lua_pushinteger(L, (lua_Integer)received);
     return 3;
 }
 
+/**
+ * Find the first occurrence of pattern in data.
+ */
+static const char *
+__memmem(const char *data, size_t size, const char *pattern, size_t len)
+{
+    if (len == 1)
+        return memchr(data, pattern[0], size);
+#ifdef HAVE_MEMMEM
+    return memmem(data, size, pattern, len);
+#else
+    const char *p = data;
+    const char *end = data + size;
+    while ((size_t)(end - p) >= len) {
+        p = memchr(p, pattern[0], end - p - len + 1);
+        if (p == NULL)
+            return NULL;
+        if (memcmp(p, pattern, len) == 0)
+            return p;
+        p++;
+    }
+    return NULL;
+#endif
+}
+
 static int
 tcpsock_readuntil_iterator(lua_State *L)
 {
@@ -1149,8 +6132,13 @@ tcpsock_readuntil_iterator(lua_State *L)
     char *errstr = NULL;
     size_t len;
     const char *pattern = lua_tolstring(L, lua_upvalueindex(2), &len);
-    int state = lua_tointeger(L, lua_upvalueindex(4));
     int inclusive = lua_toboolean(L, lua_upvalueindex(3));
+    /* Bytes of the message (from buf->pos) already scanned, kept across
+     * calls so that the scan resumes where it stopped. */
+    size_t scanned = lua_tointeger(L, lua_upvalueindex(4));
+
+    if (__sockobj_flush(L, s, 0) == -1)
+        return 2;
 
     if (s->buf == NULL) {
         s->buf = buffer_create(RECV_BUFSIZE);
@@ -1158,93 +6146,60 @@ tcpsock_readuntil_iterator(lua_State *L)
     struct buffer *buf = s->buf;
 
     struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
+    __sockobj_inittimeout(L, s, &tm, NULL);
 
 again:
-    do {
-        int i = 0;
-        int bytes = buffer_size(buf);
-        if (bytes == 0) {
-            break;
-        }
-        while (i < bytes) {
-            char c = buf->pos[i];
-
-            if (c == pattern[state]) {
-                i++;
-                state++;
-                if (state == (int)len) {
-                    /* matched */
-                    buf->pos += i;
-                    state = 0;
-                    lua_pushinteger(L, state);
-                    lua_replace(L, lua_upvalueindex(4));
-                    goto matched;
-                }
-                continue;
-            }
-
-            if (state == 0) {
-                i++;
-                continue;
-            }
-
-            state = 0;
+    if ((size_t)buffer_size(buf) >= len) {
+        // A match may start in the last len - 1 bytes scanned.
+        size_t from = scanned >= len ? scanned - len + 1 : 0;
+        const char *match = __memmem(buf->pos + from, buffer_size(buf) - from, pattern, len);
+        if (match) {
+            scanned = match - buf->pos + len;
+            lua_pushinteger(L, 0);
+            lua_replace(L, lua_upvalueindex(4));
+            goto matched;
         }
-
-        buf->pos += i;
-        lua_pushinteger(L, state);
+        scanned = buffer_size(buf);
+        lua_pushinteger(L, scanned);
         lua_replace(L, lua_upvalueindex(4));
-    } while (0);
+    }
 
-    while (1) {
-        int timeout = __waitfd(s, EVENT_READABLE, &tm);
-        if (timeout == -1) {
-            errstr = strerror(errno);
-            goto err;
-        } else if (timeout == 1) {
-            errstr = ERROR_TIMEOUT;
-            goto err;
-        } else {
-            if (buffer_available(buf) < RECV_BUFSIZE) {
-                buffer_grow(buf, RECV_BUFSIZE - buffer_available(buf));
-            }
-            int bytes_read = recv(s->fd, buf->last, RECV_BUFSIZE, 0);
-            if (bytes_read > 0) {
-                buf->last += bytes_read;
-                goto again;
-            } else if (bytes_read == 0) {
-                errstr = ERROR_CLOSED;
-                goto err;
-            } else {
-                switch (errno) {
-                case EINTR:
-                case EAGAIN:
-                    // do nothing, continue
-                    continue;
-                default:
-                    errstr = strerror(errno);
-                    goto err;
-                }
-            }
-        }
+    if (buffer_reserve(buf, RECV_BUFSIZE) == -1) {
+        errstr = strerror(ENOMEM);
+        goto err;
+    }
+    int bytes_read = __sockobj_recvwait(L, s, buf->last, buffer_available(buf), &tm, 0);
+    if (bytes_read > 0) {
+        buf->last += bytes_read;
+        goto again;
+    } else if (bytes_read == 0) {
+        errstr = ERROR_CLOSED;
+        goto err;
+    } else if (CHECK_ERRNO(ETIMEDOUT)) {
+        errstr = ERROR_TIMEOUT;
+        goto err;
+    } else {
+        errstr = strerror(errno);
+        goto err;
     }
 
 matched:
     if (inclusive) {
-        lua_pushlstring(L, buf->start, buf->pos - buf->start);
+        lua_pushlstring(L, buf->pos, scanned);
     } else {
-        lua_pushlstring(L, buf->start, buf->pos - buf->start - len);
+        lua_pushlstring(L, buf->pos, scanned - len);
     }
-    buffer_shrink(buf);
+    buffer_consume(buf, scanned);
     return 1;
 
 err:
     assert(errstr);
     lua_pushnil(L);
     lua_pushstring(L, errstr);
-    lua_pushlstring(L, buf->start, buf->pos - buf->start);
-    buffer_shrink(buf);
+    lua_pushlstring(L, buf->pos, buffer_size(buf));
+    buffer_consume(buf, buffer_size(buf));
+    lua_pushinteger(L, 0);
+    lua_replace(L, lua_upvalueindex(4));
     return 3;
 }
 
@@ -1263,6 +6218,9 @@ tcpsock_readuntil(lua_State *L)
     if (type != LUA_TSTRING) {
         return luaL_error(L, "pattern should be string");
     }
+    if (lua_rawlen(L, 2) == 0) {
+        return luaL_error(L, "pattern should not be empty");
+    }
     if (n == 3) {
         if (!lua_isboolean(L, 3)) {
             luaL_error(L, "the second argument should be boolean value");
@@ -1270,7 +6228,7 @@ tcpsock_readuntil(lua_State *L)
     } else {
         lua_pushboolean(L, 0);
     }
-    lua_pushinteger(L, 0);
+    lua_pushinteger(L, 0);    /* scanned */
 
     lua_pushcclosure(L, tcpsock_readuntil_iterator, 4);
     return 1;
@@ -1293,10 +6251,96 @@ tcpsock_shutdown(lua_State * L)
     int ret = shutdown(s->fd, how);
     if (ret < 0) {
         lua_pushnil(L);
-        lua_pushstring(L, strerror(errno));
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * Set option o (see sockopts) of s to the value at index 3, or record it if
+ * the socket does not exist yet and s mirrors it.
+ */
+static int
+__sockobj_setopt(lua_State *L, struct sockobj *s, const struct sockopt *o)
+{
+    int level, optname, value;
+
+    if (o->type == SOCKOPT_BOOL) {
+        value = lua_toboolean(L, 3);
+    } else if (o->type == SOCKOPT_TIME) {
+        double seconds = luaL_checknumber(L, 3);
+        luaL_argcheck(L, seconds >= 0 && seconds * o->scale <= INT_MAX, 3, "duration out of range");
+        value = (int)(seconds * o->scale);
+    } else {
+        lua_Integer n = luaL_checkinteger(L, 3);
+        luaL_argcheck(L, n >= 0 && n <= (o->max ? o->max : INT_MAX), 3, "value out of range");
+        value = (int)n;
+    }
+    if (o->optname == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(ENOPROTOOPT));
+        return 2;
+    }
+    // The socket is created by bind(), connect() or sendto(), mirrored options
+    // are applied then if it does not exist yet.
+    if (s->fd != -1 || (!o->sockflag && o->offset == -1)) {
+        __sockopt_name(o, s->sock_family, &level, &optname);
+        if (setsockopt(s->fd, level, optname, (void *)&value, sizeof(value)) < 0) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+        s->sock_opts |= 1u << (o - sockopts);
+    }
+    if (o->sockflag && value) {
+        s->sock_flags |= o->sockflag;
+    } else if (o->sockflag) {
+        s->sock_flags &= ~o->sockflag;
+        // Uncorked, no segment is held back anymore.
+        if (o->sockflag == SOCKOBJ_CORK)
+            s->sock_flags &= ~SOCKOBJ_MORE;
+    } else if (o->offset != -1) {
+        *(int *)((char *)s + o->offset) = value;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * Push the value of option o (see sockopts) of s.
+ */
+static int
+__sockobj_getopt(lua_State *L, struct sockobj *s, const struct sockopt *o)
+{
+    int level, optname, value = 0;
+    socklen_t len = sizeof(value);
+
+    if (o->optname == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(ENOPROTOOPT));
         return 2;
     }
-    lua_pushboolean(L, 1);
+    if (s->fd == -1 && o->sockflag) {
+        value = (s->sock_flags & o->sockflag) != 0;
+    } else if (s->fd == -1 && o->offset != -1) {
+        value = *(int *)((char *)s + o->offset);
+    } else {
+        __sockopt_name(o, s->sock_family, &level, &optname);
+        if (getsockopt(s->fd, level, optname, (void *)&value, &len) < 0) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+    }
+    if (o->type == SOCKOPT_BOOL) {
+        lua_pushboolean(L, value);
+    } else if (o->type == SOCKOPT_TIME) {
+        lua_pushnumber(L, (double)value / o->scale);
+    } else {
+        lua_pushinteger(L, value);
+    }
     return 1;
 }
 
@@ -1307,33 +6351,7 @@ static int
 tcpsock_setopt(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
-    const char *opt = luaL_checkstring(L, 2);
-    int flag = lua_toboolean(L, 3);
-    socklen_t flagsize;
-    flagsize = sizeof(flag);
-    int err;
-    int level;
-    int optname;
-    if (!strcmp(opt, OPT_TCP_KEEPALIVE)) {
-        level = SOL_SOCKET;
-        optname = SO_KEEPALIVE;
-    } else if (!strcmp(opt, OPT_TCP_NODELAY)) {
-        level = IPPROTO_TCP;
-        optname = TCP_NODELAY;
-    } else if (!strcmp(opt, OPT_TCP_REUSEADDR)) {
-        level = SOL_SOCKET;
-        optname = SO_REUSEADDR;
-    } else {
-        return luaL_error(L, "unexpected option: %s", opt);
-    }
-    err = setsockopt(s->fd, level, optname, (void *)&flag, flagsize);
-    if (err < 0) {
-        lua_pushnil(L);
-        lua_pushstring(L, strerror(errno));
-        return 2;
-    }
-    lua_pushboolean(L, 1);
-    return 1;
+    return __sockobj_setopt(L, s, __sockopt_check(L, 2, SOCKOPT_TCP));
 }
 
 /**
@@ -1343,32 +6361,7 @@ static int
 tcpsock_getopt(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
-    const char *opt = luaL_checkstring(L, 2);
-    int flag;
-    int err;
-    socklen_t flagsize = sizeof(flag);
-    int level;
-    int optname;
-    if (!strcmp(opt, OPT_TCP_KEEPALIVE)) {
-        level = SOL_SOCKET;
-        optname = SO_KEEPALIVE;
-    } else if (!strcmp(opt, OPT_TCP_NODELAY)) {
-        level = IPPROTO_TCP;
-        optname = TCP_NODELAY;
-    } else if (!strcmp(opt, OPT_TCP_REUSEADDR)) {
-        level = SOL_SOCKET;
-        optname = SO_REUSEADDR;
-    } else {
-        return luaL_error(L, "unexpected option: %s", opt);
-    }
-    err = getsockopt(s->fd, level, optname, (void *)&flag, &flagsize);
-    if (err < 0) {
-        lua_pushnil(L);
-        lua_pushstring(L, strerror(errno));
-        return 2;
-    }
-    lua_pushboolean(L, flag);
-    return 1;
+    return __sockobj_getopt(L, s, __sockopt_check(L, 2, SOCKOPT_TCP));
 }
 
 /**
@@ -1447,6 +6440,7 @@ udpsock_connect(lua_State * L)
     struct sockobj *s = getsockobj(L);
     sockaddr_t addr;
     socklen_t len;
+    struct timeout tm;
 
     if (s->fd > 0) {
         return luaL_error(L, "already connected");
@@ -1457,7 +6451,8 @@ udpsock_connect(lua_State * L)
     if (__sockobj_createsocket(L, s, SOCK_DGRAM) == -1) {
         return 2;
     }
-    if (__sockobj_connect(L, s, SAS2SA(&addr), len) == -1)
+    timeout_init(&tm, s->sock_timeout);
+    if (__sockobj_connect(L, s, SAS2SA(&addr), len, &tm) == -1)
         return 2;
 
     lua_pushboolean(L, 1);
@@ -1501,7 +6496,32 @@ err:
 }
 
 /**
- * ok, err = udpsock:send(data)
+ * ok, err = udpsock:setopt(opt, value)
+ *
+ * OPT_UDP_SEGMENT takes a segment size, 0 disables it. With it, data sent in a
+ * single call is split by the kernel into datagrams of that size (UDP GSO).
+ * OPT_UDP_GRO takes a boolean, see udpsock:recv().
+ */
+static int
+udpsock_setopt(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    return __sockobj_setopt(L, s, __sockopt_check(L, 2, SOCKOPT_UDP));
+}
+
+/**
+ * value, err = udpsock:getopt(opt)
+ */
+static int
+udpsock_getopt(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    return __sockobj_getopt(L, s, __sockopt_check(L, 2, SOCKOPT_UDP));
+}
+
+/**
+ * ok, err = udpsock:send(data, i?, j?)
+ * ok, err = udpsock:send({data, ...})
  *
  * Writes data on the current UDP or datagram unix domain socket object.
  *
@@ -1512,13 +6532,14 @@ static int
 udpsock_send(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
-    size_t len;
-    const char *buf = luaL_checklstring(L, 2, &len);
+    struct iovec iovs[IOV_INLINE];
+    int iovcnt;
+    struct iovec *iov = __checkiov(L, 2, iovs, IOV_INLINE, 0, &iovcnt);
 
     struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
+    __sockobj_inittimeout(L, s, &tm, NULL);
     size_t sent = 0;
-    if (__sockobj_send(L, s, buf, len, &sent, &tm) == -1)
+    if (__sockobj_send(L, s, iov, iovcnt, &sent, &tm) == -1)
         return 2;
 
     lua_pushboolean(L, 1);
@@ -1540,7 +6561,7 @@ udpsock_sendto(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
     size_t len;
-    const char *buf = luaL_checklstring(L, 2, &len);
+    const char *buf = __checkdata(L, 2, &len, 0);
     sockaddr_t addr;
     socklen_t addrlen;
 
@@ -1554,7 +6575,7 @@ udpsock_sendto(lua_State * L)
         }
     }
     struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
+    __sockobj_inittimeout(L, s, &tm, NULL);
     size_t sent = 0;
     if (__sockobj_sendto(L, s, buf, len, &sent, SAS2SA(&addr), addrlen, &tm) == -1)
         return 2;
@@ -1563,12 +6584,40 @@ udpsock_sendto(lua_State * L)
     return 1;
 }
 
+/**
+ * Returns the receive buffer of the udp socket, with room for a datagram of
+ * the buffersize argument, which is lowered to DATAGRAM_MAX as no datagram is
+ * larger, and set in *size. It is kept by the socket, datagrams are copied out
+ * of it into Lua strings right away.
+ *
+ * On error, pushes nil and an error message and returns NULL.
+ */
+static struct buffer *
+__udpsock_recvbuf(lua_State *L, struct sockobj *s, size_t *size)
+{
+    lua_Integer buffersize = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, buffersize > 0, 2, "buffersize out of range");
+    *size = buffersize > DATAGRAM_MAX ? DATAGRAM_MAX : (size_t)buffersize;
+    if (s->buf == NULL)
+        s->buf = buffer_create(*size);
+    if (s->buf == NULL || buffer_reserve(s->buf, *size) == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(ENOMEM));
+        return NULL;
+    }
+    return s->buf;
+}
+
 /**
  * data, err = udpsock:recv(buffersize)
+ * data, segsize = udpsock:recv(buffersize)
  *
  * Receive up to buffersize bytes from UDP or datagram unix domain socket
  * object.
  *
+ * If OPT_UDP_GRO is enabled, a datagram may be a batch of segments coalesced
+ * by the kernel, which are all segsize bytes long except the last one.
+ *
  * In case of success, it returns the data received; in case of error, it
  * returns nil with a string describing the error.
  */
@@ -1576,13 +6625,24 @@ static int
 udpsock_recv(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
-    size_t buffersize = (int)luaL_checknumber(L, 2);
-    struct buffer *buf = NULL;
-    buf = buffer_create(buffersize);
+    size_t buffersize;
+    struct buffer *buf = __udpsock_recvbuf(L, s, &buffersize);
     size_t received = 0;
 
+    if (buf == NULL)
+        return 2;
+
     struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
+    __sockobj_inittimeout(L, s, &tm, NULL);
+
+    if (s->sock_flags & SOCKOBJ_GRO) {
+        size_t segsize;
+        if (__sockobj_recvfrom(L, s, buf->last, buffersize, &received, NULL, NULL, &segsize, &tm) == -1)
+            return 2;
+        lua_pushlstring(L, buf->last, received);
+        lua_pushinteger(L, (lua_Integer)segsize);
+        return 2;
+    }
 
     if (__sockobj_recv(L, s, buf->last, buffersize, &received, &tm) == -1)
         return 2;
@@ -1593,6 +6653,7 @@ udpsock_recv(lua_State * L)
 
 /**
  * data, addr, err = udpsock:recvfrom(buffersize)
+ * data, addr, segsize = udpsock:recvfrom(buffersize)
  *
  * Works exactly as the udpsock:recv method, except it returns the addr as extra
  * return values (and is therefore slightly less efficient) in
@@ -1602,12 +6663,14 @@ static int
 udpsock_recvfrom(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
-    size_t buffersize = (int)luaL_checknumber(L, 2);
-    struct buffer *buf = NULL;
-    buf = buffer_create(buffersize);
+    size_t buffersize;
+    struct buffer *buf = __udpsock_recvbuf(L, s, &buffersize);
     size_t received = 0;
+    size_t segsize;
     sockaddr_t addr;
     socklen_t addrlen;
+    if (buf == NULL)
+        return 2;
     if (!__getsockaddrlen(s, &addrlen)) {
         lua_pushnil(L);
         lua_pushnil(L);
@@ -1616,9 +6679,9 @@ udpsock_recvfrom(lua_State * L)
     }
 
     struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
+    __sockobj_inittimeout(L, s, &tm, NULL);
 
-    if (__sockobj_recvfrom(L, s, buf->last, buffersize, &received, SAS2SA(&addr), &addrlen, &tm) == -1)
+    if (__sockobj_recvfrom(L, s, buf->last, buffersize, &received, SAS2SA(&addr), &addrlen, &segsize, &tm) == -1)
         return 2;
 
     lua_pushlstring(L, buf->last, received);
@@ -1627,33 +6690,409 @@ udpsock_recvfrom(lua_State * L)
         return 2;
     }
 
+    if (s->sock_flags & SOCKOBJ_GRO) {
+        lua_pushinteger(L, (lua_Integer)segsize);
+        return 3;
+    }
+    return 2;
+}
+
+/**
+ * Receive up to count messages of size bytes each into the message vectors,
+ * without blocking.
+ *
+ * Returns the number of messages received (at least one), or -1 on error with
+ * errno set (EAGAIN if there is none).
+ */
+static int
+__recvmany(int fd, struct msgslab *slab, unsigned int count, size_t size)
+{
+    unsigned int i;
+    for (i = 0; i < count; i++) {
+        struct msghdr *hdr = &slab->msgs[i].msg_hdr;
+        slab->iov[i].iov_base = slab->data + i * size;
+        slab->iov[i].iov_len = size;
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->msg_name = &slab->addrs[i];
+        hdr->msg_namelen = sizeof(sockaddr_t);
+        hdr->msg_iov = &slab->iov[i];
+        hdr->msg_iovlen = 1;
+    }
+#ifdef HAVE_RECVMMSG
+    return recvmmsg(fd, slab->msgs, count, MSG_DONTWAIT, NULL);
+#else
+    for (i = 0; i < count; i++) {
+        ssize_t n = recvmsg(fd, &slab->msgs[i].msg_hdr, MSG_DONTWAIT);
+        if (n == -1)
+            return i > 0 ? (int)i : -1;
+        slab->msgs[i].msg_len = n;
+    }
+    return count;
+#endif
+}
+
+/**
+ * datas, addrs = udpsock:recvmany(maxmsgs, maxsize)
+ *
+ * Wait for at least one datagram, then receive up to maxmsgs datagrams of up to
+ * maxsize bytes each (at most DATAGRAM_MAX, as udpsock:recv) in a single
+ * system call (recvmmsg on Linux). Returns an
+ * array of the data received and an array of the source addresses, in the
+ * format of udpsock:recvfrom (false if the source is unnamed).
+ *
+ * In case of error, it returns nil and a string describing the error.
+ */
+static int
+udpsock_recvmany(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    lua_Integer maxmsgs = luaL_checkinteger(L, 2);
+    lua_Integer maxsize = luaL_checkinteger(L, 3);
+    char *errstr = NULL;
+    int n, i;
+
+    luaL_argcheck(L, maxmsgs > 0 && maxmsgs <= MMSG_MAX, 2, "maxmsgs out of range");
+    luaL_argcheck(L, maxsize > 0, 3, "maxsize out of range");
+    if (maxsize > DATAGRAM_MAX)
+        maxsize = DATAGRAM_MAX;
+
+    struct msgslab *slab = __sockobj_slab(s, maxmsgs, maxsize);
+    if (slab == NULL) {
+        errstr = strerror(ENOMEM);
+        goto err;
+    }
+
+    struct timeout tm;
+    __sockobj_inittimeout(L, s, &tm, NULL);
+    while (1) {
+        if (s->fd == -1) {
+            errstr = ERROR_CLOSED;
+            goto err;
+        }
+        // Try first, pending datagrams are received without polling.
+        n = __recvmany(s->fd, slab, maxmsgs, maxsize);
+        if (n > 0)
+            break;
+        if (CHECK_ERRNO(EINTR))
+            continue;
+        if (!CHECK_ERRNO(EAGAIN)) {
+            errstr = strerror(errno);
+            goto err;
+        }
+        int timeout = __waitfd(L, s, EVENT_READABLE, &tm, 0);
+        if (timeout == -1) {
+            errstr = strerror(errno);
+            goto err;
+        } else if (timeout == 1) {
+            errstr = ERROR_TIMEOUT;
+            goto err;
+        }
+    }
+
+    size_t received = 0;
+    lua_createtable(L, n, 0);
+    lua_createtable(L, n, 0);
+    int top = lua_gettop(L);
+    for (i = 0; i < n; i++) {
+        mmsghdr_t *msg = &slab->msgs[i];
+        lua_pushlstring(L, slab->iov[i].iov_base, msg->msg_len);
+        lua_rawseti(L, top - 1, i + 1);
+        if (msg->msg_hdr.msg_namelen == 0) {
+            lua_pushboolean(L, 0);
+        } else if (__sockobj_makeaddr(L, s, msg->msg_hdr.msg_name, msg->msg_hdr.msg_namelen) == -1) {
+            return 2;
+        }
+        lua_rawseti(L, top, i + 1);
+        lua_settop(L, top);
+        received += msg->msg_len;
+    }
+    __sockobj_account(L, s, received, 0);
+    return 2;
+
+err:
+    assert(errstr);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return 2;
+}
+
+/**
+ * Send count messages of the message vectors, without blocking.
+ *
+ * Returns the number of messages sent (at least one), or -1 on error with
+ * errno set, for the first message.
+ */
+static int
+__sendmany(int fd, struct msgslab *slab, unsigned int count)
+{
+#ifdef HAVE_SENDMMSG
+    return sendmmsg(fd, slab->msgs, count, MSG_DONTWAIT);
+#else
+    unsigned int i;
+    for (i = 0; i < count; i++) {
+        ssize_t n = sendmsg(fd, &slab->msgs[i].msg_hdr, MSG_DONTWAIT);
+        if (n == -1)
+            return i > 0 ? (int)i : -1;
+        slab->msgs[i].msg_len = n;
+    }
+    return count;
+#endif
+}
+
+/**
+ * Fill a message header with the entry at index i of the list at index 2: a
+ * string (or bytes object) sent to the connected peer, or a table
+ * {data, host, port} or {data, path}.
+ *
+ * Data is not copied, the list keeps it alive. If the destination does not
+ * resolve, pushes an error message and returns -1. Resolving it may suspend
+ * the operation, see __sockobj_resolve.
+ */
+static int
+__udpsock_msgentry(lua_State *L, struct sockobj *s, int i, mmsghdr_t *msg, struct iovec *iov, sockaddr_t *addr, struct timeout *tm, size_t progress)
+{
+    int entry;
+    size_t len;
+    lua_rawgeti(L, 2, i);
+    entry = lua_gettop(L);
+    memset(&msg->msg_hdr, 0, sizeof(msg->msg_hdr));
+    msg->msg_hdr.msg_iov = iov;
+    msg->msg_hdr.msg_iovlen = 1;
+    if (lua_type(L, entry) != LUA_TTABLE) {
+        iov->iov_base = (char *)__checkdata(L, entry, &len, 0);
+        iov->iov_len = len;
+        lua_settop(L, entry - 1);
+        return 0;
+    }
+
+    lua_rawgeti(L, entry, 1);
+    iov->iov_base = (char *)__checkdata(L, entry + 1, &len, 0);
+    iov->iov_len = len;
+    lua_rawgeti(L, entry, 2);
+    lua_rawgeti(L, entry, 3);
+    const char *host = luaL_checkstring(L, entry + 2);
+    if (lua_isnil(L, entry + 3)) {
+        addr->un.sun_family = AF_UNIX;
+        strncpy(addr->un.sun_path, host, sizeof(addr->un.sun_path) - 1);
+        addr->un.sun_path[sizeof(addr->un.sun_path) - 1] = '\0';
+        msg->msg_hdr.msg_namelen = sizeof(addr->un);
+    } else {
+        int port = luaL_checkinteger(L, entry + 3);
+        if (__sockobj_setipaddr(L, tm, host, SAS2SA(addr), sizeof(*addr), s->sock_family, progress) != 0) {
+            lua_replace(L, entry);
+            lua_settop(L, entry);
+            return -1;
+        }
+        msg->msg_hdr.msg_namelen = __setport(addr, port);
+    }
+    msg->msg_hdr.msg_name = addr;
+    lua_settop(L, entry - 1);
+    return 0;
+}
+
+/**
+ * Record the error on top of the stack for message i, in the table of errors
+ * at index 3 (created on the first error).
+ */
+static void
+__udpsock_msgerror(lua_State *L, int i)
+{
+    if (lua_isnil(L, 3)) {
+        lua_newtable(L);
+        lua_replace(L, 3);
+    }
+    lua_rawseti(L, 3, i);
+}
+
+/**
+ * Returns the number of errors recorded for the first n messages.
+ */
+static size_t
+__udpsock_nerrors(lua_State *L, size_t n)
+{
+    size_t nerrors = 0;
+    if (lua_isnil(L, 3))
+        return 0;
+    lua_pushnil(L);
+    while (lua_next(L, 3)) {
+        if ((size_t)lua_tointeger(L, -2) <= n)
+            nerrors++;
+        lua_pop(L, 1);
+    }
+    return nerrors;
+}
+
+/**
+ * sent, errs = udpsock:sendmany(list)
+ *
+ * Send each message of list, in as few system calls as possible (sendmmsg on
+ * Linux). A message is a string (or bytes object) for the connected peer, or a
+ * table {data, host, port} or {data, path} with its destination, so that the
+ * same data can be fanned out to many destinations.
+ *
+ * It returns the number of messages sent and, if some of them failed, a table
+ * mapping their indices in list to a string describing the error. Other
+ * messages are still sent. In case of error (timeout, socket closed), it
+ * returns nil, a string describing the error and the number of messages sent.
+ */
+static int
+udpsock_sendmany(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    char *errstr = NULL;
+    size_t progress;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    size_t total = lua_rawlen(L, 2);
+
+    struct timeout tm;
+    if (!__sockobj_inittimeout(L, s, &tm, &progress))
+        lua_settop(L, 2);
+    /* The table of errors is kept on the stack while suspended (the
+     * continuation sees the same stack), so that it survives restarts. */
+    lua_settop(L, 3);
+
+    if (s->fd == -1 && total > 0) {
+        // create socket if not presented, for the family of the first message
+        lua_rawgeti(L, 2, 1);
+        if (lua_type(L, -1) == LUA_TTABLE) {
+            lua_rawgeti(L, -1, 2);
+            lua_rawgeti(L, -2, 3);
+            if (lua_isnil(L, -1)) {
+                s->sock_family = AF_UNIX;
+            } else {
+                sockaddr_t addr;
+                const char *host = lua_tostring(L, -2);
+                // A bad destination is reported with its message.
+                if (host == NULL || __sockobj_setipaddr(L, &tm, host, SAS2SA(&addr), sizeof(addr), AF_UNSPEC, progress) == -1)
+                    addr.sa.sa_family = AF_INET;
+                s->sock_family = addr.sa.sa_family;
+            }
+            lua_settop(L, 3);
+            if (__sockobj_createsocket(L, s, SOCK_DGRAM) == -1)
+                return 2;
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+
+    struct msgslab *slab = __sockobj_slab(s, total < MMSG_MAX ? (total > 0 ? total : 1) : MMSG_MAX, 0);
+    if (slab == NULL) {
+        errstr = strerror(ENOMEM);
+        goto err;
+    }
+
+    // progress is the number of messages handled so far
+    while (progress < total) {
+        unsigned int count = 0;
+        int bad = 0;
+        if (s->fd == -1) {
+            errstr = ERROR_CLOSED;
+            goto err;
+        }
+        while (count < slab->count && progress + count < total) {
+            if (__udpsock_msgentry(L, s, progress + count + 1, &slab->msgs[count], &slab->iov[count], &slab->addrs[count], &tm, progress) == -1) {
+                // skipped once the messages before it are sent
+                __udpsock_msgerror(L, progress + count + 1);
+                bad = 1;
+                break;
+            }
+            count++;
+        }
+        if (count == 0) {
+            progress++;
+            continue;
+        }
+
+        int n = __sendmany(s->fd, slab, count);
+        if (n == -1) {
+            if (CHECK_ERRNO(EINTR))
+                continue;
+            if (CHECK_ERRNO(EAGAIN)) {
+                int timeout = __waitfd(L, s, EVENT_WRITABLE, &tm, progress);
+                if (timeout == -1) {
+                    errstr = strerror(errno);
+                    goto err;
+                } else if (timeout == 1) {
+                    errstr = ERROR_TIMEOUT;
+                    goto err;
+                }
+                continue;
+            }
+            // the first message failed, skip it
+            lua_pushstring(L, strerror(errno));
+            __udpsock_msgerror(L, progress + 1);
+            progress++;
+            continue;
+        }
+
+        size_t bytes = 0;
+        int i;
+        for (i = 0; i < n; i++)
+            bytes += slab->msgs[i].msg_len;
+        __sockobj_account(L, s, 0, bytes);
+        progress += n;
+        if (bad && (unsigned int)n == count)
+            progress++;
+    }
+
+    lua_pushinteger(L, (lua_Integer)(total - __udpsock_nerrors(L, total)));
+    lua_pushvalue(L, 3);
     return 2;
+
+err:
+    assert(errstr);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    lua_pushinteger(L, (lua_Integer)(progress - __udpsock_nerrors(L, progress)));
+    return 3;
 }
 
 static const luaL_Reg socketlib[] = {
     {"tcp", socket_tcp},
     {"udp", socket_udp},
     {"select", socket_select},
+    {"poller", socket_poller},
+    {"spawn", socket_spawn},
+    {"run", socket_run},
+    {"sleep", socket_sleep},
+    {"workers", socket_workers},
+    {"bytes", socket_bytes},
+    {"relay", socket_relay},
+    {"resolve", socket_resolve},
+    {"setdnsttl", socket_setdnsttl},
+    {"sethost", socket_sethost},
+    {"connect_many", socket_connect_many},
     {NULL, NULL},
 };
 
 static const luaL_Reg sockobj_methods[] = {
-    {"__gc", sockobj_close},
+    {"__gc", sockobj_gc},
     {"__tostring", sockobj_tostring},
     {"close", sockobj_close},
     {"fileno", sockobj_fileno},
     {"settimeout", sockobj_settimeout},
     {"gettimeout", sockobj_gettimeout},
+    {"setidletimeout", sockobj_setidletimeout},
+    {"getidletimeout", sockobj_getidletimeout},
+    {"recvinto", sockobj_recvinto},
     {NULL, NULL},
 };
 
 static const luaL_Reg tcpsock_methods[] = {
     {"connect", tcpsock_connect},
+    {"setkeepalive", tcpsock_setkeepalive},
     {"bind", tcpsock_bind},
     {"listen", tcpsock_listen},
     {"accept", tcpsock_accept},
+    {"acceptmany", tcpsock_acceptmany},
     {"write", tcpsock_write},
+    {"setwritebuffer", tcpsock_setwritebuffer},
+    {"flush", tcpsock_flush},
+    {"setzerocopy", tcpsock_setzerocopy},
+    {"sendfile", tcpsock_sendfile},
     {"read", tcpsock_read},
+    {"readinto", tcpsock_readinto},
+    {"readtofile", tcpsock_readtofile},
     {"readuntil", tcpsock_readuntil},
     {"shutdown", tcpsock_shutdown},
     {"setopt", tcpsock_setopt},
@@ -1670,6 +7109,31 @@ static const luaL_Reg udpsock_methods[] = {
     {"sendto", udpsock_sendto},
     {"recv", udpsock_recv},
     {"recvfrom", udpsock_recvfrom},
+    {"recvmany", udpsock_recvmany},
+    {"sendmany", udpsock_sendmany},
+    {"setopt", udpsock_setopt},
+    {"getopt", udpsock_getopt},
+    {NULL, NULL},
+};
+
+static const luaL_Reg bytes_methods[] = {
+    {"__len", bytes_len},
+    {"__tostring", bytes_tostring},
+    {"capacity", bytes_capacity},
+    {"sub", bytes_sub},
+    {NULL, NULL},
+};
+
+static const luaL_Reg poller_methods[] = {
+    {"__gc", poller_close},
+    {"__tostring", poller_tostring},
+#ifdef HAVE_EPOLL
+    {"register", poller_register},
+    {"modify", poller_modify},
+    {"unregister", poller_unregister},
+    {"wait", poller_wait},
+#endif
+    {"close", poller_close},
     {NULL, NULL},
 };
 
@@ -1690,16 +7154,67 @@ luaopen_ssocket(lua_State * L)
     // Module infos:
     ADD_STR_CONST(_VERSION);
 
+    // Execution backend
+    const char *backend = getenv("SSOCKET_BACKEND");
+#ifdef HAVE_IO_URING
+    if (backend && !strcmp(backend, BACKEND_IO_URING) && __sockobj_uring(L) == NULL) {
+        struct uring **ringp = (struct uring **)lua_newuserdata(L, sizeof(struct uring *));
+        *ringp = uring_create(URING_ENTRIES);
+        if (*ringp) {
+            luaL_newmetatable(L, URING_TYPENAME);
+            lua_pushcfunction(L, uring_gc);
+            lua_setfield(L, -2, "__gc");
+            lua_setmetatable(L, -2);
+            lua_rawsetp(L, LUA_REGISTRYINDEX, &uring_key);
+        } else {
+            // io_uring is not available, fall back to poll
+            lua_pop(L, 1);
+        }
+    }
+    backend = __sockobj_uring(L) ? BACKEND_IO_URING : BACKEND_POLL;
+#else
+    backend = BACKEND_POLL;
+#endif
+    lua_pushstring(L, backend);
+    lua_setfield(L, -2, "_BACKEND");
+
     // OPT_* options
     ADD_STR_CONST(OPT_TCP_NODELAY);
     ADD_STR_CONST(OPT_TCP_KEEPALIVE);
     ADD_STR_CONST(OPT_TCP_REUSEADDR);
+    ADD_STR_CONST(OPT_TCP_REUSEPORT);
+    ADD_STR_CONST(OPT_TCP_CORK);
+    ADD_STR_CONST(OPT_UDP_SEGMENT);
+    ADD_STR_CONST(OPT_UDP_GRO);
+    ADD_STR_CONST(OPT_TCP_QUICKACK);
+    ADD_STR_CONST(OPT_TCP_NOTSENT_LOWAT);
+    ADD_STR_CONST(OPT_TCP_DEFER_ACCEPT);
+    ADD_STR_CONST(OPT_TCP_USER_TIMEOUT);
+    ADD_STR_CONST(OPT_SO_RCVBUF);
+    ADD_STR_CONST(OPT_SO_SNDBUF);
+    ADD_STR_CONST(OPT_SO_REUSEPORT);
+    ADD_STR_CONST(OPT_SO_BUSY_POLL);
+    ADD_STR_CONST(OPT_SO_PRIORITY);
+    ADD_STR_CONST(OPT_IP_TOS);
+
+    // Options by name, see __sockopt_check
+    const struct sockopt *o;
+    lua_newtable(L);
+    for (o = sockopts; o->name; o++) {
+        lua_pushlightuserdata(L, (void *)o);
+        lua_setfield(L, -2, o->name);
+    }
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &sockopt_key);
 
     // SHUT_* sock:shutdown() parameters
     ADD_NUM_CONST(SHUT_RD);
     ADD_NUM_CONST(SHUT_WR);
     ADD_NUM_CONST(SHUT_RDWR);
 
+    // EVENT_* poller:register() parameters
+    ADD_NUM_CONST(EVENT_READABLE);
+    ADD_NUM_CONST(EVENT_WRITABLE);
+
     // ERROR_* some error strings, which can be used to detect errors
     ADD_STR_CONST(ERROR_TIMEOUT);
     ADD_STR_CONST(ERROR_CLOSED);
@@ -1721,6 +7236,66 @@ luaopen_ssocket(lua_State * L)
     luaL_setfuncs(L, udpsock_methods, 0);
     lua_pop(L, 1);
 
+    // Create a metatable for bytes userdata.
+    luaL_newmetatable(L, BYTES_TYPENAME);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");     /* metable.__index = metatable */
+    luaL_setfuncs(L, bytes_methods, 0);
+    lua_pop(L, 1);
+
+    // Create a metatable for relay userdata.
+    luaL_newmetatable(L, RELAY_TYPENAME);
+    lua_pushcfunction(L, relay_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    // Create a metatable for file transfer userdata.
+    luaL_newmetatable(L, FILEXFER_TYPENAME);
+    lua_pushcfunction(L, filexfer_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    // Create a metatable for connection race userdata.
+    luaL_newmetatable(L, CONNRACE_TYPENAME);
+    lua_pushcfunction(L, connrace_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    // Create a metatable for batch connect userdata.
+    luaL_newmetatable(L, CONNMANY_TYPENAME);
+    lua_pushcfunction(L, connmany_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    // Create a metatable for keepalive pool userdata.
+    luaL_newmetatable(L, POOL_TYPENAME);
+    lua_pushcfunction(L, pool_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    // Create a metatable for poller userdata.
+    luaL_newmetatable(L, POLLER_TYPENAME);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");     /* metable.__index = metatable */
+    luaL_setfuncs(L, poller_methods, 0);
+    lua_pop(L, 1);
+
+#ifdef HAVE_ZEROCOPY
+    // Create a metatable for lingering sockets userdata.
+    luaL_newmetatable(L, ZCLINGER_TYPENAME);
+    lua_pushcfunction(L, zclinger_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+#endif
+
+#ifdef HAVE_EPOLL
+    // Create a metatable for scheduler userdata.
+    luaL_newmetatable(L, SCHEDULER_TYPENAME);
+    lua_pushcfunction(L, sched_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+#endif
+
     // install a handler to ignore sigpipe or it will crash us
     signal(SIGPIPE, SIG_IGN);
 
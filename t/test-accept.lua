@@ -0,0 +1,51 @@
+-- setup path
+local filepath = debug.getinfo(1).source:match("@(.*)$")
+local filedir = filepath:match('(.+)/[^/]*') or '.'
+package.path = string.format(";%s/?.lua;%s/../?.lua;", filedir, filedir) .. package.path
+package.cpath = string.format(";%s/?.so;%s/../?.so;", filedir, filedir) .. package.cpath
+
+require 'Test.More'
+local socket = require "ssocket"
+
+plan(8)
+
+HOST = "127.0.0.1"
+PORT = 16794
+
+local server = socket.tcp()
+server:setopt(socket.OPT_TCP_REUSEADDR, true)
+server:bind(HOST, PORT)
+server:listen(128)
+
+local clients = {}
+for i = 1, 3 do
+  clients[i] = socket.tcp()
+  clients[i]:connect(HOST, PORT)
+end
+
+-- 1. Accept a batch, up to max
+local socks, err = server:acceptmany(2)
+is(#socks, 2)
+like(socks[1], "<tcpsock: %d+>")
+
+-- 2. Drain the rest of the backlog
+socks, err = server:acceptmany()
+is(#socks, 1)
+
+-- 3. Accepted sockets work
+clients[3]:write("ping")
+is(socks[1]:read(4), "ping")
+
+-- 4. Timeout
+server:settimeout(0.01)
+socks, err = server:acceptmany()
+is(socks, nil)
+is(err, socket.ERROR_TIMEOUT)
+local sock, err = server:accept()
+is(sock, nil)
+is(err, socket.ERROR_TIMEOUT)
+
+for i = 1, 3 do
+  clients[i]:close()
+end
+server:close()
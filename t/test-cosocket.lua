@@ -0,0 +1,191 @@
+-- setup path
+local filepath = debug.getinfo(1).source:match("@(.*)$")
+local filedir = filepath:match('(.+)/[^/]*') or '.'
+package.path = string.format(";%s/?.lua;%s/../?.lua;", filedir, filedir) .. package.path
+package.cpath = string.format(";%s/?.so;%s/../?.so;", filedir, filedir) .. package.cpath
+
+require 'Test.More'
+local socket = require "ssocket"
+
+plan(25)
+
+HOST = "127.0.0.1"
+PORT = 16791
+NCLIENTS = 3
+
+local server = socket.tcp()
+server:bind(HOST, PORT)
+server:listen(128)
+
+-- 1. Echo server and clients in the same Lua state
+local co = socket.spawn(function()
+  for i = 1, NCLIENTS do
+    local conn = server:accept()
+    socket.spawn(function(conn)
+      local reader = conn:readuntil("\n")
+      local line = reader()
+      conn:write(line .. "\n")
+      conn:close()
+    end, conn)
+  end
+end)
+type_ok(co, "thread")
+
+local replies = {}
+for i = 1, NCLIENTS do
+  socket.spawn(function(n)
+    local sock = socket.tcp()
+    sock:connect(HOST, PORT)
+    socket.sleep(0.01 * (NCLIENTS - n))
+    local msg = "hello " .. n .. "\n"
+    sock:write(msg)
+    replies[n] = sock:read(#msg)
+    sock:close()
+  end, i)
+end
+
+-- 2. Sleep
+local order = {}
+socket.spawn(function()
+  socket.sleep(0.02)
+  table.insert(order, "b")
+end)
+socket.spawn(function()
+  socket.sleep(0.01)
+  table.insert(order, "a")
+end)
+
+-- 3. Timeout
+local timeout_err
+socket.spawn(function()
+  local udpsock = socket.udp()
+  udpsock:bind(HOST, PORT + 1)
+  udpsock:settimeout(0.01)
+  local data
+  data, timeout_err = udpsock:recv(8192)
+  udpsock:close()
+end)
+
+is(socket.run(), true)
+for i = 1, NCLIENTS do
+  is(replies[i], "hello " .. i .. "\n")
+end
+is(order[1], "a")
+is(order[2], "b")
+is(timeout_err, socket.ERROR_TIMEOUT)
+
+-- 4. Outside of the scheduler, sleep blocks as usual
+socket.sleep(0.001)
+pass("blocking sleep")
+
+-- 5. Idle sockets are closed by the scheduler
+local data, idle_err
+socket.spawn(function()
+  local conn = server:accept()
+  ok(conn:setidletimeout(0.02))
+  data = conn:read(1)
+  -- no activity anymore
+  local _
+  _, idle_err = conn:read(1)
+end)
+socket.spawn(function()
+  local sock = socket.tcp()
+  sock:connect(HOST, PORT)
+  socket.sleep(0.01)
+  sock:write("x")
+  socket.sleep(0.1)
+  sock:close()
+end)
+
+is(socket.run(), true)
+is(data, "x")
+is(idle_err, socket.ERROR_CLOSED)
+
+-- 6. Batch connect, while the server accepts
+local socks, errs, accepted
+socket.spawn(function()
+  socks, errs = socket.connect_many({{HOST, PORT}, {HOST, PORT + 1}, {HOST, PORT}}, 1)
+end)
+socket.spawn(function()
+  accepted = {server:accept(), server:accept()}
+end)
+
+is(socket.run(), true)
+ok(socks[1] and socks[3] and not socks[2])
+is(errs[2], socket.ERROR_REFUSED)
+for _, sock in ipairs({socks[1], socks[3], accepted[1], accepted[2]}) do
+  sock:close()
+end
+
+-- 7. sendfile goes on with its file when suspended, even if the path is replaced
+local path = os.tmpname()
+local f = io.open(path, "wb")
+f:write(string.rep("a", 4 * 1024 * 1024))
+f:close()
+local sent, received
+socket.spawn(function()
+  local conn = server:accept()
+  sent = conn:sendfile(path)
+  conn:close()
+end)
+socket.spawn(function()
+  local sock = socket.tcp()
+  sock:connect(HOST, PORT)
+  socket.sleep(0.01) -- the socket buffers are full by now
+  os.remove(path)
+  local f = io.open(path, "wb")
+  f:write(string.rep("b", 4 * 1024 * 1024))
+  f:close()
+  received = sock:read(4 * 1024 * 1024)
+  sock:close()
+end)
+
+is(socket.run(), true)
+is(sent, 4 * 1024 * 1024)
+is(received, string.rep("a", 4 * 1024 * 1024))
+os.remove(path)
+
+-- 8. readtofile goes on with its file when suspended, even if it is renamed
+local moved = path .. ".moved"
+local received, exists
+socket.spawn(function()
+  local conn = server:accept()
+  received = conn:readtofile(path, 11)
+  conn:close()
+end)
+socket.spawn(function()
+  local sock = socket.tcp()
+  sock:connect(HOST, PORT)
+  sock:write("first")
+  socket.sleep(0.01)
+  os.rename(path, moved)
+  sock:write("second")
+  sock:close()
+end)
+
+is(socket.run(), true)
+is(received, 11)
+local f = io.open(moved, "rb")
+is(f:read("*a"), "firstsecond")
+f:close()
+is(io.open(path, "rb"), nil)
+os.remove(moved)
+
+-- 9. Where the coroutine cannot yield, sleep blocks instead
+if _VERSION == "Lua 5.2" then
+  skip("no lua_isyieldable in Lua 5.2", 2)
+else
+  local sorted
+  socket.spawn(function()
+    local t = {3, 1, 2}
+    table.sort(t, function(x, y)
+      socket.sleep(0.001)
+      return x < y
+    end)
+    sorted = table.concat(t)
+  end)
+  is(socket.run(), true)
+  is(sorted, "123")
+end
+
+server:close()
@@ -0,0 +1,68 @@
+-- setup path
+local filepath = debug.getinfo(1).source:match("@(.*)$")
+local filedir = filepath:match('(.+)/[^/]*') or '.'
+package.path = string.format(";%s/?.lua;%s/../?.lua;", filedir, filedir) .. package.path
+package.cpath = string.format(";%s/?.so;%s/../?.so;", filedir, filedir) .. package.cpath
+
+require 'Test.More'
+local socket = require "ssocket"
+
+plan(22)
+
+HOST = "127.0.0.1"
+PORT = 16790
+
+local server = socket.tcp()
+server:bind(HOST, PORT)
+server:listen(5)
+
+-- 1. Basic
+local poller, err = socket.poller()
+like(poller, "<poller: %d+>") -- __tostring
+is(err, nil)
+is(poller:register(server, socket.EVENT_READABLE), true)
+local readsocks, writesocks, err = poller:wait(0.01)
+is(readsocks, nil)
+is(err, socket.ERROR_TIMEOUT)
+
+-- 2. Listening socket becomes readable
+local client = socket.tcp()
+client:connect(HOST, PORT)
+readsocks, writesocks, err = poller:wait(1)
+is(#readsocks, 1)
+is(readsocks[1], server)
+local conn = server:accept()
+
+-- 3. Level-triggered
+is(poller:register(conn, socket.EVENT_READABLE + socket.EVENT_WRITABLE), true)
+readsocks, writesocks, err = poller:wait(1)
+is(#readsocks, 0)
+is(writesocks[1], conn)
+
+-- 4. Edge-triggered
+is(poller:modify(conn, socket.EVENT_READABLE, true), true)
+client:write("ping")
+readsocks, writesocks, err = poller:wait(1)
+is(readsocks[1], conn)
+is(#writesocks, 0)
+readsocks, writesocks, err = poller:wait(0.01)
+is(err, socket.ERROR_TIMEOUT)
+is(conn:read(4), "ping")
+readsocks, writesocks, err = poller:wait(0) -- does not block
+is(err, socket.ERROR_TIMEOUT)
+
+-- 5. Unregister/close
+is(poller:unregister(conn), true)
+local other = socket.tcp()
+other:connect(HOST, PORT)
+is(poller:register(other, socket.EVENT_WRITABLE), true)
+other:close()
+is(poller:unregister(other), true) -- forgotten although closed
+local _, err = poller:unregister(other)
+is(err, socket.ERROR_CLOSED)
+server:accept():close()
+is(poller:close(), true)
+
+client:close()
+conn:close()
+server:close()
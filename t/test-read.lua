@@ -0,0 +1,284 @@
+-- setup path
+local filepath = debug.getinfo(1).source:match("@(.*)$")
+local filedir = filepath:match('(.+)/[^/]*') or '.'
+package.path = string.format(";%s/?.lua;%s/../?.lua;", filedir, filedir) .. package.path
+package.cpath = string.format(";%s/?.so;%s/../?.so;", filedir, filedir) .. package.cpath
+
+require 'Test.More'
+local socket = require "ssocket"
+
+plan(71)
+
+HOST = "127.0.0.1"
+PORT = 16795
+NLINES = 1000
+
+local server = socket.tcp()
+server:setopt(socket.OPT_TCP_REUSEADDR, true)
+server:bind(HOST, PORT)
+server:listen(128)
+
+local client = socket.tcp()
+client:connect(HOST, PORT)
+local conn = server:accept()
+
+-- 1. Many small pipelined messages
+local lines = {}
+for i = 1, NLINES do
+  lines[i] = "line " .. i .. "\r\n"
+end
+client:write(table.concat(lines))
+local reader = conn:readuntil("\r\n")
+local n = 0
+for i = 1, NLINES do
+  if reader() == "line " .. i then
+    n = n + 1
+  end
+end
+is(n, NLINES)
+
+-- 2. read and readuntil share the buffer
+client:write("HEAD 5\r\nhelloTAIL\r\n")
+is(reader(), "HEAD 5")
+is(conn:read(5), "hello")
+is(reader(), "TAIL")
+
+-- 3. Self-overlapping delimiter, split across receives
+local headers = conn:readuntil("\r\n\r\n")
+client:write("a\r\n\r\r\n\r")
+socket.sleep(0.01)
+client:write("\nb\r\n")
+is(headers(), "a\r\n\r")
+is(reader(), "b")
+
+-- 4. Reading into bytes, writing slices of them
+local b = socket.bytes(16)
+client:write("0123456789abcdef")
+is(conn:readinto(b), 16)
+is(b:sub(), "0123456789abcdef")
+conn:write(b, 11, 15)
+is(client:read(5), "bcdef")
+client:write("hi")
+is(conn:recvinto(b), 2)
+is(#b, 2)
+
+-- 5. Vectored writes
+is(client:write({"GET ", {b, 1, 2}, "", " HTTP/1.1", "\r\n"}), 17)
+is(reader(), "GET hi HTTP/1.1")
+
+-- 6. Write buffer
+is(conn:setwritebuffer(64), true)
+conn:write("a")
+conn:write({"b", "\r\n"})
+client:settimeout(0.05)
+local _, err = client:read(4)
+is(err, socket.ERROR_TIMEOUT)
+client:settimeout(-1)
+conn:flush()
+is(client:read(4), "ab\r\n")
+conn:write("z")
+conn:write(string.rep("x", 100)) -- above the watermark, sent with "z"
+is(client:read(101), "z" .. string.rep("x", 100))
+conn:setwritebuffer(0)
+
+-- 7. sendfile
+local path = os.tmpname()
+local f = io.open(path, "wb")
+f:write(string.rep("0123456789", 1000))
+f:close()
+is(conn:sendfile(path), 10000)
+is(client:read(10000), string.rep("0123456789", 1000))
+conn:sendfile(path, 9995, 100) -- stops at the end of the file
+is(client:read(5), "56789")
+os.remove(path)
+
+-- 8. Zerocopy writes
+local big = string.rep("z", 100000)
+is(conn:setzerocopy(65536), true)
+is(conn:write(big), 100000)
+is(conn:write({big, {big, 1, 10}}), 100010)
+is(client:read(200010), big .. big .. string.rep("z", 10))
+conn:setzerocopy(0)
+
+local c = socket.tcp()
+c:connect(HOST, PORT)
+local s = server:accept()
+s:setzerocopy(65536)
+s:write(string.rep("y", 100000))
+s:close() -- the data is kept until sent
+collectgarbage()
+is(c:read(100000), string.rep("y", 100000))
+local _, err = c:read(1)
+is(err, socket.ERROR_CLOSED)
+c:close()
+
+-- 9. readtofile
+client:write("PUT\r\n" .. string.rep("0123456789", 1000))
+is(reader(), "PUT") -- the body is partly read ahead
+path = os.tmpname()
+is(conn:readtofile(path, 10000), 10000)
+local f = io.open(path, "rb")
+is(f:read("*a"), string.rep("0123456789", 1000))
+f:close()
+os.remove(path)
+
+-- 10. Relay
+local c1, c2 = socket.tcp(), socket.tcp()
+c1:connect(HOST, PORT)
+local s1 = server:accept()
+c2:connect(HOST, PORT)
+local s2 = server:accept()
+c1:write("x\r\nhello")
+is(s1:readuntil("\r\n")(), "x") -- "hello" is read ahead
+c1:shutdown(socket.SHUT_WR)
+c2:write("world!")
+c2:shutdown(socket.SHUT_WR)
+local sent, received = socket.relay(s1, s2, {idle = 1})
+is(sent, 5)
+is(received, 6)
+is(c2:read(5), "hello")
+is(c1:read(6), "world!")
+for _, sock in ipairs({c1, c2, s1, s2}) do
+  sock:close()
+end
+
+c1, c2 = socket.tcp(), socket.tcp()
+c1:connect(HOST, PORT)
+s1 = server:accept()
+c2:connect(HOST, PORT)
+s2 = server:accept()
+c1:write("ping")
+c1:shutdown(socket.SHUT_WR)
+sent, received = socket.relay(s1, s2, {idle = 1, halfclose = false})
+is(sent, 4)
+is(c2:read(4), "ping")
+s2:write("more") -- not shut down
+is(c2:read(4), "more")
+s1:write("back") -- still usable once the relay is released
+is(c1:read(4), "back")
+for _, sock in ipairs({c1, c2, s1, s2}) do
+  sock:close()
+end
+
+c1, c2 = socket.tcp(), socket.tcp()
+c1:connect(HOST, PORT)
+s1 = server:accept()
+c2:connect(HOST, PORT)
+s2 = server:accept()
+local up = string.rep("u", 100000)
+c2:write(up) -- in flight the other way when c1 ends its stream
+c1:write("bye")
+c1:shutdown(socket.SHUT_WR)
+sent, received = socket.relay(s1, s2, {idle = 1, halfclose = false})
+is(sent, 3)
+is(c2:read(3), "bye")
+local relayed = received > 0 and c1:read(received) or ""
+local left = received < #up and s2:read(#up - received) or ""
+is(relayed .. left, up) -- nothing read is lost
+for _, sock in ipairs({c1, c2, s1, s2}) do
+  sock:close()
+end
+
+-- 11. Keepalive pool
+local c = socket.tcp()
+c:connect(HOST, PORT)
+local s1 = server:accept()
+local port = c:getsockname()[2]
+is(c:setkeepalive(10, 4), true)
+is(c:fileno(), -1)
+c = socket.tcp()
+is(c:connect(HOST, PORT), true)
+is(c:getsockname()[2], port) -- reused, nothing to accept
+c:write("ping")
+is(s1:read(4), "ping")
+s1:write("late")
+c:read(2)
+local ok, err = c:setkeepalive()
+is(err, "unread data in buffer")
+c = socket.tcp()
+c:connect(HOST, PORT)
+local s2 = server:accept()
+port = c:getsockname()[2]
+c:setkeepalive()
+s2:close()
+c = socket.tcp()
+is(c:connect(HOST, PORT), true)
+isnt(c:getsockname()[2], port) -- closed by the peer, not reused
+local s3 = server:accept()
+c:setkeepalive()
+c = socket.tcp()
+c:setopt(socket.OPT_TCP_CORK, true) -- applied to the connection reused
+is(c:connect(HOST, PORT), true)
+is(c:getopt(socket.OPT_TCP_CORK), true)
+c:setopt(socket.OPT_TCP_NODELAY, true)
+c:setkeepalive()
+c = socket.tcp()
+is(c:connect(HOST, PORT), true) -- reused, with the options of c reset
+is(c:getopt(socket.OPT_TCP_CORK), false)
+is(c:getopt(socket.OPT_TCP_NODELAY), false)
+c:write("uncorked")
+is(s3:read(8), "uncorked")
+c:setopt(socket.OPT_SO_RCVBUF, 65536)
+local _, err = c:setkeepalive()
+is(err, "socket options can not be reset")
+for _, sock in ipairs({c, s1, s3}) do
+  sock:close()
+end
+
+-- 12. Batch connect
+local socks, errs = socket.connect_many({{HOST, PORT}, {HOST, 16787}, {HOST, PORT}}, 1)
+ok(socks[1] and socks[3])
+is(socks[2], nil)
+is(errs[1], nil)
+is(errs[2], socket.ERROR_REFUSED)
+for _, sock in ipairs({socks[1], socks[3], server:accept(), server:accept()}) do
+  sock:close()
+end
+
+-- 13. TCP Fast Open, the data is in the SYN once the client has a cookie
+local f = io.open("/proc/sys/net/ipv4/tcp_fastopen")
+local sysctl = f and tonumber(f:read("*l")) or 0
+if f then f:close() end
+local tfo = socket.tcp()
+tfo:setopt(socket.OPT_TCP_REUSEADDR, true)
+tfo:bind(HOST, PORT + 1)
+is(tfo:listen(16, 16), true)
+local fastopen
+for i = 1, 2 do
+  local c = socket.tcp()
+  local ok, err
+  ok, err, fastopen = c:connect(HOST, PORT + 1, {data = "hello"})
+  is(ok, true)
+  local sc = tfo:accept()
+  is(sc:read(5), "hello")
+  sc:close()
+  c:close()
+end
+is(fastopen, sysctl % 4 == 3) -- client and server enabled
+tfo:close()
+
+-- a server without it ignores the data in the SYN, which is sent again
+local plain = socket.tcp()
+plain:setopt(socket.OPT_TCP_REUSEADDR, true)
+plain:bind(HOST, PORT + 2)
+plain:listen(16)
+local c = socket.tcp()
+local ok, err
+ok, err, fastopen = c:connect(HOST, PORT + 2, {data = "again"})
+is(ok, true)
+is(fastopen, false)
+local sc = plain:accept()
+is(sc:read(5), "again")
+sc:close()
+c:close()
+plain:close()
+
+-- 14. Partial data on error
+client:write("partial")
+client:close()
+local data, err, partial = reader()
+is(err, socket.ERROR_CLOSED)
+is(partial, "partial")
+
+conn:close()
+server:close()
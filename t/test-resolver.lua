@@ -0,0 +1,127 @@
+-- setup path
+local filepath = debug.getinfo(1).source:match("@(.*)$")
+local filedir = filepath:match('(.+)/[^/]*') or '.'
+package.path = string.format(";%s/?.lua;%s/../?.lua;", filedir, filedir) .. package.path
+package.cpath = string.format(";%s/?.so;%s/../?.so;", filedir, filedir) .. package.cpath
+
+require 'Test.More'
+local socket = require "ssocket"
+
+plan(24)
+
+PORT = 16799
+
+-- 1. Names from the hosts file
+local addrs, err = socket.resolve("localhost")
+is(err, nil)
+is(addrs[1], "127.0.0.1")
+addrs = socket.resolve("127.0.0.1")
+is(addrs[1], "127.0.0.1")
+
+-- 2. Errors are described by their getaddrinfo() code
+local addrs, err = socket.resolve("nonexistent.invalid")
+is(addrs, nil)
+type_ok(err, "string")
+isnt(err, "Success")
+
+-- 3. Coroutines are not blocked while a name is resolved
+local server = socket.tcp()
+server:setopt(socket.OPT_TCP_REUSEADDR, true)
+server:bind("127.0.0.1", PORT)
+server:listen(128)
+
+socket.setdnsttl(0) -- resolved again by each connect
+local ticks = 0
+local connected, resolved
+socket.spawn(function()
+  local sock = socket.tcp()
+  connected = sock:connect("localhost", PORT)
+  resolved = socket.resolve("localhost")
+  sock:close()
+end)
+socket.spawn(function()
+  while not resolved do
+    ticks = ticks + 1
+    socket.sleep(0.001)
+  end
+end)
+socket.run()
+is(connected, true)
+is(resolved[1], "127.0.0.1")
+ok(ticks > 0)
+is(socket.setdnsttl(60, 5), true)
+
+-- 4. IPv6
+local server6 = socket.tcp()
+server6:setopt(socket.OPT_TCP_REUSEADDR, true)
+server6:bind("::1", PORT + 1)
+server6:listen(128)
+local sock = socket.tcp()
+is(sock:connect("::1", PORT + 1), true)
+local addr = sock:getpeername()
+is(addr[1], "::1")
+is(addr[2], PORT + 1)
+sock:close()
+server6:close()
+
+-- 5. Addresses of a name are raced, ::1 refuses and 127.0.0.1 wins
+is(socket.sethost("race.test", {"::1", "127.0.0.1"}), true)
+is(socket.resolve("race.test")[1], "::1")
+local sock = socket.tcp()
+sock:settimeout(1)
+is(sock:connect("race.test", PORT), true)
+is(sock:getpeername()[1], "127.0.0.1")
+local conn = server:accept()
+sock:write("raced")
+is(conn:read(5), "raced")
+conn:close()
+sock:close()
+
+local peer
+socket.spawn(function()
+  local sock = socket.tcp()
+  sock:settimeout(1)
+  connected = sock:connect("race.test", PORT)
+  peer = sock:getpeername()[1]
+  sock:close()
+end)
+socket.run()
+is(connected, true)
+is(peer, "127.0.0.1")
+
+socket.sethost("race.test", nil)
+is(socket.resolve("race.test"), nil)
+
+-- 6. Resolving and connecting share the timeout
+local full = socket.tcp()
+full:bind("127.0.0.1", PORT + 2)
+full:listen(0)
+local queued = socket.tcp()
+queued:connect("127.0.0.1", PORT + 2) -- fills the backlog, the next SYN is dropped
+socket.sethost("slow.test", {"127.0.0.1"}, 0.3)
+local events = {}
+socket.spawn(function()
+  local sock = socket.tcp()
+  sock:settimeout(0.5)
+  local _, err = sock:connect("slow.test", PORT + 2)
+  table.insert(events, err)
+  sock:close()
+end)
+socket.spawn(function()
+  socket.sleep(0.65) -- 0.3 + 0.5 if the connection had its own timeout
+  table.insert(events, "slept")
+end)
+socket.run()
+is(events[1], socket.ERROR_TIMEOUT)
+is(events[2], "slept")
+
+local sock = socket.tcp()
+sock:settimeout(0.2)
+local _, err = sock:connect("slow.test", PORT + 2)
+is(err, socket.ERROR_TIMEOUT) -- while resolving, blocking
+sock:close()
+socket.sethost("slow.test", nil)
+queued:close()
+full:close()
+
+server:close()
@@ -7,7 +7,7 @@ package.cpath = string.format(";%s/?.so;%s/../?.so;", filedir, filedir) .. packa
 require 'Test.More'
 local socket = require "ssocket"
 
-plan(29)
+plan(33)
 
 -- 1. Success connection.
 local tcpsock, err = socket.tcp()
@@ -73,3 +73,11 @@ local value = tcpsock:getopt(socket.OPT_TCP_NODELAY)
 is(value, true)
 local value = tcpsock:getopt(socket.OPT_TCP_REUSEADDR)
 is(value, true)
+ok, err = tcpsock:setopt(socket.OPT_SO_RCVBUF, 65536)
+is(ok, true)
+is(tcpsock:getopt(socket.OPT_SO_RCVBUF) >= 65536, true)
+ok, err = tcpsock:setopt(socket.OPT_TCP_USER_TIMEOUT, 1.5)
+is(tcpsock:getopt(socket.OPT_TCP_USER_TIMEOUT), 1.5)
+ok, err = tcpsock:setopt(socket.OPT_IP_TOS, 0x10)
+is(tcpsock:getopt(socket.OPT_IP_TOS), 0x10)
+tcpsock:close()
@@ -8,7 +8,7 @@ package.cpath = string.format(";%s/?.so;%s/../?.so;", filedir, filedir) .. packa
 require 'Test.More'
 local socket = require "ssocket"
 
-plan(12)
+plan(35)
 
 function string_repeat(str, num)
   local s = ""
@@ -50,4 +50,71 @@ type_ok(addr[2], "number")
 longstr = string_repeat("a",165507)
 ok, err = sendsock:sendto(longstr, "8.8.8.8", 53)
 is(ok, nil)
-is(err, "Message too long")
\ No newline at end of file
+is(err, "Message too long")
+
+-- 5. Sub-millisecond timeout
+recvsock:settimeout(0.0005)
+data, err = recvsock:recv(8192)
+is(data, nil)
+is(err, socket.ERROR_TIMEOUT)
+
+-- 6. Batch receive
+recvsock:settimeout(-1)
+for i = 1, 5 do
+  sendsock:sendto("packet " .. i, 'localhost', 8888)
+end
+datas, addrs = recvsock:recvmany(64, 2048)
+is(#datas, 5)
+is(datas[5], "packet 5")
+is(addrs[1][1], '127.0.0.1')
+sendsock:sendto(packet_data, 'localhost', 8888)
+is(recvsock:recv(8192), packet_data)
+sendsock:sendto(packet_data, 'localhost', 8888)
+is(recvsock:recv(1000000), packet_data) -- larger than any datagram
+sendsock:sendto(packet_data, 'localhost', 8888)
+datas = recvsock:recvmany(4, 1000000)
+is(datas[1], packet_data)
+is(pcall(recvsock.recv, recvsock, -1), false)
+is(pcall(recvsock.recvfrom, recvsock, 0), false)
+
+-- 7. Batch send, a failing message does not stop the others
+local msgs = {}
+for i = 1, 4 do
+  msgs[i] = {"fan " .. i, '127.0.0.1', 8888}
+end
+msgs[2] = {"denied", '255.255.255.255', 8888} -- no SO_BROADCAST
+local sent, errs = sendsock:sendmany(msgs)
+is(sent, 3)
+type_ok(errs[2], "string")
+datas = recvsock:recvmany(64, 2048)
+is(table.concat(datas, ","), "fan 1,fan 3,fan 4")
+
+-- 8. Segmentation offload, one send and one receive for 10 datagrams
+local grosock = socket.udp()
+grosock:setopt(socket.OPT_UDP_GRO, true)
+grosock:bind('127.0.0.1', 8889)
+local gsosock = socket.udp()
+gsosock:setopt(socket.OPT_UDP_SEGMENT, 100)
+gsosock:connect('127.0.0.1', 8889)
+is(gsosock:getopt(socket.OPT_UDP_SEGMENT), 100)
+gsosock:send(string.rep("x", 1000))
+local data, segsize = grosock:recv(65536)
+is(#data, 1000)
+is(segsize, 100)
+gsosock:send(string.rep("y", 1000))
+local data, err = grosock:recv(500) -- not the first 5 segments only
+is(data, nil)
+type_ok(err, "string")
+gsosock:send(string.rep("z", 300))
+is(grosock:recv(65536), string.rep("z", 300))
+
+-- 9. Options set before the socket is created fail with the call creating it
+local unixsock = socket.udp()
+is(unixsock:setopt(socket.OPT_UDP_SEGMENT, 100), true)
+local path = os.tmpname()
+os.remove(path)
+local ok, err = unixsock:bind(path) -- no UDP options for unix domain sockets
+is(ok, nil)
+type_ok(err, "string")
+is(unixsock:fileno(), -1)
+os.remove(path)
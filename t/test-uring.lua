@@ -0,0 +1,57 @@
+-- setup path
+local filepath = debug.getinfo(1).source:match("@(.*)$")
+local filedir = filepath:match('(.+)/[^/]*') or '.'
+package.path = string.format(";%s/?.lua;%s/../?.lua;", filedir, filedir) .. package.path
+package.cpath = string.format(";%s/?.so;%s/../?.so;", filedir, filedir) .. package.cpath
+local lua_bin = os.getenv("LUA") or "lua"
+
+-- The backend is selected when the module is loaded, run again with it.
+if os.getenv("SSOCKET_BACKEND") ~= "io_uring" then
+  local _, _, code = os.execute(string.format("SSOCKET_BACKEND=io_uring %s %s", lua_bin, filepath))
+  os.exit(code or 1)
+end
+
+require 'Test.More'
+local socket = require "ssocket"
+
+if socket._BACKEND ~= "io_uring" then
+  skip_all("io_uring is not available, the poll backend is used")
+end
+
+plan(7)
+
+HOST = "127.0.0.1"
+PORT = 16797
+
+is(socket._BACKEND, "io_uring")
+
+-- 1. TCP round trip
+local server = socket.tcp()
+server:setopt(socket.OPT_TCP_REUSEADDR, true)
+server:bind(HOST, PORT)
+server:listen(16)
+local client = socket.tcp()
+client:settimeout(1)
+is(client:connect(HOST, PORT), true)
+local conn = server:accept()
+client:write("ping\r\n")
+is(conn:readuntil("\r\n")(), "ping")
+conn:write("pong")
+is(client:read(4), "pong")
+client:settimeout(0.05)
+local _, err = client:read(1) -- cancelled by the linked timeout
+is(err, socket.ERROR_TIMEOUT)
+for _, sock in ipairs({client, conn, server}) do
+  sock:close()
+end
+
+-- 2. UDP round trip
+local recvsock = socket.udp()
+recvsock:settimeout(1)
+recvsock:bind(HOST, PORT)
+local sendsock = socket.udp()
+is(sendsock:connect(HOST, PORT), true)
+sendsock:send("datagram")
+is(recvsock:recv(8192), "datagram")
+recvsock:close()
+sendsock:close()
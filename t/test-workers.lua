@@ -0,0 +1,43 @@
+-- setup path
+local filepath = debug.getinfo(1).source:match("@(.*)$")
+local filedir = filepath:match('(.+)/[^/]*') or '.'
+package.path = string.format(";%s/?.lua;%s/../?.lua;", filedir, filedir) .. package.path
+package.cpath = string.format(";%s/?.so;%s/../?.so;", filedir, filedir) .. package.cpath
+
+require 'Test.More'
+local socket = require "ssocket"
+
+plan(8)
+
+HOST = "127.0.0.1"
+PORT = 16793
+
+-- 1. Every worker connects once, connections are spread across listeners
+local stats, err = socket.workers{
+  script = filedir .. "/worker-echo.lua",
+  host = HOST,
+  port = PORT,
+  n = 2,
+}
+type_ok(stats, "table")
+is(#stats, 2)
+is(stats[1].id, 1)
+local accepted, received, sent = 0, 0, 0
+for _, s in ipairs(stats) do
+  accepted = accepted + s.accepted
+  received = received + s.received
+  sent = sent + s.sent
+end
+is(accepted, 2)
+is(received, 16)
+is(sent, 16)
+
+-- 2. Error
+local stats, err = socket.workers{
+  script = filedir .. "/no-such-script.lua",
+  host = HOST,
+  port = PORT,
+  n = 1,
+}
+is(stats, nil)
+like(err, "^worker 1: ")
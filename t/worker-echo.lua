@@ -0,0 +1,25 @@
+-- Worker script of test-workers.lua
+local listener, info = ...
+local socket = require "ssocket"
+assert(socket.worker == info)
+
+local addr = listener:getsockname()
+local sock = socket.tcp()
+assert(sock:connect(addr[1], addr[2]))
+assert(sock:write("ping"))
+
+listener:settimeout(0.2)
+while true do
+  local conn = listener:accept()
+  if not conn then
+    break
+  end
+  conn:settimeout(1)
+  assert(conn:read(4) == "ping")
+  conn:write("pong")
+  conn:close()
+end
+
+sock:settimeout(1)
+assert(sock:read(4) == "pong")
+sock:close()
@@ -1,46 +1,96 @@
+#define _POSIX_C_SOURCE 200809L
 
 #include "timeout.h"
+#include <limits.h>
 #include <time.h>
-#include <sys/time.h>
 
 /**
- * Returns current time in ms. (since 1970)
+ * Returns current time in nanoseconds, from a monotonic clock (not affected
+ * by changes of the system time).
  */
-double
+int64_t
 timeout_gettime(void)
 {
-    struct timeval v;
-    gettimeofday(&v, NULL);
-    return v.tv_sec + v.tv_usec / 1.0e6;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * TIMEOUT_NSEC + ts.tv_nsec;
+}
+
+/**
+ * Convert seconds to nanoseconds, negative values stay negative.
+ */
+int64_t
+timeout_fromsec(double seconds)
+{
+    if (seconds <= 0)
+        return seconds < 0 ? -1 : 0;
+    if (seconds >= (double)(INT64_MAX / TIMEOUT_NSEC))
+        return INT64_MAX / 2;
+    return (int64_t)(seconds * 1.0e9);
 }
 
 /**
  * Init timeout structure.
+ *
+ * The clock is not read here, the deadline is set by the first timeout_left()
+ * call, so operations which do not wait never read it.
  */
 void
 timeout_init(struct timeout *tm, double timeout)
 {
-    tm->tm_timeout = timeout;
-    if (tm->tm_timeout <= 0) {
-        tm->tm_deadline = -1;
-    } else {
-        tm->tm_deadline = timeout_gettime() + tm->tm_timeout;
-    }
+    tm->tm_timeout = timeout_fromsec(timeout);
+    tm->tm_deadline = -1;
 }
 
 /**
  * Determine how much time we have left.
  *
- * Returns the number of ms left or -1 if there is no time limit.
+ * `now` is the current time if the caller has it cached, or -1, then the clock
+ * is read if needed.
+ *
+ * Returns the number of nanoseconds left or -1 if there is no time limit.
  */
-double
-timeout_left(struct timeout *tm)
+int64_t
+timeout_left(struct timeout *tm, int64_t now)
 {
     if (tm->tm_timeout <= 0) {
         return -1;
     } else {
-        double left = tm->tm_deadline - timeout_gettime();
-        if (left < 0.0) left = 0.0;
+        if (now < 0)
+            now = timeout_gettime();
+        if (tm->tm_deadline < 0)
+            tm->tm_deadline = now + tm->tm_timeout;
+        int64_t left = tm->tm_deadline - now;
+        if (left < 0) left = 0;
         return left;
     }
-}
\ No newline at end of file
+}
+
+/**
+ * Convert time left to milliseconds for poll(2) and friends, rounded up so
+ * that waits never end before the deadline.
+ */
+int
+timeout_ms(int64_t left)
+{
+    int64_t ms;
+    if (left < 0)
+        return -1;
+    ms = (left + 999999) / 1000000;
+    return ms < INT_MAX ? (int)ms : INT_MAX;
+}
+
+/**
+ * Convert time left to a timespec for ppoll(2) and friends.
+ *
+ * Returns ts, or NULL if there is no time limit.
+ */
+struct timespec *
+timeout_timespec(int64_t left, struct timespec *ts)
+{
+    if (left < 0)
+        return NULL;
+    ts->tv_sec = (time_t)(left / TIMEOUT_NSEC);
+    ts->tv_nsec = (long)(left % TIMEOUT_NSEC);
+    return ts;
+}
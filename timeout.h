@@ -1,17 +1,26 @@
 #ifndef TIMEOUT_H
 #define TIMEOUT_H
 
+#include <stdint.h>
+#include <time.h>
+
+#define TIMEOUT_NSEC    INT64_C(1000000000)     /* nanoseconds per second */
+
 struct timeout {
     /* Invariants:
      * tm_timeout <= 0, means no timeout, then tm_deadline is set as -1
-     * tm_timeout > 0, then tm_deadline = timeout_gettime() + tm_timeout
+     * tm_timeout > 0, then tm_deadline = now + tm_timeout, where now is the
+     * time of the first timeout_left() call (-1 until then)
      */
-    double tm_timeout;          /* timeout time (in seconds) */
-    double tm_deadline;         /* time of deadline (seconds since 1970) */
+    int64_t tm_timeout;         /* timeout time (in nanoseconds) */
+    int64_t tm_deadline;        /* time of deadline (monotonic nanoseconds) */
 };
 
 void timeout_init(struct timeout *tm, double timeout);
-double timeout_gettime(void);
-double timeout_left(struct timeout *tm);
+int64_t timeout_gettime(void);
+int64_t timeout_left(struct timeout *tm, int64_t now);
+int64_t timeout_fromsec(double seconds);
+int timeout_ms(int64_t left);
+struct timespec *timeout_timespec(int64_t left, struct timespec *ts);
 
 #endif
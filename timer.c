@@ -0,0 +1,241 @@
+#include "timer.h"
+
+#define TIMER_EXPIRED_LEVEL TIMER_LEVELS   /* level of the expired list */
+
+static void
+__list_init(struct timer *head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+static void
+__list_append(struct timer *head, struct timer *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void
+__list_remove(struct timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+static int
+__ctz64(uint64_t v)
+{
+    int n = 0;
+    while (!(v & 1)) {
+        v >>= 1;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Init a timer.
+ */
+void
+timer_init(struct timer *t, int kind, void *data)
+{
+    t->prev = t->next = NULL;
+    t->expires = 0;
+    t->level = -1;
+    t->slot = -1;
+    t->kind = kind;
+    t->data = data;
+}
+
+/**
+ * Init the wheel at given tick.
+ */
+void
+timerwheel_init(struct timerwheel *tw, uint64_t now)
+{
+    int l, s;
+    tw->now = now;
+    tw->count = 0;
+    for (l = 0; l < TIMER_LEVELS; l++) {
+        tw->pending[l] = 0;
+        for (s = 0; s < TIMER_SLOTS; s++)
+            __list_init(&tw->slots[l][s]);
+    }
+    __list_init(&tw->expired);
+}
+
+static void
+__timerwheel_insert(struct timerwheel *tw, struct timer *t)
+{
+    uint64_t expires = t->expires;
+    uint64_t delta;
+    int level, slot;
+
+    if (expires <= tw->now) {
+        t->level = TIMER_EXPIRED_LEVEL;
+        t->slot = 0;
+        __list_append(&tw->expired, t);
+        return;
+    }
+
+    delta = expires - tw->now;
+    if (delta > TIMER_MAX_DELTA) {
+        // Too far, park it in the farthest slot, it will be cascaded again.
+        delta = TIMER_MAX_DELTA;
+        expires = tw->now + delta;
+    }
+    for (level = 0; level < TIMER_LEVELS - 1; level++) {
+        if (delta < (UINT64_C(1) << ((level + 1) * TIMER_SLOT_BITS)))
+            break;
+    }
+    slot = (expires >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1);
+    t->level = level;
+    t->slot = slot;
+    __list_append(&tw->slots[level][slot], t);
+    tw->pending[level] |= UINT64_C(1) << slot;
+}
+
+/**
+ * Add a timer expiring at given tick. The timer must not be pending.
+ */
+void
+timerwheel_add(struct timerwheel *tw, struct timer *t, uint64_t expires)
+{
+    t->expires = expires;
+    __timerwheel_insert(tw, t);
+    tw->count++;
+}
+
+/**
+ * Delete a pending timer, do nothing if it's not pending.
+ */
+void
+timerwheel_del(struct timerwheel *tw, struct timer *t)
+{
+    if (!timer_pending(t))
+        return;
+    __list_remove(t);
+    if (t->level < TIMER_LEVELS) {
+        struct timer *head = &tw->slots[t->level][t->slot];
+        if (head->next == head)
+            tw->pending[t->level] &= ~(UINT64_C(1) << t->slot);
+    }
+    t->level = -1;
+    t->slot = -1;
+    tw->count--;
+}
+
+/**
+ * Returns the number of ticks until the wheel must be turned, i.e. a lower
+ * bound of the time until the next timer expires. UINT64_MAX if there is no
+ * timer.
+ */
+uint64_t
+timerwheel_timeout(struct timerwheel *tw)
+{
+    uint64_t timeout = UINT64_MAX;
+    int level;
+
+    if (tw->expired.next != &tw->expired)
+        return 0;
+
+    for (level = 0; level < TIMER_LEVELS; level++) {
+        int shift = level * TIMER_SLOT_BITS;
+        uint64_t base = tw->now >> shift;
+        int cur = base & (TIMER_SLOTS - 1);
+        uint64_t pending = tw->pending[level];
+        uint64_t ticks;
+        int rot, k;
+
+        if (pending == 0)
+            continue;
+        // find the first non-empty slot after the current one
+        rot = (cur + 1) & (TIMER_SLOTS - 1);
+        pending = rot ? (pending >> rot) | (pending << (TIMER_SLOTS - rot)) : pending;
+        k = __ctz64(pending);
+        ticks = ((base + k + 1) << shift) - tw->now;
+        if (ticks < timeout)
+            timeout = ticks;
+    }
+    return timeout;
+}
+
+static void
+__timerwheel_cascade(struct timerwheel *tw, int level, int slot, struct timer *out)
+{
+    struct timer *head = &tw->slots[level][slot];
+    while (head->next != head) {
+        struct timer *t = head->next;
+        __list_remove(t);
+        if (t->expires <= tw->now) {
+            t->level = TIMER_EXPIRED_LEVEL;
+            __list_append(out, t);
+        } else {
+            __timerwheel_insert(tw, t);
+        }
+    }
+    tw->pending[level] &= ~(UINT64_C(1) << slot);
+}
+
+/**
+ * Turn the wheel to given tick.
+ *
+ * Returns the list of expired timers, linked through their `next` field and
+ * terminated by NULL. They are no longer pending, so they can be added again.
+ */
+struct timer *
+timerwheel_expire(struct timerwheel *tw, uint64_t now)
+{
+    struct timer out;
+    struct timer *list = NULL, *t;
+    uint64_t old = tw->now;
+    int level;
+
+    __list_init(&out);
+    while (tw->expired.next != &tw->expired) {
+        t = tw->expired.next;
+        __list_remove(t);
+        __list_append(&out, t);
+    }
+
+    if (now > old) {
+        tw->now = now;
+        for (level = 0; level < TIMER_LEVELS; level++) {
+            int shift = level * TIMER_SLOT_BITS;
+            uint64_t obase = old >> shift;
+            uint64_t nbase = now >> shift;
+            uint64_t k;
+            if (obase == nbase)
+                break;
+            if (nbase - obase >= TIMER_SLOTS) {
+                int slot;
+                for (slot = 0; slot < TIMER_SLOTS; slot++) {
+                    if (tw->pending[level] & (UINT64_C(1) << slot))
+                        __timerwheel_cascade(tw, level, slot, &out);
+                }
+            } else {
+                for (k = obase + 1; k <= nbase; k++) {
+                    int slot = k & (TIMER_SLOTS - 1);
+                    if (tw->pending[level] & (UINT64_C(1) << slot))
+                        __timerwheel_cascade(tw, level, slot, &out);
+                }
+            }
+        }
+    }
+
+    // Convert to a NULL terminated list.
+    while (out.prev != &out) {
+        t = out.prev;
+        __list_remove(t);
+        t->level = -1;
+        t->slot = -1;
+        t->next = list;
+        list = t;
+        tw->count--;
+    }
+    return list;
+}
@@ -0,0 +1,48 @@
+#ifndef TIMER_H
+#define TIMER_H
+/**
+ * Hierarchical timing wheel.
+ *
+ * Timers are added and deleted in O(1). Expiring them costs O(1) amortized per
+ * timer, timers far in the future are cascaded down to lower levels as the
+ * wheel turns.
+ *
+ * Time is measured in ticks, the unit is up to the user.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TIMER_LEVELS        5
+#define TIMER_SLOT_BITS     6
+#define TIMER_SLOTS         (1 << TIMER_SLOT_BITS)
+#define TIMER_MAX_DELTA     ((UINT64_C(1) << (TIMER_LEVELS * TIMER_SLOT_BITS)) - 1)
+
+struct timer {
+    struct timer *prev;
+    struct timer *next;
+    uint64_t expires;   /* tick of expiration */
+    int level;          /* -1 if not pending */
+    int slot;
+    int kind;           /* user defined */
+    void *data;         /* user defined */
+};
+
+struct timerwheel {
+    uint64_t now;                                   /* current tick */
+    uint64_t pending[TIMER_LEVELS];                 /* non-empty slots */
+    struct timer slots[TIMER_LEVELS][TIMER_SLOTS];  /* list heads */
+    struct timer expired;                           /* list head */
+    size_t count;
+};
+
+#define timer_pending(t)    ((t)->level >= 0)
+
+void timer_init(struct timer *t, int kind, void *data);
+void timerwheel_init(struct timerwheel *tw, uint64_t now);
+void timerwheel_add(struct timerwheel *tw, struct timer *t, uint64_t expires);
+void timerwheel_del(struct timerwheel *tw, struct timer *t);
+uint64_t timerwheel_timeout(struct timerwheel *tw);
+struct timer *timerwheel_expire(struct timerwheel *tw, uint64_t now);
+
+#endif
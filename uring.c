@@ -0,0 +1,299 @@
+#include "compat.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+#define URING_OP        1   /* user_data of operations */
+#define URING_TIMEOUT   2   /* user_data of linked timeouts */
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned to_submit;         /* sqes queued but not submitted yet */
+};
+
+static int
+__io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+__io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * Create a ring of given entries.
+ *
+ * Returns NULL with errno set if io_uring is not available.
+ */
+struct uring *
+uring_create(unsigned entries)
+{
+    struct io_uring_params p;
+    struct uring *ring = malloc(sizeof(*ring));
+    if (!ring)
+        return NULL;
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = __io_uring_setup(entries, &p);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+    // Requires fast poll (Linux 5.7+), so operations on non-blocking sockets
+    // wait for readiness in kernel instead of failing with EAGAIN.
+    if (!(p.features & IORING_FEAT_FAST_POLL) || !(p.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        free(ring);
+        errno = ENOSYS;
+        return NULL;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto err;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto err;
+        }
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto err;
+    }
+
+    ring->sq_entries = p.sq_entries;
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+    return ring;
+
+err:
+    if (ring->sq_ring == MAP_FAILED)
+        ring->sq_ring = NULL;
+    uring_delete(ring);
+    return NULL;
+}
+
+/**
+ * Delete the ring.
+ */
+void
+uring_delete(struct uring *ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring);
+}
+
+/**
+ * Queue a sqe, it is submitted by the next io_uring_enter().
+ */
+static struct io_uring_sqe *
+__uring_getsqe(struct uring *ring)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned idx;
+    struct io_uring_sqe *sqe;
+
+    if (tail - head >= ring->sq_entries)
+        return NULL;
+    idx = tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+/**
+ * Submit queued sqes and wait for the completion of the operation (and of its
+ * linked timeout, if any), in one system call.
+ *
+ * If they can not be submitted, they are taken back from the queue: they point
+ * to memory of the caller, which must not be read by a later submission.
+ *
+ * Returns the result of the operation.
+ */
+static int
+__uring_submit_and_wait(struct uring *ring, int linked)
+{
+    int res = 0;
+    int pending = linked ? 2 : 1;
+    int timedout = 0;
+
+    while (pending > 0) {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            int ret = __io_uring_enter(ring->fd, ring->to_submit, 1,
+                                       IORING_ENTER_GETEVENTS);
+            if (ret < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                    continue;
+                ret = -errno;
+                __atomic_store_n(ring->sq_tail, *ring->sq_tail - ring->to_submit, __ATOMIC_RELEASE);
+                ring->to_submit = 0;
+                return ret;
+            }
+            ring->to_submit -= (unsigned)ret < ring->to_submit ? (unsigned)ret : ring->to_submit;
+            continue;
+        }
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data == URING_OP) {
+                res = cqe->res;
+                pending--;
+            } else if (cqe->user_data == URING_TIMEOUT) {
+                if (cqe->res == -ETIME)
+                    timedout = 1;
+                pending--;
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (res == -ECANCELED && timedout)
+        res = -ETIMEDOUT;
+    return res;
+}
+
+static int
+__uring_do(struct uring *ring, int opcode, int fd, const void *addr,
+           unsigned len, uint64_t off, unsigned flags, int64_t timeout)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_sqe *sqe;
+    int linked = timeout > 0;
+    int res;
+
+    if (timeout == 0) {
+        // No time left to wait, but what is ready is still transferred.
+        if (opcode != IORING_OP_RECV && opcode != IORING_OP_SEND && opcode != IORING_OP_SENDMSG) {
+            errno = EAGAIN;
+            return -1;
+        }
+        flags |= MSG_DONTWAIT;
+    }
+
+    // Make room for the operation and its linked timeout.
+    if (ring->sq_entries - (*ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) < 2) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe = __uring_getsqe(ring);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->msg_flags = flags;
+    sqe->user_data = URING_OP;
+    if (linked) {
+        sqe->flags |= IOSQE_IO_LINK;
+        ts.tv_sec = timeout / 1000000000;
+        ts.tv_nsec = timeout % 1000000000;
+        sqe = __uring_getsqe(ring);
+        sqe->opcode = IORING_OP_LINK_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t)(uintptr_t)&ts;
+        sqe->len = 1;
+        sqe->user_data = URING_TIMEOUT;
+    }
+
+    res = __uring_submit_and_wait(ring, linked);
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+int
+uring_recv(struct uring *ring, int fd, void *buf, size_t len, int flags, int64_t timeout)
+{
+    return __uring_do(ring, IORING_OP_RECV, fd, buf, len, 0, flags, timeout);
+}
+
+int
+uring_send(struct uring *ring, int fd, const void *buf, size_t len, int flags, int64_t timeout)
+{
+    return __uring_do(ring, IORING_OP_SEND, fd, buf, len, 0, flags, timeout);
+}
+
+int
+uring_sendmsg(struct uring *ring, int fd, const struct msghdr *msg, int flags, int64_t timeout)
+{
+    return __uring_do(ring, IORING_OP_SENDMSG, fd, msg, 1, 0, flags, timeout);
+}
+
+int
+uring_accept(struct uring *ring, int fd, struct sockaddr *addr, socklen_t *addrlen, int flags, int64_t timeout)
+{
+    // accept_flags shares the same field as msg_flags
+    return __uring_do(ring, IORING_OP_ACCEPT, fd, addr, 0,
+                      (uint64_t)(uintptr_t)addrlen, flags, timeout);
+}
+
+int
+uring_connect(struct uring *ring, int fd, const struct sockaddr *addr, socklen_t addrlen, int64_t timeout)
+{
+    return __uring_do(ring, IORING_OP_CONNECT, fd, addr, 0, addrlen, 0, timeout);
+}
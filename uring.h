@@ -0,0 +1,32 @@
+#ifndef URING_H
+#define URING_H
+/**
+ * Minimal io_uring wrapper (Linux only).
+ *
+ * Each operation is submitted together with a linked timeout, and a single
+ * io_uring_enter() call both waits for readiness and transfers data.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+struct uring;
+
+struct uring *uring_create(unsigned entries);
+void uring_delete(struct uring *ring);
+
+/*
+ * Operations return the result of the corresponding system call, or -1 with
+ * errno set. errno is ETIMEDOUT if timeout (in nanoseconds, negative means no
+ * timeout) expired. With a timeout of 0, recv and send operations are tried
+ * once without waiting (EAGAIN if the socket is not ready), accept and connect
+ * fail with EAGAIN without being tried, for a plain system call to try them.
+ */
+int uring_recv(struct uring *ring, int fd, void *buf, size_t len, int flags, int64_t timeout);
+int uring_send(struct uring *ring, int fd, const void *buf, size_t len, int flags, int64_t timeout);
+int uring_sendmsg(struct uring *ring, int fd, const struct msghdr *msg, int flags, int64_t timeout);
+int uring_accept(struct uring *ring, int fd, struct sockaddr *addr, socklen_t *addrlen, int flags, int64_t timeout);
+int uring_connect(struct uring *ring, int fd, const struct sockaddr *addr, socklen_t addrlen, int64_t timeout);
+
+#endif